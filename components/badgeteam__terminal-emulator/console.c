@@ -27,27 +27,23 @@
  *****************************************************************************/
 
 #include "console.h"
+#include "console_internal.h"
 #include "freertos/portable.h"
 #include "pax_fonts.h"
 #include "pax_gfx.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdint.h>
 
 /******************************************************************************
  * Preprocessors
  *****************************************************************************/
 
-#define CONS_ESC_TERM_RANGE_START 0x40
-#define CONS_ESC_TERM_RANGE_END   0x7E
-
-#define CONS_ESC_PARAM_RANGE_START  0x30
-#define CONS_ESC_PARAM_RANGE_END    0x3F
-
 /* Normal colors */
 
 #define CONS_ESC_SGR_FG_START       30
-#define CONS_ESC_SGR_FG_END         38
+#define CONS_ESC_SGR_FG_END         37
 
 #define CONS_ESC_SGR_BG_START       40
 #define CONS_ESC_SGR_BG_END         47
@@ -60,6 +56,13 @@
 #define CONS_ESC_SGR_BG_B_START       100
 #define CONS_ESC_SGR_BG_B_END         107
 
+/* The 256 color palette is the 16 colors followed by a 6x6x6 color cube
+ * and a gray ramp
+ */
+
+#define CONS_PALETTE_CUBE             16
+#define CONS_PALETTE_GRAY             232
+
 /* Special chars */
 
 #define CONS_SPEC_CHARS_END           31
@@ -95,10 +98,22 @@ const enum console_fg_color_vga_e g_console_vga_palette[] =
   CONS_COL_VGA_B_ERR
 };
 
+/* All palette colors, filled in by console_palette_init */
+
+static pax_col_t g_console_palette[CONSOLE_PALETTE_SIZE];
+
 /******************************************************************************
  * Prototypes
  *****************************************************************************/
 
+void console_clear_span(struct cons_insts_s *inst, size_t y,
+                        size_t x1, size_t x2);
+void console_scroll_region(struct cons_insts_s *inst, size_t top,
+                           size_t bottom, int lines);
+void console_render_scroll(struct cons_insts_s *inst);
+void console_shift_row(struct cons_insts_s *inst, int n);
+void console_reverse_index(struct cons_insts_s *inst);
+
 /******************************************************************************
  * Private Functions
  *****************************************************************************/
@@ -115,826 +130,1721 @@ void console_output(struct cons_insts_s *inst, char *str, size_t len)
 
 /* ANSII escape code parsing *************************************************/
 
-/* The entire parsing happens in single characters. cons_insts_s holds the state.
- * [put] char> [esc_put] char> [escparse_x] params> [escparse_x_y]
+/* The bytes go through the state machine in console_parser.c, which
+ * collects the parameters and calls one of the dispatchers below when a
+ * sequence is complete.
+ * [put] char> [parser_advance] sequence> [escparse_x] params> [escparse_x_y]
  *
  * The following comments assumes the user already knows about ANSII escape codes.
  *
  * Typically, the "escparse_x_y" is called based on what character terminates
  * the escape sequence. For example the H at the end of a CSI sequence would call
  * "escparse_csi_cup", where y in escparse_x_y is cup.
- * Anything that is not a valid terminator is stored as parameters for parsing in
- * "escparse_x_y".
  *
- * CSI means Control Sequence Introducer.
- * This is the x in "escparse_x" and "escparse_x_y".
- * The CSI is decided by the character after the escape character \e. (ex: "\e[...")
- * Characters that come after are routed to "escparse_x".
+ * CSI means Control Sequence Introducer, "\e[". OSC is the Operating System
+ * Command, "\e]". ESC sequences have no introducer, only a final character.
  */
 
-/* Reset is used to end a sequence */
+/* Returns parameter n, or def when it is missing or 0.
+ * For most sequences a 0 means the default.
+ */
 
-void console_esc_reset(struct cons_insts_s *inst)
+static size_t console_esc_param(struct cons_insts_s *inst, size_t n,
+                                size_t def)
 {
-  inst->_esc_code_parsing.control_code = 0;
-  inst->_esc_code_parsing.esc_mode = false;
-  inst->_esc_code_parsing.seq_buf_pos = 0;
-  memset(inst->_esc_code_parsing.seq_buf, 0,
-         sizeof(inst->_esc_code_parsing.seq_buf));
-}
-
-/* All the SGR Select Graphic Rendition parameters and commands */
+  if (n >= inst->parser.param_count || inst->parser.params[n] == 0)
+  {
+    return def;
+  }
 
-void console_escparse_csi_sgr(struct cons_insts_s *inst)
-{
-  /* Extract parameters */
+  return inst->parser.params[n];
+}
 
-  int code   = 0;
-  int param1 = 0;
-  int param2 = 0;
-  int param3 = 0;
-  int param4 = 0;
+/* Colors ********************************************************************/
 
-  int params = sscanf(inst->_esc_code_parsing.seq_buf, "%d;%d;%d;%d;%d",
-                      &code, &param1, &param2, &param3, &param4);
+/* Picks how cells store colors for the pax buffer */
 
-  /* We need atleast a code */
+static enum cons_col_format_e console_col_format(const pax_buf_t *buf)
+{
+  if (buf->palette != NULL && buf->palette_size > 0 &&
+      buf->palette_size <= (1 << CONSOLE_COL_BITS))
+  {
+    return CONS_COL_FORMAT_PALETTE;
+  }
 
-  if (params == 0)
+#if CONSOLE_COL_BITS == 8
+  return CONS_COL_FORMAT_RGB332;
+#else
+  if (buf->type == PAX_BUF_16_565RGB && buf->reverse_endianness)
   {
-    console_esc_reset(inst);
-    return;
+    return CONS_COL_FORMAT_RGB565_SWAP;
   }
 
-  /* Get SGR code */
+  return CONS_COL_FORMAT_RGB565;
+#endif
+}
 
-  switch (code)
-  {
-    case CONS_CSI_SGR_RESET:
-    {
-      inst->fg = CONSOLE_DEFAULT_FG;
-      inst->bg = CONSOLE_DEFAULT_BG;
-      break;
-    }
+/* ARGB to the cell format */
 
-    case CONS_CSI_SGR_SET_FG:
+cons_col_t console_col_native(struct cons_insts_s *inst, pax_col_t col)
+{
+  switch (inst->col_format)
+  {
+    case CONS_COL_FORMAT_RGB565:
+    case CONS_COL_FORMAT_RGB565_SWAP:
     {
-      /* RGB params */
+      uint16_t native = ((col >> 8) & 0xF800) |
+                        ((col >> 5) & 0x07E0) |
+                        ((col >> 3) & 0x001F);
 
-      if (param1 == 2)
+      if (inst->col_format == CONS_COL_FORMAT_RGB565_SWAP)
       {
-        uint32_t r = (uint32_t)param4 << 16;
-        uint32_t g = (uint32_t)param3 << 8;
-        uint32_t b = (uint32_t)param2;
-
-        uint32_t rgb = r | g | b;
-        uint32_t rgba = rgb | CONSOLE_DEFAULT_ALPHA;
-
-        inst->fg = rgba;
+        native = (native >> 8) | (native << 8);
       }
 
-      break;
+      return native;
     }
 
-    case CONS_CSI_SGR_SET_BG:
+    case CONS_COL_FORMAT_RGB332:
     {
-      /* RGB params */
-
-      if (param1 == 2)
-      {
-        uint32_t r = (uint32_t)param4 << 16;
-        uint32_t g = (uint32_t)param3 << 8;
-        uint32_t b = (uint32_t)param2;
-
-        uint32_t rgb = r | g | b;
-        uint32_t rgba = rgb | CONSOLE_DEFAULT_ALPHA;
-
-        inst->bg = rgba;
-      }
-
-      break;      
+      return ((col >> 16) & 0xE0) | ((col >> 11) & 0x1C) | ((col >> 6) & 0x03);
     }
-    
-    /* Other codes. Such as ranges or unknown.
-     * NOTE: it is probably not a bad idea to turn some of these in functions.
-     * Might make this function less big.
-     */
+
+    /* The closest palette entry */
 
     default:
     {
-      /* Set FG */
-
-      if (code >= CONS_ESC_SGR_FG_START && code <= CONS_ESC_SGR_FG_END)
-      {
-        code = code - CONS_ESC_SGR_FG_START;
-        /* Colors cant exceed palette. Limit to last */
-
-        if (code >= (sizeof(g_console_vga_palette) / sizeof(g_console_vga_palette[0])) )
-        {
-          code = (sizeof(g_console_vga_palette) / sizeof(g_console_vga_palette[0])) - 1;
-        }
-
-        /* Set FG */
-
-        uint32_t fg = g_console_vga_palette[code];
-        inst->fg = fg | CONSOLE_DEFAULT_ALPHA;
-        break;
-      }
-
-      /* Set BG */
-
-      if (code >= CONS_ESC_SGR_BG_START && code <= CONS_ESC_SGR_BG_END)
-      {
-        code = code - CONS_ESC_SGR_BG_START;
-
-        /* Colors cant exceed palette. Limit to last */
-
-        if (code >= (sizeof(g_console_vga_palette) / sizeof(g_console_vga_palette[0])) )
-        {
-          code = (sizeof(g_console_vga_palette) / sizeof(g_console_vga_palette[0])) - 1;
-        }
-
-        /* Set BG */
-
-        uint32_t bg = g_console_vga_palette[code];
-        inst->bg = bg | CONSOLE_DEFAULT_ALPHA;
-        break;
-      }
-
-      /* Set Bright FG */
-
-      if (code >= CONS_ESC_SGR_FG_B_START && code <= CONS_ESC_SGR_FG_B_END)
-      {
-        code = code - CONS_ESC_SGR_FG_B_START;
-        code += 8;
-
-        /* Colors cant exceed palette. Limit to last */
-
-        if (code >= (sizeof(g_console_vga_palette) / sizeof(g_console_vga_palette[0])) )
-        {
-          code = (sizeof(g_console_vga_palette) / sizeof(g_console_vga_palette[0])) - 1;
-        }
-
-        /* Set FG */
-
-        uint32_t fg = g_console_vga_palette[code];
-        inst->fg = fg | CONSOLE_DEFAULT_ALPHA;
-        break;
-      }
-
-      /* Set Bright BG */
+      const pax_buf_t *buf = inst->paxbuf;
+      uint32_t best_dist = UINT32_MAX;
+      cons_col_t best = 0;
 
-      if (code >= CONS_ESC_SGR_BG_B_START && code <= CONS_ESC_SGR_BG_B_END)
+      for (size_t i = 0; i < buf->palette_size; i++)
       {
-        code = code - CONS_ESC_SGR_BG_B_START;
-        code += 8;
+        int dr = (int)((col >> 16) & 0xFF) - (int)((buf->palette[i] >> 16) & 0xFF);
+        int dg = (int)((col >> 8) & 0xFF) - (int)((buf->palette[i] >> 8) & 0xFF);
+        int db = (int)(col & 0xFF) - (int)(buf->palette[i] & 0xFF);
+        uint32_t dist = dr * dr + dg * dg + db * db;
 
-        /* Colors cant exceed palette. Limit to last */
-
-        if (code >= (sizeof(g_console_vga_palette) / sizeof(g_console_vga_palette[0])) )
+        if (dist < best_dist)
         {
-          code = (sizeof(g_console_vga_palette) / sizeof(g_console_vga_palette[0])) - 1;
+          best_dist = dist;
+          best = i;
         }
-
-        /* Set BG */
-
-        uint32_t bg = g_console_vga_palette[code];
-        inst->bg = bg | CONSOLE_DEFAULT_ALPHA;
-        break;
       }
 
-      /* Unknown */
-
-      break;
+      return best;
     }
   }
-
-  /* End sequence */
-
-  console_esc_reset(inst);
 }
 
-/* Cursor Position command parsing */
-
-void console_escparse_csi_cup(struct cons_insts_s *inst)
-{
-  int row;
-  int col;
-
-  /* Extract parameters n;m or only n */
-
-  int params = sscanf(inst->_esc_code_parsing.seq_buf,
-                      "%d;%d", &col, &row);
-
-  /* Change cursor position */
-
-  if (params == 2)
-  {
-    console_set_cursor(inst, row-1, col-1);
-  }
-
-  /* End sequence */
+/* Cell format back to ARGB, for drawing with pax */
 
-  console_esc_reset(inst);
-
-  return;
-}
-
-void console_escparse_csi_cha(struct cons_insts_s *inst)
+pax_col_t console_col_argb(struct cons_insts_s *inst, cons_col_t col)
 {
-  int col;
-
-  /* Extract parameters n;m or only n */
-
-  int params = sscanf(inst->_esc_code_parsing.seq_buf, "%d", &col);
-
-  /* Change cursor position */
-
-  if (params == 1)
+  switch (inst->col_format)
   {
-    console_set_cursor(inst, inst->cursor_x, col-1);
-  }else{
-    console_set_cursor(inst, inst->cursor_x, 0);
-  }
-
-  /* End sequence */
-
-  console_esc_reset(inst);
-
-  return;
-}
-
-/* Erase in Display */
-
-void console_escparse_csi_ed(struct cons_insts_s *inst)
-{
-  int param;
-
-  /* Extract parameters */
-
-  int params = sscanf(inst->_esc_code_parsing.seq_buf, "%d", &param);
+    case CONS_COL_FORMAT_RGB565:
+    case CONS_COL_FORMAT_RGB565_SWAP:
+    {
+      uint16_t native = col;
 
-  /* Change cursor position */
+      if (inst->col_format == CONS_COL_FORMAT_RGB565_SWAP)
+      {
+        native = (native >> 8) | (native << 8);
+      }
 
-  if (params == 1)
-  {
-    if (param == 0)
-    {
-      /* Clear from cursor to end of screen */
+      uint32_t r = (native >> 11) & 0x1F;
+      uint32_t g = (native >> 5) & 0x3F;
+      uint32_t b = native & 0x1F;
 
-      console_clear_at(inst, inst->cursor_x, inst->cursor_y,
-                       inst->chars_x, inst->chars_y);      
+      return CONSOLE_DEFAULT_ALPHA |
+             (((r << 3) | (r >> 2)) << 16) |
+             (((g << 2) | (g >> 4)) << 8) |
+             ((b << 3) | (b >> 2));
     }
-    else if (param == 1)
-    {
-      /* Clear from cursor to beginning of screen */
 
-      console_clear_at(inst, inst->chars_x, inst->chars_y,
-                       inst->cursor_x, inst->cursor_y );            
-    }
-    else if (param == 2)
+    case CONS_COL_FORMAT_RGB332:
     {
-      /* Clear entire screen and moves cursor to upper left */
+      uint32_t r = ((col >> 5) & 0x07) * 255 / 7;
+      uint32_t g = ((col >> 2) & 0x07) * 255 / 7;
+      uint32_t b = (col & 0x03) * 85;
 
-      console_clear(inst);
-      console_set_cursor(inst, 0, 0);
+      return CONSOLE_DEFAULT_ALPHA | (r << 16) | (g << 8) | b;
     }
-    else if (param == 3)
+
+    default:
     {
-      /* clear entire screen and delete all lines saved in the scrollback buffer
-       * (this feature was added for xterm and is supported by other terminal applications).
-       */
+      const pax_buf_t *buf = inst->paxbuf;
 
-      /* No support yet for scrollback */
+      return col < buf->palette_size ? buf->palette[col] : CONSOLE_DEFAULT_BG;
     }
   }
-  else /* Param is missing */
-  {
-    /* Clear from cursor to end of screen */
-
-    console_clear_at(inst, inst->cursor_x, inst->cursor_y,
-                     inst->chars_x, inst->chars_y);
-  }
-
-  /* End sequence */
-
-  console_esc_reset(inst);
-
-  return;
 }
 
-/* Erase in Line */
+/* Computes the 256 color palette, in ARGB once and in the cell format
+ * for each console. SGR only has to look colors up.
+ */
 
-void console_escparse_csi_el(struct cons_insts_s *inst)
+static void console_palette_init(struct cons_insts_s *inst)
 {
-  int param;
-
-  /* Extract parameters */
-
-  int params = sscanf(inst->_esc_code_parsing.seq_buf, "%d", &param);
-
-  /* Change cursor position */
+  static const uint8_t levels[6] =
+  {
+    0x00, 0x5F, 0x87, 0xAF, 0xD7, 0xFF
+  };
 
-  if (params == 1)
+  if (g_console_palette[CONSOLE_PALETTE_SIZE - 1] == 0)
   {
-    if (param == 0)
+    for (size_t i = 0; i < CONS_PALETTE_CUBE; i++)
     {
-      /* Clear from cursor to end of line */
-
-      console_clear_at(inst, inst->cursor_x, inst->cursor_y,
-                       inst->chars_x, inst->cursor_y);  
+      g_console_palette[i] = g_console_vga_palette[i] | CONSOLE_DEFAULT_ALPHA;
     }
-    else if (param == 1)
-    {
-      /* Clear from cursor to beginning of line */
 
-      console_clear_at(inst, 0, inst->cursor_y,
-                       inst->cursor_x, inst->cursor_y );            
-    }
-    else if (param == 2)
+    for (size_t i = CONS_PALETTE_CUBE; i < CONS_PALETTE_GRAY; i++)
     {
-      /* Clear entire line */
+      size_t n = i - CONS_PALETTE_CUBE;
+      g_console_palette[i] = CONSOLE_DEFAULT_ALPHA |
+                             ((uint32_t)levels[n / 36] << 16) |
+                             ((uint32_t)levels[(n / 6) % 6] << 8) |
+                             levels[n % 6];
+    }
 
-      console_clear_at(inst, 0, inst->cursor_y,
-                       inst->chars_x, inst->cursor_y);
+    for (size_t i = CONS_PALETTE_GRAY; i < CONSOLE_PALETTE_SIZE; i++)
+    {
+      uint32_t level = 8 + (i - CONS_PALETTE_GRAY) * 10;
+      g_console_palette[i] = CONSOLE_DEFAULT_ALPHA |
+                             (level << 16) | (level << 8) | level;
     }
   }
-  else /* Param is missing */
-  {
-    /* Clear from cursor to end of line */
 
-    console_clear_at(inst, inst->cursor_x, inst->cursor_y,
-                     inst->chars_x, inst->cursor_y);
+  for (size_t i = 0; i < CONSOLE_PALETTE_SIZE; i++)
+  {
+    inst->palette[i] = console_col_native(inst, g_console_palette[i]);
   }
-
-  /* End sequence */
-
-  console_esc_reset(inst);
-
-  return;
-}
-
-/* Device Status Return */
-
-void console_escparse_csi_dsr(struct cons_insts_s *inst)
-{
-  /* Return cursor position */
-
-  char str[32];
-  snprintf(str, sizeof(str), "\e[%d;%dR", inst->cursor_y, inst->cursor_x);
-  console_output(inst, str, strlen(str));
-
-  /* End of sequence */
-
-  console_esc_reset(inst);
-
-  return;
 }
 
-/* Basic cursor movements */
+/* Works out the colors that go into the cells from the SGR state. Bold
+ * makes the first 8 palette colors bright, dim halves the foreground.
+ */
 
-void console_escparse_csi_cuu(struct cons_insts_s *inst)
+static void console_sgr_apply(struct cons_insts_s *inst)
 {
-  int param;
-  int x;
-  int y;
+  const struct cons_sgr_s *sgr = &inst->sgr;
+  int fg_index = sgr->fg_index;
+  cons_col_t fg;
+  cons_col_t bg;
 
-  /* Extract parameters */
-
-  int params = sscanf(inst->_esc_code_parsing.seq_buf, "%d", &param);
-  param = param - 1;
-  if (params > 0)
+  if ((sgr->attr & CONS_ATTR_BOLD) && fg_index >= 0 && fg_index < 8)
   {
-    console_get_cursor(inst, &x, &y);
-    console_set_cursor(inst, x, y - param);
+    fg_index += 8;
   }
-  else
+
+  if (sgr->attr & CONS_ATTR_DIM)
   {
-    console_get_cursor(inst, &x, &y);
-    console_set_cursor(inst, x, y - 1);   
+    pax_col_t col = fg_index >= 0 ? g_console_palette[fg_index] : sgr->fg;
+    fg = console_col_native(inst, (col & 0xFF000000) |
+                                  ((col >> 1) & 0x007F7F7F));
   }
-
-  /* End of sequence */
-
-  console_esc_reset(inst);
-
-  return;   
-}
-
-void console_escparse_csi_cud(struct cons_insts_s *inst)
-{
-  int param;
-  int x;
-  int y;
-
-  /* Extract parameters */
-
-  int params = sscanf(inst->_esc_code_parsing.seq_buf, "%d", &param);
-  param = param - 1;
-  if (params > 0)
+  else if (fg_index >= 0)
   {
-    console_get_cursor(inst, &x, &y);
-    console_set_cursor(inst, x , y + param);
+    fg = inst->palette[fg_index];
   }
   else
   {
-    console_get_cursor(inst, &x, &y);
-    console_set_cursor(inst, x, y + 1);   
+    fg = console_col_native(inst, sgr->fg);
   }
 
-  /* End of sequence */
-
-  console_esc_reset(inst);
-
-  return;   
-}
-
-void console_escparse_csi_cuf(struct cons_insts_s *inst)
-{
-  int param;
-  int x;
-  int y;
-
-  /* Extract parameters */
-
-  int params = sscanf(inst->_esc_code_parsing.seq_buf, "%d", &param);
-  param = param - 1;
-  if (params > 0)
+  if (sgr->bg_index >= 0)
   {
-    console_get_cursor(inst, &x, &y);
-    console_set_cursor(inst, x + param, y);
+    bg = inst->palette[sgr->bg_index];
   }
   else
   {
-    console_get_cursor(inst, &x, &y);
-    console_set_cursor(inst, x + 1, y);   
+    bg = console_col_native(inst, sgr->bg);
   }
 
-  /* End of sequence */
-
-  console_esc_reset(inst);
-
-  return;   
-}
-
-void console_escparse_csi_cub(struct cons_insts_s *inst)
-{
-  int param;
-  int x;
-  int y;
-
-  /* Extract parameters */
+  inst->attr = sgr->attr & CONS_ATTR_CELL;
 
-  int params = sscanf(inst->_esc_code_parsing.seq_buf, "%d", &param);
-  param = param - 1;
-  if (params > 0)
+  if (sgr->attr & CONS_ATTR_REVERSE)
   {
-    console_get_cursor(inst, &x, &y);
-    console_set_cursor(inst, x - param, y);
+    inst->fg = bg;
+    inst->bg = fg;
+    inst->attr &= ~CONS_ATTR_DEFAULT_BG;
   }
   else
   {
-    console_get_cursor(inst, &x, &y);
-    console_set_cursor(inst, x - 1, y);   
+    inst->fg = fg;
+    inst->bg = bg;
   }
-
-  /* End of sequence */
-
-  console_esc_reset(inst);
-
-  return;   
 }
 
-/* Cursor Next Line */
-
-void console_escparse_csi_cnl(struct cons_insts_s *inst)
+static void console_sgr_reset(struct cons_insts_s *inst)
 {
-  int param;
-  int x;
-  int y;
-
-  /* Extract parameters */
-
-  int params = sscanf(inst->_esc_code_parsing.seq_buf, "%d", &param);
-  param = param - 1;
-  if (params > 0)
-  {
-    console_get_cursor(inst, &x, &y);
-    console_set_cursor(inst, 0, y + param);
-  }
-  else
-  {
-    console_get_cursor(inst, &x, &y);
-    console_set_cursor(inst, 0, y + 1);   
-  }
-
-  /* End of sequence */
-
-  console_esc_reset(inst);
-
-  return;   
+  inst->sgr.fg = CONSOLE_DEFAULT_FG;
+  inst->sgr.bg = CONSOLE_DEFAULT_BG;
+  inst->sgr.fg_index = -1;
+  inst->sgr.bg_index = -1;
+  inst->sgr.attr = CONS_ATTR_DEFAULT_BG;
 }
 
-/* Cursor Previous Line */
+/* Sets one SGR Select Graphic Rendition color from the palette */
 
-void console_escparse_csi_cpl(struct cons_insts_s *inst)
+static void console_escparse_csi_sgr_palette(struct cons_insts_s *inst,
+                                             int index, bool bg)
 {
-  int param;
-  int x;
-  int y;
-
-  /* Extract parameters */
+  if (index >= CONSOLE_PALETTE_SIZE)
+  {
+    return;
+  }
 
-  int params = sscanf(inst->_esc_code_parsing.seq_buf, "%d", &param);
-  param = param - 1;
-  if (params > 0)
+  if (bg)
   {
-    console_get_cursor(inst, &x, &y);
-    console_set_cursor(inst, 0, y - param);
+    inst->sgr.bg = g_console_palette[index];
+    inst->sgr.bg_index = index;
+    inst->sgr.attr &= ~CONS_ATTR_DEFAULT_BG;
   }
   else
   {
-    console_get_cursor(inst, &x, &y);
-    console_set_cursor(inst, 0, y - 1);   
+    inst->sgr.fg = g_console_palette[index];
+    inst->sgr.fg_index = index;
   }
-
-  /* End of sequence */
-
-  console_esc_reset(inst);
-
-  return;    
 }
 
-/* Paste Bracket mode enable */
+/* Extended color of SGR 38 and 48 at params[i], 5;n or 2;r;g;b. Returns
+ * how many parameters after the 38 or 48 it used.
+ */
 
-void console_escparse_csi_pbe(struct cons_insts_s *inst)
+static size_t console_escparse_csi_sgr_color(struct cons_insts_s *inst,
+                                             size_t i, bool bg)
 {
-  int param;
+  const uint16_t *params = inst->parser.params;
+  size_t count = inst->parser.param_count;
 
-  int params = sscanf(inst->_esc_code_parsing.seq_buf, "%d", &param);
-  param = param - 1;
-  fprintf(stderr, "console_escparse_csi_pbe() - %d params\n", params);
-
-  /* End of sequence */
-
-  console_esc_reset(inst);
+  if (i + 1 >= count)
+  {
+    return 0;
+  }
 
-  return;   
-}
+  switch (params[i + 1])
+  {
+    case CONS_CSI_SGR_COLOR_INDEXED:
+    {
+      if (i + 2 >= count)
+      {
+        return 1;
+      }
 
-/* Paste Bracket mode disable */
+      console_escparse_csi_sgr_palette(inst, params[i + 2], bg);
+      return 2;
+    }
 
-void console_escparse_csi_pbd(struct cons_insts_s *inst)
-{
-  int param;
+    case CONS_CSI_SGR_COLOR_RGB:
+    {
+      if (i + 4 >= count)
+      {
+        return count - i - 1;
+      }
 
-  int params = sscanf(inst->_esc_code_parsing.seq_buf, "%d", &param);
-  param = param - 1;
-  fprintf(stderr, "console_escparse_csi_pbd() - %d params\n", params);
+      uint32_t r = (uint32_t)(params[i + 2] & 0xFF) << 16;
+      uint32_t g = (uint32_t)(params[i + 3] & 0xFF) << 8;
+      uint32_t b = (uint32_t)(params[i + 4] & 0xFF);
+      uint32_t rgba = r | g | b | CONSOLE_DEFAULT_ALPHA;
 
-  /* End of sequence */
+      if (bg)
+      {
+        inst->sgr.bg = rgba;
+        inst->sgr.bg_index = -1;
+        inst->sgr.attr &= ~CONS_ATTR_DEFAULT_BG;
+      }
+      else
+      {
+        inst->sgr.fg = rgba;
+        inst->sgr.fg_index = -1;
+      }
 
-  console_esc_reset(inst);
+      return 4;
+    }
 
-  return;   
+    default:
+    {
+      return 1;
+    }
+  }
 }
 
-/* Parse CSI */
+/* All the SGR Select Graphic Rendition parameters and commands. Every
+ * parameter is applied in order, "\e[m" is the same as "\e[0m".
+ */
 
-void console_escparse_csi(struct cons_insts_s *inst, char c)
+void console_escparse_csi_sgr(struct cons_insts_s *inst)
 {
-  size_t index = inst->_esc_code_parsing.seq_buf_pos;
-  ESP_LOGI(CONS_TAG, "console_escparse_csi");
-  ESP_LOGI(CONS_TAG, "  index: %d", (int)index);
+  const uint16_t *params = inst->parser.params;
+  size_t count = inst->parser.param_count;
 
-  // XXX right here - skip if pattern matches CSI ? \d+ l or h.
-  //if (inst->_esc_code_parsing.seq_buf[index] == '?') {
-  //  ESP_LOGI(CONS_TAG, "  found private sequence, skipping");
-  //  // XXX some private escape sequences are a different number of characters
-  //  inst->_esc_code_parsing.seq_buf_pos += 6;
-  //  return;
-  //}
-
-  /* Check for CSI terminators */
+  if (count == 0)
+  {
+    count = 1;
+  }
 
-  if (c >= CONS_ESC_TERM_RANGE_START && c <= CONS_ESC_TERM_RANGE_END)
+  for (size_t i = 0; i < count; i++)
   {
-    switch (c)
+    int code = params[i];
+
+    switch (code)
     {
-      case CONS_CSI_CUP_TERM:
+      case CONS_CSI_SGR_RESET:
       {
-        console_escparse_csi_cup(inst);
-        return;
-       }
+        console_sgr_reset(inst);
+        break;
+      }
 
-      case CONS_CSI_ED_TERM:
+      case CONS_CSI_SGR_BOLD:
       {
-        console_escparse_csi_ed(inst);
-        return;
+        inst->sgr.attr |= CONS_ATTR_BOLD;
+        break;
       }
 
-      case CONS_CSI_EL_TERM:
+      case CONS_CSI_SGR_DIM:
       {
-        console_escparse_csi_el(inst);
-        return;
+        inst->sgr.attr |= CONS_ATTR_DIM;
+        break;
       }
 
-      case CONS_CSI_DSR_TERM:
+      case CONS_CSI_SGR_UNDERLINE:
       {
-        console_escparse_csi_dsr(inst);
-        return;
+        inst->sgr.attr |= CONS_ATTR_UNDERLINE;
+        break;
       }
 
-      case CONS_CSI_HVP_TERM:
+      case CONS_CSI_SGR_REVERSE:
       {
-        console_escparse_csi_cup(inst);
-        return;
+        inst->sgr.attr |= CONS_ATTR_REVERSE;
+        break;
       }
 
-      case CONS_CSI_CHA_TERM:
+      case CONS_CSI_SGR_NORMAL:
       {
-        console_escparse_csi_cha(inst);
-        return;
+        inst->sgr.attr &= ~(CONS_ATTR_BOLD | CONS_ATTR_DIM);
+        break;
       }
 
-      case CONS_CSI_CUU_TERM:
+      case CONS_CSI_SGR_NO_UNDERLINE:
       {
-        console_escparse_csi_cuu(inst);
-        return;
+        inst->sgr.attr &= ~CONS_ATTR_UNDERLINE;
+        break;
       }
 
-      case CONS_CSI_CUD_TERM:
+      case CONS_CSI_SGR_NO_REVERSE:
       {
-        console_escparse_csi_cud(inst);
-        return;
+        inst->sgr.attr &= ~CONS_ATTR_REVERSE;
+        break;
       }
 
-      case CONS_CSI_CUF_TERM:
+      case CONS_CSI_SGR_SET_FG:
+      case CONS_CSI_SGR_SET_BG:
       {
-        console_escparse_csi_cuf(inst);
-        return;
+        i += console_escparse_csi_sgr_color(inst, i,
+                                            code == CONS_CSI_SGR_SET_BG);
+        break;
       }
 
-      case CONS_CSI_CUB_TERM:
+      case CONS_CSI_SGR_DEFAULT_FG:
       {
-        console_escparse_csi_cub(inst);
-        return;
+        inst->sgr.fg = CONSOLE_DEFAULT_FG;
+        inst->sgr.fg_index = -1;
+        break;
       }
 
-      case CONS_CSI_CNL_TERM:
+      case CONS_CSI_SGR_DEFAULT_BG:
       {
-        console_escparse_csi_cnl(inst);
-        return;
+        inst->sgr.bg = CONSOLE_DEFAULT_BG;
+        inst->sgr.bg_index = -1;
+        inst->sgr.attr |= CONS_ATTR_DEFAULT_BG;
+        break;
       }
 
-      case CONS_CSI_CPL_TERM:
+      /* Other codes. Such as ranges or unknown. */
+
+      default:
       {
-        console_escparse_csi_cpl(inst);
-        return;
+        if (code >= CONS_ESC_SGR_FG_START && code <= CONS_ESC_SGR_FG_END)
+        {
+          console_escparse_csi_sgr_palette(inst,
+                                           code - CONS_ESC_SGR_FG_START,
+                                           false);
+        }
+        else if (code >= CONS_ESC_SGR_BG_START && code <= CONS_ESC_SGR_BG_END)
+        {
+          console_escparse_csi_sgr_palette(inst,
+                                           code - CONS_ESC_SGR_BG_START,
+                                           true);
+        }
+        else if (code >= CONS_ESC_SGR_FG_B_START &&
+                 code <= CONS_ESC_SGR_FG_B_END)
+        {
+          console_escparse_csi_sgr_palette(inst,
+                                           code - CONS_ESC_SGR_FG_B_START + 8,
+                                           false);
+        }
+        else if (code >= CONS_ESC_SGR_BG_B_START &&
+                 code <= CONS_ESC_SGR_BG_B_END)
+        {
+          console_escparse_csi_sgr_palette(inst,
+                                           code - CONS_ESC_SGR_BG_B_START + 8,
+                                           true);
+        }
+
+        /* Unknown */
+
+        break;
       }
+    }
+  }
+
+  console_sgr_apply(inst);
+}
+
+/* Cursor Position, row;col, both start at 1 */
+
+void console_escparse_csi_cup(struct cons_insts_s *inst)
+{
+  size_t row = console_esc_param(inst, 0, 1);
+  size_t col = console_esc_param(inst, 1, 1);
+
+  console_set_cursor(inst, col - 1, row - 1);
+}
+
+/* Cursor Horizontal Absolute */
+
+void console_escparse_csi_cha(struct cons_insts_s *inst)
+{
+  size_t col = console_esc_param(inst, 0, 1);
+
+  console_set_cursor(inst, col - 1, inst->cursor_y);
+}
+
+/* Erase in Display */
+
+void console_escparse_csi_ed(struct cons_insts_s *inst)
+{
+  switch (console_esc_param(inst, 0, 0))
+  {
+    case 0:
+    {
+      /* Clear from cursor to end of screen */
 
-      case CONS_CSI_SGR_TERM:
+      console_clear_span(inst, inst->cursor_y, inst->cursor_x, inst->chars_x);
+      if (inst->cursor_y + 1 < inst->chars_y)
       {
-        console_escparse_csi_sgr(inst);
-        return;
+        console_clear_at(inst, 0, inst->cursor_y + 1,
+                         inst->chars_x - 1, inst->chars_y - 1);
       }
+      break;
+    }
+
+    case 1:
+    {
+      /* Clear from cursor to beginning of screen */
 
-      case CONS_CSI_PBE_TERM:
+      if (inst->cursor_y > 0)
       {
-        console_escparse_csi_pbe(inst);
-        return;
+        console_clear_at(inst, 0, 0, inst->chars_x - 1, inst->cursor_y - 1);
       }
+      console_clear_span(inst, inst->cursor_y, 0, inst->cursor_x + 1);
+      break;
+    }
+
+    case 2:
+    {
+      /* Clear entire screen and moves cursor to upper left */
+
+      console_clear(inst);
+      console_set_cursor(inst, 0, 0);
 
-      case CONS_CSI_PBD_TERM:
+      if (inst->clear_cb != NULL)
       {
-        console_escparse_csi_pbd(inst);
-        return;
+        inst->clear_cb();
       }
+      break;
+    }
 
-      /* This is not a known or illegal terminator */
-  
-      default:
-      {
-        ESP_LOGE(CONS_TAG, "Illegal escape terminator 0x%X", c);
+    case 3:
+    {
+      /* Delete all lines saved in the scrollback buffer. Like xterm,
+       * the screen itself is left alone, "clear" sends ED 2 as well.
+       */
 
-        /* End sequence */
+      console_scrollback_clear(inst);
+      break;
+    }
 
-        console_esc_reset(inst);
-        return;
-      }
+    default:
+    {
+      break;
     }
   }
+}
 
-  /* Check whether this is a legal parameter byte */
+/* Erase in Line */
 
-  if (c < CONS_ESC_PARAM_RANGE_START || c > CONS_ESC_PARAM_RANGE_END)
+void console_escparse_csi_el(struct cons_insts_s *inst)
+{
+  switch (console_esc_param(inst, 0, 0))
   {
-    /* Illegal parameter byte */
+    case 0:
+    {
+      /* Clear from cursor to end of line */
 
-    /* End sequence */
+      console_clear_span(inst, inst->cursor_y, inst->cursor_x, inst->chars_x);
+      break;
+    }
 
-    console_esc_reset(inst);
-    ESP_LOGE(CONS_TAG, "Illegal escape parameter 0x%X", c);
+    case 1:
+    {
+      /* Clear from cursor to beginning of line */
 
-    return;
+      console_clear_span(inst, inst->cursor_y, 0, inst->cursor_x + 1);
+      break;
+    }
+
+    case 2:
+    {
+      /* Clear entire line */
+
+      console_clear_span(inst, inst->cursor_y, 0, inst->chars_x);
+      break;
+    }
+
+    default:
+    {
+      break;
+    }
   }
+}
+
+/* Device Status Report */
 
-  /* Store character as param in sequence buffer */
+void console_escparse_csi_dsr(struct cons_insts_s *inst)
+{
+  char str[32];
 
-  index = inst->_esc_code_parsing.seq_buf_pos++;
-  ESP_LOGI(CONS_TAG, "  seq_buf index %d", index);
-  if (index >= sizeof(inst->_esc_code_parsing.seq_buf))
+  switch (console_esc_param(inst, 0, 0))
   {
-    /* In case of overflow, reset parser */
+    case 5:
+    {
+      /* Status, always OK */
+
+      snprintf(str, sizeof(str), "\e[0n");
+      break;
+    }
 
-    /* End sequence */
+    case 6:
+    {
+      /* Return cursor position, starting at 1 like CUP */
 
-    console_esc_reset(inst);
-    return;
+      snprintf(str, sizeof(str), "\e[%zu;%zuR",
+               inst->cursor_y + 1, inst->cursor_x + 1);
+      break;
+    }
+
+    default:
+    {
+      return;
+    }
+  }
+
+  console_output(inst, str, strlen(str));
+}
+
+/* Cursor movements. Moves n cells in a direction, stops at the edges.
+ * CNL and CPL also go to the start of the line.
+ */
+
+void console_escparse_csi_move(struct cons_insts_s *inst, int dx, int dy,
+                               bool line_start)
+{
+  int n = console_esc_param(inst, 0, 1);
+  int x;
+  int y;
+
+  console_get_cursor(inst, &x, &y);
+  if (line_start)
+  {
+    x = 0;
   }
 
-  inst->_esc_code_parsing.seq_buf[index] = c;
-  ESP_LOGI(CONS_TAG, "  seq_buf[%d] = %c", index, c);
+  console_set_cursor(inst, x + dx * n, y + dy * n);
 }
 
-/* ASII escape code entry ****************************************************/
+/* Insert Lines and Delete Lines, move the lines from the cursor to the
+ * bottom of the scrolling region
+ */
 
-void console_esc_put(struct cons_insts_s *inst, char c)
+void console_escparse_csi_lines(struct cons_insts_s *inst, bool insert)
 {
-  /* Get control code if we dont have one and return */
+  int n = console_esc_param(inst, 0, 1);
 
-  if (inst->_esc_code_parsing.control_code == 0)
+  if (inst->cursor_y < inst->scroll_top ||
+      inst->cursor_y > inst->scroll_bottom)
   {
-    inst->_esc_code_parsing.control_code = c;
     return;
   }
 
-  /* Give params to control code */
+  console_scroll_region(inst, inst->cursor_y, inst->scroll_bottom,
+                        insert ? -n : n);
+  inst->cursor_x = 0;
+  inst->wrap_pending = false;
+}
+
+/* Insert, Delete and Erase Characters on the cursor line */
+
+void console_escparse_csi_chars(struct cons_insts_s *inst, char c)
+{
+  int n = console_esc_param(inst, 0, 1);
 
-  switch (inst->_esc_code_parsing.control_code)
+  switch (c)
   {
-    case CONS_CTRL_CSI:
+    case CONS_CSI_ICH_TERM:
     {
-      console_escparse_csi(inst, c);
-      return;
+      console_shift_row(inst, n);
+      break;
     }
 
-    /* Unknown control code */
+    case CONS_CSI_DCH_TERM:
+    {
+      console_shift_row(inst, -n);
+      break;
+    }
 
     default:
     {
-      ESP_LOGE(CONS_TAG, "Illegal escape code 0x%X", c);
-      console_esc_reset(inst);
-      return;
+      console_clear_span(inst, inst->cursor_y, inst->cursor_x,
+                         inst->cursor_x + n);
+      break;
     }
   }
 }
 
-/* Drawing ******************************************************************/
+/* Set Top and Bottom Margins, top;bottom start at 1. Moves the cursor
+ * home.
+ */
 
-void console_clear_at(struct cons_insts_s *inst, size_t x1, size_t y1,
-                      size_t x2, size_t y2)
+void console_escparse_csi_decstbm(struct cons_insts_s *inst)
+{
+  size_t top = console_esc_param(inst, 0, 1);
+  size_t bottom = console_esc_param(inst, 1, inst->chars_y);
+
+  if (bottom > inst->chars_y)
+  {
+    bottom = inst->chars_y;
+  }
+
+  if (top >= bottom)
+  {
+    return;
+  }
+
+  inst->scroll_top = top - 1;
+  inst->scroll_bottom = bottom - 1;
+  console_set_cursor(inst, 0, 0);
+}
+
+/* DECSC and DECRC, also used when switching screens */
+
+static void console_cursor_save(struct cons_insts_s *inst)
+{
+  inst->saved_x = inst->cursor_x;
+  inst->saved_y = inst->cursor_y;
+  inst->saved_sgr = inst->sgr;
+}
+
+static void console_cursor_restore(struct cons_insts_s *inst)
+{
+  console_set_cursor(inst, inst->saved_x, inst->saved_y);
+  inst->sgr = inst->saved_sgr;
+  console_sgr_apply(inst);
+}
+
+/* Switches between the normal and the alternate screen by swapping the
+ * grids. The next render draws the cells that differ, so leaving an
+ * editor puts the shell back without the host sending it again.
+ * Returns false when there is no memory for the alternate grid.
+ */
+
+static bool console_alt_screen(struct cons_insts_s *inst, bool enable)
+{
+  if (enable == inst->alt_screen)
+  {
+    return true;
+  }
+
+  /* The alternate grid is only allocated once something uses it */
+
+  if (inst->alt_alloc == NULL)
+  {
+    size_t alloc = inst->chars_x * inst->chars_y * sizeof(struct cons_char_s);
+    inst->alt_alloc = (struct cons_char_s *)pvPortMalloc(alloc);
+    if (inst->alt_alloc == NULL)
+    {
+      ESP_LOGE(CONS_TAG, "No memory for the alternate screen");
+      return false;
+    }
+
+    memcpy(inst->alt_alloc, inst->char_alloc, alloc);
+  }
+
+  struct cons_char_s *swap = inst->char_alloc;
+  inst->char_alloc = inst->alt_alloc;
+  inst->alt_alloc = swap;
+  inst->alt_screen = enable;
+  return true;
+}
+
+/* Set Mode and Reset Mode. Only DEC private modes are supported. */
+
+void console_escparse_csi_mode(struct cons_insts_s *inst, bool set)
+{
+  if (inst->parser.private_marker != '?')
+  {
+    return;
+  }
+
+  for (size_t i = 0; i < inst->parser.param_count; i++)
+  {
+    switch (inst->parser.params[i])
+    {
+      case CONS_DEC_CURSOR_BLINK:
+      {
+        inst->cursor_blink = set;
+        inst->cursor_blink_off = false;
+        break;
+      }
+
+      case CONS_DEC_CURSOR_VISIBLE:
+      {
+        inst->cursor_visible = set;
+        break;
+      }
+
+      case CONS_DEC_BRACKETED_PASTE:
+      {
+        inst->bracketed_paste = set;
+        break;
+      }
+
+      case CONS_DEC_ALT_SCREEN:
+      {
+        console_alt_screen(inst, set);
+        break;
+      }
+
+      case CONS_DEC_ALT_SCREEN_CLEAR:
+      {
+        /* Leaving clears the alternate screen first */
+
+        if (!set && inst->alt_screen)
+        {
+          console_clear(inst);
+        }
+
+        console_alt_screen(inst, set);
+        break;
+      }
+
+      case CONS_DEC_SAVE_CURSOR:
+      {
+        if (set)
+        {
+          console_cursor_save(inst);
+        }
+        else
+        {
+          console_cursor_restore(inst);
+        }
+        break;
+      }
+
+      case CONS_DEC_ALT_SCREEN_SAVE:
+      {
+        /* Save the cursor and start with a clear alternate screen,
+         * put both back when leaving
+         */
+
+        if (set && !inst->alt_screen)
+        {
+          /* Stay on the normal screen untouched without the memory */
+
+          if (console_alt_screen(inst, true))
+          {
+            console_cursor_save(inst);
+            console_clear(inst);
+          }
+        }
+        else if (!set && inst->alt_screen)
+        {
+          console_alt_screen(inst, false);
+          console_cursor_restore(inst);
+        }
+        break;
+      }
+
+      /* Unknown modes are ignored */
+
+      default:
+      {
+        break;
+      }
+    }
+  }
+}
+
+/* Set Cursor Style, CSI n SP q. 0 and odd values blink. */
+
+void console_escparse_csi_decscusr(struct cons_insts_s *inst)
 {
-  x1 = x1 * inst->char_width;
-  x2 = (x2+1) * inst->char_width; /* Add one cell width */
+  size_t n = console_esc_param(inst, 0, 0);
 
-  y1 = y1 * inst->char_height;
-  y2 = (y2+1) * inst->char_height; /* Add one cell thickness */
+  if (n > 6)
+  {
+    return;
+  }
+
+  static const enum cons_cursor_style_e styles[] =
+  {
+    CONS_CURSOR_BLOCK, CONS_CURSOR_BLOCK, CONS_CURSOR_BLOCK,
+    CONS_CURSOR_UNDERLINE, CONS_CURSOR_UNDERLINE,
+    CONS_CURSOR_BAR, CONS_CURSOR_BAR
+  };
 
-  pax_simple_rect(inst->paxbuf, inst->bg, x1, y1, x2-x1, y2-y1);
+  console_set_cursor_style(inst, styles[n], n == 0 || (n & 1));
 }
 
-void console_clear(struct cons_insts_s *inst)
+/* Dispatch CSI */
+
+void console_escparse_csi(struct cons_insts_s *inst, char c)
+{
+  if (inst->parser.intermediate_count == 1 &&
+      inst->parser.intermediates[0] == ' ' &&
+      inst->parser.private_marker == 0 && c == CONS_CSI_DECSCUSR_TERM)
+  {
+    console_escparse_csi_decscusr(inst);
+    return;
+  }
+
+  /* Other sequences with intermediates are not supported */
+
+  if (inst->parser.intermediate_count > 0)
+  {
+    return;
+  }
+
+  /* Private sequences only go to the mode handling */
+
+  if (inst->parser.private_marker != 0 &&
+      c != CONS_CSI_SM_TERM && c != CONS_CSI_RM_TERM)
+  {
+    return;
+  }
+
+  switch (c)
+  {
+    case CONS_CSI_CUP_TERM:
+    case CONS_CSI_HVP_TERM:
+    {
+      console_escparse_csi_cup(inst);
+      return;
+    }
+
+    case CONS_CSI_ED_TERM:
+    {
+      console_escparse_csi_ed(inst);
+      return;
+    }
+
+    case CONS_CSI_EL_TERM:
+    {
+      console_escparse_csi_el(inst);
+      return;
+    }
+
+    case CONS_CSI_DSR_TERM:
+    {
+      console_escparse_csi_dsr(inst);
+      return;
+    }
+
+    case CONS_CSI_CHA_TERM:
+    {
+      console_escparse_csi_cha(inst);
+      return;
+    }
+
+    case CONS_CSI_CUU_TERM:
+    {
+      console_escparse_csi_move(inst, 0, -1, false);
+      return;
+    }
+
+    case CONS_CSI_CUD_TERM:
+    {
+      console_escparse_csi_move(inst, 0, 1, false);
+      return;
+    }
+
+    case CONS_CSI_CUF_TERM:
+    {
+      console_escparse_csi_move(inst, 1, 0, false);
+      return;
+    }
+
+    case CONS_CSI_CUB_TERM:
+    {
+      console_escparse_csi_move(inst, -1, 0, false);
+      return;
+    }
+
+    case CONS_CSI_CNL_TERM:
+    {
+      console_escparse_csi_move(inst, 0, 1, true);
+      return;
+    }
+
+    case CONS_CSI_CPL_TERM:
+    {
+      console_escparse_csi_move(inst, 0, -1, true);
+      return;
+    }
+
+    case CONS_CSI_SGR_TERM:
+    {
+      console_escparse_csi_sgr(inst);
+      return;
+    }
+
+    case CONS_CSI_SM_TERM:
+    {
+      console_escparse_csi_mode(inst, true);
+      return;
+    }
+
+    case CONS_CSI_RM_TERM:
+    {
+      console_escparse_csi_mode(inst, false);
+      return;
+    }
+
+    case CONS_CSI_IL_TERM:
+    {
+      console_escparse_csi_lines(inst, true);
+      return;
+    }
+
+    case CONS_CSI_DL_TERM:
+    {
+      console_escparse_csi_lines(inst, false);
+      return;
+    }
+
+    case CONS_CSI_ICH_TERM:
+    case CONS_CSI_DCH_TERM:
+    case CONS_CSI_ECH_TERM:
+    {
+      console_escparse_csi_chars(inst, c);
+      return;
+    }
+
+    case CONS_CSI_SU_TERM:
+    {
+      console_scroll_region(inst, inst->scroll_top, inst->scroll_bottom,
+                            console_esc_param(inst, 0, 1));
+      return;
+    }
+
+    case CONS_CSI_SD_TERM:
+    {
+      console_scroll_region(inst, inst->scroll_top, inst->scroll_bottom,
+                            -(int)console_esc_param(inst, 0, 1));
+      return;
+    }
+
+    case CONS_CSI_DECSTBM_TERM:
+    {
+      console_escparse_csi_decstbm(inst);
+      return;
+    }
+
+    /* This is not a known terminator */
+
+    default:
+    {
+      ESP_LOGD(CONS_TAG, "Unsupported CSI terminator 0x%X", c);
+      return;
+    }
+  }
+}
+
+/* Dispatch ESC */
+
+void console_escparse_esc(struct cons_insts_s *inst, char c)
+{
+  /* Character set designations and such are not supported */
+
+  if (inst->parser.intermediate_count > 0)
+  {
+    return;
+  }
+
+  switch (c)
+  {
+    case CONS_ESC_DECSC:
+    {
+      console_cursor_save(inst);
+      return;
+    }
+
+    case CONS_ESC_DECRC:
+    {
+      console_cursor_restore(inst);
+      return;
+    }
+
+    case CONS_ESC_IND:
+    {
+      console_newline(inst);
+      return;
+    }
+
+    case CONS_ESC_NEL:
+    {
+      console_newline(inst);
+      inst->cursor_x = 0;
+      return;
+    }
+
+    case CONS_ESC_RI:
+    {
+      console_reverse_index(inst);
+      return;
+    }
+
+    case CONS_ESC_RIS:
+    {
+      console_sgr_reset(inst);
+      console_sgr_apply(inst);
+      inst->bracketed_paste = false;
+      inst->cursor_visible = true;
+      inst->scroll_top = 0;
+      inst->scroll_bottom = inst->chars_y - 1;
+      console_alt_screen(inst, false);
+      console_clear(inst);
+      console_set_cursor(inst, 0, 0);
+      return;
+    }
+
+    /* Also the ST ending an OSC or DCS string */
+
+    default:
+    {
+      return;
+    }
+  }
+}
+
+/* Dispatch OSC. The string is "n;text". */
+
+void console_escparse_osc(struct cons_insts_s *inst)
+{
+  const char *str = inst->parser.osc_buf;
+  int command = 0;
+
+  while (*str >= '0' && *str <= '9')
+  {
+    command = command * 10 + (*str - '0');
+    str++;
+  }
+
+  if (*str != ';')
+  {
+    return;
+  }
+  str++;
+
+  switch (command)
+  {
+    case CONS_OSC_TITLE_ICON:
+    case CONS_OSC_TITLE:
+    {
+      snprintf(inst->title, sizeof(inst->title), "%s", str);
+      return;
+    }
+
+    default:
+    {
+      return;
+    }
+  }
+}
+
+/* Character grid ***********************************************************/
+
+static inline struct cons_char_s *console_cell(struct cons_insts_s *inst,
+                                               size_t x, size_t y)
+{
+  return &inst->char_alloc[x + (y * inst->chars_x)];
+}
+
+/* Clears cells x1 up to (not including) x2 on row y */
+
+void console_clear_span(struct cons_insts_s *inst, size_t y,
+                        size_t x1, size_t x2)
+{
+  if (y >= inst->chars_y)
+  {
+    return;
+  }
+
+  if (x2 > inst->chars_x)
+  {
+    x2 = inst->chars_x;
+  }
+
+  struct cons_char_s blank =
+  {
+    .character = ' ',
+    .attr = inst->attr & CONS_ATTR_DEFAULT_BG,
+    .fg = inst->fg,
+    .bg = inst->bg
+  };
+
+  struct cons_char_s *row = console_cell(inst, 0, y);
+  for (size_t x = x1; x < x2; x++)
+  {
+    row[x] = blank;
+  }
+}
+
+void console_clear_at(struct cons_insts_s *inst, size_t x1, size_t y1,
+                      size_t x2, size_t y2)
+{
+  if (y2 >= inst->chars_y)
+  {
+    y2 = inst->chars_y - 1;
+  }
+
+  for (size_t y = y1; y <= y2; y++)
+  {
+    console_clear_span(inst, y, x1, x2 + 1); /* Include x2 */
+  }
+}
+
+void console_clear(struct cons_insts_s *inst)
+{
+  console_clear_at(inst, 0, 0, inst->chars_x-1, inst->chars_y-1);
+}
+
+/* Moves rows top to bottom (included) up by lines, down when negative,
+ * and clears the rows that come free. The pixels follow on the next
+ * render, as one block move for all lines scrolled in the same region.
+ */
+
+void console_scroll_region(struct cons_insts_s *inst, size_t top,
+                           size_t bottom, int lines)
+{
+  if (lines == 0 || top > bottom || bottom >= inst->chars_y)
+  {
+    return;
+  }
+
+  size_t height = bottom - top + 1;
+  size_t n = lines > 0 ? lines : -lines;
+
+  if (n >= height)
+  {
+    console_clear_at(inst, 0, top, inst->chars_x - 1, bottom);
+    return;
+  }
+
+  size_t keep = height - n;
+  if (lines > 0)
+  {
+    memmove(console_cell(inst, 0, top), console_cell(inst, 0, top + n),
+            keep * inst->chars_x * sizeof(struct cons_char_s));
+    console_clear_at(inst, 0, top + keep, inst->chars_x - 1, bottom);
+  }
+  else
+  {
+    memmove(console_cell(inst, 0, top + n), console_cell(inst, 0, top),
+            keep * inst->chars_x * sizeof(struct cons_char_s));
+    console_clear_at(inst, 0, top, inst->chars_x - 1, top + n - 1);
+  }
+
+  /* Moves of another region or direction don't add up, the pixels
+   * catch up with the earlier one first
+   */
+
+  struct cons_move_s *pending = &inst->pending_scroll;
+  if (pending->lines != 0 &&
+      (pending->top != top || pending->bottom != bottom ||
+       (pending->lines > 0) != (lines > 0)))
+  {
+    console_render_scroll(inst);
+  }
+
+  pending->top = top;
+  pending->bottom = bottom;
+  pending->lines += lines;
+}
+
+/* Moves the cells right of the cursor by n, right when positive, and
+ * clears the cells that come free. For ICH and DCH.
+ */
+
+void console_shift_row(struct cons_insts_s *inst, int n)
+{
+  size_t x = inst->cursor_x;
+  size_t room = inst->chars_x - x;
+  size_t count = n > 0 ? n : -n;
+  struct cons_char_s *row = console_cell(inst, 0, inst->cursor_y);
+
+  if (count >= room)
+  {
+    console_clear_span(inst, inst->cursor_y, x, inst->chars_x);
+    return;
+  }
+
+  if (n > 0)
+  {
+    memmove(&row[x + count], &row[x],
+            (room - count) * sizeof(struct cons_char_s));
+    console_clear_span(inst, inst->cursor_y, x, x + count);
+  }
+  else
+  {
+    memmove(&row[x], &row[x + count],
+            (room - count) * sizeof(struct cons_char_s));
+    console_clear_span(inst, inst->cursor_y, inst->chars_x - count,
+                       inst->chars_x);
+  }
+}
+
+/* Damage tracking **********************************************************/
+
+/* Returns how many pixels the union of a and b covers */
+
+static size_t console_rect_union(const struct cons_rect_s *a,
+                                 const struct cons_rect_s *b,
+                                 struct cons_rect_s *out)
+{
+  size_t x1 = a->x < b->x ? a->x : b->x;
+  size_t y1 = a->y < b->y ? a->y : b->y;
+  size_t x2 = (a->x + a->w) > (b->x + b->w) ? (a->x + a->w) : (b->x + b->w);
+  size_t y2 = (a->y + a->h) > (b->y + b->h) ? (a->y + a->h) : (b->y + b->h);
+
+  out->x = x1;
+  out->y = y1;
+  out->w = x2 - x1;
+  out->h = y2 - y1;
+
+  return out->w * out->h;
+}
+
+/* Records a drawn rectangle of cells. Rows drawn one after the other with
+ * overlapping columns become one rectangle. When all slots are in use the
+ * rectangle is merged into the slot that grows the least.
+ */
+
+void console_damage_cells(struct cons_insts_s *inst, size_t x1, size_t y1,
+                          size_t x2, size_t y2)
+{
+  struct cons_rect_s rect =
+  {
+    .x = x1 * inst->char_width,
+    .y = y1 * inst->char_height,
+    .w = (x2 - x1) * inst->char_width,
+    .h = (y2 - y1) * inst->char_height
+  };
+
+  struct cons_rect_s merged;
+
+  /* Already covered, for example by a scroll */
+
+  for (size_t i = 0; i < inst->damage_count; i++)
+  {
+    if (console_rect_union(&inst->damage[i], &rect, &merged) ==
+        inst->damage[i].w * inst->damage[i].h)
+    {
+      return;
+    }
+  }
+
+  if (inst->damage_count > 0)
+  {
+    struct cons_rect_s *last = &inst->damage[inst->damage_count - 1];
+
+    if (last->y + last->h == rect.y &&
+        rect.x <= last->x + last->w && last->x <= rect.x + rect.w)
+    {
+      console_rect_union(last, &rect, last);
+      return;
+    }
+  }
+
+  if (inst->damage_count < CONSOLE_DAMAGE_RECTS)
+  {
+    inst->damage[inst->damage_count++] = rect;
+    return;
+  }
+
+  size_t best = 0;
+  size_t best_growth = SIZE_MAX;
+  for (size_t i = 0; i < inst->damage_count; i++)
+  {
+    size_t area = console_rect_union(&inst->damage[i], &rect, &merged);
+    size_t growth = area - (inst->damage[i].w * inst->damage[i].h);
+    if (growth < best_growth)
+    {
+      best = i;
+      best_growth = growth;
+    }
+  }
+
+  console_rect_union(&inst->damage[best], &rect, &inst->damage[best]);
+}
+
+/* Drawing ******************************************************************/
+
+/* Two cells look the same on screen. The foreground of a blank
+ * cell without underline is invisible, so it does not matter.
+ */
+
+static inline bool console_cell_equal(const struct cons_char_s *a,
+                                      const struct cons_char_s *b)
+{
+  if (a->character != b->character || a->bg != b->bg || a->attr != b->attr)
+  {
+    return false;
+  }
+
+  return (a->character == ' ' && !(a->attr & CONS_ATTR_BLANK_FG)) ||
+         a->fg == b->fg;
+}
+
+void console_draw_char_pax(struct cons_insts_s *inst, size_t x, size_t y,
+                           const struct cons_char_s *c)
+{
+  size_t screen_x = x * inst->char_width;
+  size_t screen_y = y * inst->char_height;
+
+  /* Draw background character block, or the image behind it */
+
+  pax_col_t fg = console_col_argb(inst, c->fg);
+
+  if ((c->attr & CONS_ATTR_DEFAULT_BG) && inst->background.pixels != NULL)
+  {
+    console_background_draw(inst, x, y);
+  }
+  else
+  {
+    pax_simple_rect(inst->paxbuf, console_col_argb(inst, c->bg),
+                    screen_x, screen_y, inst->char_width, inst->char_height);
+  }
+
+  /* Control characters can't be drawn */
+
+  uint32_t character = c->character;
+  if (character < ' ' || (character >= 0x7F && character < 0xA0))
+  {
+    character = '.';
+  }
+
+  if (c->attr & CONS_ATTR_UNDERLINE)
+  {
+    pax_simple_rect(inst->paxbuf, fg, screen_x,
+                    screen_y + inst->char_height - 1, inst->char_width, 1);
+  }
+
+  /* Blanks are done with the background */
+
+  if (character == ' ')
+  {
+    return;
+  }
+
+  /* Draw character */
+
+  char single_char[5];
+  single_char[console_utf8_encode(character, single_char)] = 0x00;
+
+  pax_draw_text(inst->paxbuf, fg, inst->font,
+                inst->font_size, screen_x, screen_y,
+                single_char);
+}
+
+void console_draw_char(struct cons_insts_s *inst, size_t x, size_t y,
+                       const struct cons_char_s *c)
+{
+  struct cons_char_s cell;
+  bool cursor = (c->attr & CONS_ATTR_CURSOR) != 0;
+
+  if (cursor)
+  {
+    cell = *c;
+    cell.attr &= ~CONS_ATTR_CURSOR;
+    if (inst->cursor_style == CONS_CURSOR_BLOCK)
+    {
+      cell.fg = c->bg;
+      cell.bg = c->fg;
+
+      /* The swapped colour is the background now, not the image */
+
+      cell.attr &= ~CONS_ATTR_DEFAULT_BG;
+    }
+
+    c = &cell;
+  }
+
+  /* The atlas is a lot faster, but only works on some buffers */
+
+  if (!console_glyph_draw(inst, x, y, c))
+  {
+    console_draw_char_pax(inst, x, y, c);
+  }
+
+  if (!cursor || inst->cursor_style == CONS_CURSOR_BLOCK)
+  {
+    return;
+  }
+
+  /* Underline and bar cursors are an eighth of the cell thick */
+
+  size_t screen_x = x * inst->char_width;
+  size_t screen_y = y * inst->char_height;
+  size_t w = inst->char_width;
+  size_t h = inst->char_height;
+
+  if (inst->cursor_style == CONS_CURSOR_UNDERLINE)
+  {
+    h = h / 8 > 0 ? h / 8 : 1;
+    screen_y += inst->char_height - h;
+  }
+  else
+  {
+    w = w / 8 > 0 ? w / 8 : 1;
+  }
+
+  pax_simple_rect(inst->paxbuf, console_col_argb(inst, c->fg),
+                  screen_x, screen_y, w, h);
+}
+
+/* Applies the lines scrolled in the grid to the pax buffer. The pixels
+ * and drawn_alloc move together, so the cells that only moved don't have
+ * to be drawn again.
+ */
+
+void console_render_scroll(struct cons_insts_s *inst)
+{
+  struct cons_move_s move = inst->pending_scroll;
+  inst->pending_scroll.lines = 0;
+
+  /* Scrolled lines are still drawn at their old place while looking
+   * back, the rendering diff takes care of the view
+   */
+
+  if (move.lines == 0 || inst->redraw_all || inst->scrollback.view > 0)
+  {
+    return;
+  }
+
+  size_t height = move.bottom - move.top + 1;
+  size_t lines = move.lines > 0 ? move.lines : -move.lines;
+
+  if (lines >= height)
+  {
+    return;
+  }
+
+  /* The image behind the text doesn't move with it, the diff draws the
+   * cells that changed over it
+   */
+
+  if (inst->background.pixels != NULL)
+  {
+    return;
+  }
+
+  size_t keep = height - lines;
+  size_t src = move.lines > 0 ? move.top + lines : move.top;
+  size_t dst = move.lines > 0 ? move.top : move.top + lines;
+  bool full = move.top == 0 && move.bottom == inst->chars_y - 1;
+  int dy = ((int)dst - (int)src) * (int)inst->char_height;
+
+  /* The rows that come free keep their pixels and their drawn cells,
+   * the diff draws what goes there
+   */
+
+  bool moved = console_glyph_move(inst, 0, src * inst->char_height,
+                                  inst->chars_x * inst->char_width,
+                                  keep * inst->char_height, 0, dy);
+
+  /* Pax can only scroll the whole buffer, parts get drawn again */
+
+  if (!moved && !full)
+  {
+    return;
+  }
+
+  cons_col_t bg = console_cell(inst, 0, dy > 0 ? 0 : inst->chars_y - 1)->bg;
+  if (!moved)
+  {
+    pax_buf_scroll(inst->paxbuf, console_col_argb(inst, bg), 0, dy);
+  }
+
+  memmove(&inst->drawn_alloc[dst * inst->chars_x],
+          &inst->drawn_alloc[src * inst->chars_x],
+          keep * inst->chars_x * sizeof(struct cons_char_s));
+
+  /* Pax filled the rows that came free with the background */
+
+  if (!moved)
+  {
+    struct cons_char_s blank =
+    {
+      .character = ' ',
+      .fg = inst->fg,
+      .bg = bg
+    };
+
+    size_t fill = dy > 0 ? 0 : keep;
+    for (size_t i = fill * inst->chars_x;
+         i < (fill + lines) * inst->chars_x; i++)
+    {
+      inst->drawn_alloc[i] = blank;
+    }
+  }
+
+  console_damage_cells(inst, 0, move.top, inst->chars_x, move.bottom + 1);
+}
+
+/* Font size and grid geometry *********************************************/
+
+/* Character dimensions, and how many fit in the buffer */
+
+static void console_metrics(struct cons_insts_s *inst, float font_size_mult)
+{
+  inst->font_size_mult = font_size_mult;
+  inst->font_size =   inst->font->default_size
+                      * inst->font_size_mult;
+  inst->char_width =  inst->font->ranges->bitmap_mono.width
+                      * inst->font_size_mult;
+  inst->char_height = inst->font->ranges->bitmap_mono.height
+                      * inst->font_size_mult;
+
+  /* Calculate how many chars can fit in the buffer
+   * NOTE: Orientation is forced with direct assignment of height/width.
+   * Depending on actual orientation, we might need to swap
+   * the height and width here.
+   */
+
+  if (inst->char_width == 0 || inst->char_height == 0)
+  {
+    inst->chars_x = 0;
+    inst->chars_y = 0;
+    return;
+  }
+
+  inst->chars_x = inst->paxbuf->height / inst->char_width;
+  inst->chars_y = inst->paxbuf->width / inst->char_height;
+}
+
+/* Copies a grid into a new one of another size. Rows from skip on go
+ * to the top, columns are cut off or padded with blanks in the colors
+ * of the last cell of the row.
+ */
+
+static struct cons_char_s *console_regrid(const struct cons_char_s *old,
+                                          size_t old_x, size_t old_y,
+                                          size_t new_x, size_t new_y,
+                                          size_t skip)
+{
+  struct cons_char_s *grid = (struct cons_char_s *)
+    pvPortMalloc(new_x * new_y * sizeof(struct cons_char_s));
+
+  if (grid == NULL)
+  {
+    return NULL;
+  }
+
+  for (size_t y = 0; y < new_y; y++)
+  {
+    struct cons_char_s *row = &grid[y * new_x];
+    size_t from = y + skip;
+    size_t copy = 0;
+
+    if (from < old_y)
+    {
+      copy = old_x < new_x ? old_x : new_x;
+      memcpy(row, &old[from * old_x], copy * sizeof(struct cons_char_s));
+    }
+
+    struct cons_char_s blank = copy > 0 ? row[copy - 1] : old[0];
+    blank.character = ' ';
+    blank.attr &= CONS_ATTR_DEFAULT_BG;
+
+    for (size_t x = copy; x < new_x; x++)
+    {
+      row[x] = blank;
+    }
+  }
+
+  return grid;
+}
+
+/* Printable text ***********************************************************/
+
+static inline bool console_is_printable(uint8_t c)
 {
-  console_clear_at(inst, 0, 0, inst->chars_x-1, inst->chars_y-1);
+  return c >= ' ' && c <= '~';
 }
 
-void console_draw_char(struct cons_insts_s *inst, size_t x, size_t y, struct cons_char_s *c)
+/* Returns how many characters at the start of buf are printable. Looks
+ * at a word at a time, a word without control characters, ESC, DEL or
+ * bytes of 0x80 and up has no byte with the top bit set in any of
+ * w, w - 0x20 and w + 0x01. Borrows and carries only reach bytes
+ * after the first one that fails, and those are checked one by one.
+ */
+
+size_t console_printable_run(const char *buf, size_t len)
 {
-  size_t screen_x = x * inst->char_width;
-  size_t screen_y = y * inst->char_height;
+  const uint8_t *p = (const uint8_t *)buf;
+  size_t i = 0;
 
-  /* Draw background character block */
+  while (i < len && ((uintptr_t)&p[i] & (sizeof(uint32_t) - 1)) != 0)
+  {
+    if (!console_is_printable(p[i]))
+    {
+      return i;
+    }
+    i++;
+  }
 
-  pax_simple_rect(inst->paxbuf, c->bg, screen_x, screen_y,
-                  inst->char_width, inst->char_height);
+  while (i + sizeof(uint32_t) <= len)
+  {
+    uint32_t w;
+    memcpy(&w, &p[i], sizeof(w));
 
+    if ((w | (w - 0x20202020) | (w + 0x01010101)) & 0x80808080)
+    {
+      break;
+    }
 
-  /* Limit the character range */
+    i += sizeof(uint32_t);
+  }
 
-  if (c->character < ' ' || c->character > '~')
+  while (i < len && console_is_printable(p[i]))
   {
-    c->character = '.';
+    i++;
   }
 
-  /* Draw character */
-
-  char single_char[] = {0x00, 0x00};
-  single_char[0] = c->character;
-
-  pax_draw_text(inst->paxbuf, c->fg, inst->font,
-                inst->font_size, screen_x, screen_y,
-                single_char);
+  return i;
 }
 
 /* Special chars */
@@ -949,13 +1859,24 @@ int console_handle_special_char(struct cons_insts_s *inst, char *c)
   switch ((*c))
   {
     case '\n':
+    case '\v':
+    case '\f':
     {
+      /* VT and FF are line feeds too */
+
       console_newline(inst);
       console_get_cursor(inst, &x, &y);
       console_set_cursor(inst, 0, y);
       return 0;
     }
 
+    case '\r':
+    {
+      console_get_cursor(inst, &x, &y);
+      console_set_cursor(inst, 0, y);
+      return 0;
+    }
+
     case '\b':
     {
       console_get_cursor(inst, &x, &y);
@@ -965,9 +1886,10 @@ int console_handle_special_char(struct cons_insts_s *inst, char *c)
 
     case '\t':
     {
+      /* Next tab stop, or the last column when there is none */
+
       console_get_cursor(inst, &x, &y);
-      x = x + (1 + x % CONSOLE_TABS);
-      console_set_cursor(inst, x - 1, y);
+      console_set_cursor(inst, (x / CONSOLE_TABS + 1) * CONSOLE_TABS, y);
       return 0;
     }
 
@@ -993,75 +1915,157 @@ void console_printf(struct cons_insts_s *inst, char *format, ...)
   va_list args;
   va_start(args, format);
   char buffer[CONSOLE_PRINTF_MAX_LEN];
-  memset(buffer, 0, sizeof(buffer));
-  vsnprintf(buffer, sizeof(buffer), format, args);
+  int len = vsnprintf(buffer, sizeof(buffer), format, args);
   va_end(args);
 
-  console_puts(inst, buffer);
+  if (len < 0)
+  {
+    return;
+  }
+
+  if (len >= sizeof(buffer))
+  {
+    len = sizeof(buffer) - 1;
+  }
+
+  console_write(inst, buffer, len);
 }
 
 void console_puts(struct cons_insts_s *inst, char *str)
 {
-  size_t len = strlen(str);
-  for (size_t i = 0; i < len; i++)
-  {
-    console_put(inst, str[i]);
-  }
+  console_write(inst, str, strlen(str));
 }
 
-void console_put(struct cons_insts_s *inst, char c)
+void console_write(struct cons_insts_s *inst, const char *buf, size_t len)
 {
+  size_t i = 0;
 
+  while (i < len)
+  {
 #if CONSOLE_ANSII_ESCAPE_CODES == 1
-  /* ANSII escape mode */
+    /* Plain text only happens outside of escape sequences */
 
-  if (inst->_esc_code_parsing.esc_mode)
-  {
-    console_esc_put(inst, c);
-    return;
+    if (console_parser_idle(inst))
+#endif
+    {
+      size_t run = console_printable_run(&buf[i], len - i);
+      if (run > 0)
+      {
+        console_print_span(inst, &buf[i], run);
+        i += run;
+        continue;
+      }
+    }
+
+    console_put(inst, buf[i++]);
   }
+}
+
+void console_put(struct cons_insts_s *inst, char c)
+{
+#if CONSOLE_ANSII_ESCAPE_CODES == 1
+  /* Everything goes through the escape sequence parser, it calls
+   * console_print for printable characters
+   */
 
-  /* Escape keys activates the special ANSII escape code parser */
+  console_parser_advance(inst, c);
+#else
+  /* Newlines arent printables, so do a shift */
 
-  if (c == '\e')
+  if (c <= CONS_SPEC_CHARS_END)
   {
-    inst->_esc_code_parsing.esc_mode = true;
+    console_handle_special_char(inst, &c);
     return;
   }
+
+  console_print(inst, c);
 #endif
+}
 
-  /* Newlines arent printables, so do a shift */
+/* Wraps to the next line if the last column was written before */
 
-  if (c <= CONS_SPEC_CHARS_END)
+static void console_wrap(struct cons_insts_s *inst)
+{
+  if (inst->wrap_pending)
   {
-    int ret = console_handle_special_char(inst, &c);
-    if (ret == 0)
-    {
-      return;
-    }
+    inst->cursor_x = 0;
+    console_newline(inst);
   }
+}
+
+void console_print(struct cons_insts_s *inst, uint32_t cp)
+{
+  console_wrap(inst);
 
   /* Put char at new location */
 
-  console_put_at(inst, inst->cursor_x, inst->cursor_y, c);
+  console_put_cp_at(inst, inst->cursor_x, inst->cursor_y, cp);
+
+  /* Increment next X position, the last column waits for the next char */
 
-  /* Increment next X position */
+  if (inst->cursor_x + 1 >= inst->chars_x)
+  {
+    inst->wrap_pending = true;
+  }
+  else
+  {
+    inst->cursor_x++;
+  }
+}
 
-  inst->cursor_x++;
+/* Prints characters that are known to be printable, a row at a time.
+ * Same result as console_print for each of them.
+ */
 
-  /* Reset X at X boundry and shift */
+void console_print_span(struct cons_insts_s *inst, const char *str,
+                        size_t len)
+{
+  struct cons_char_s charstruct =
+  {
+    .character = ' ',
+    .bg = inst->bg,
+    .fg = inst->fg,
+    .attr = inst->attr
+  };
 
-  if (inst->cursor_x >= inst->chars_x)
+  while (len > 0)
   {
-    inst->cursor_x = 0;
-    console_newline(inst);
+    console_wrap(inst);
+
+    size_t room = inst->chars_x - inst->cursor_x;
+    size_t n = len < room ? len : room;
+    struct cons_char_s *cell = console_cell(inst, inst->cursor_x,
+                                            inst->cursor_y);
+
+    for (size_t i = 0; i < n; i++)
+    {
+      charstruct.character = (uint8_t)str[i];
+      cell[i] = charstruct;
+    }
+
+    str += n;
+    len -= n;
+
+    if (inst->cursor_x + n >= inst->chars_x)
+    {
+      inst->cursor_x = inst->chars_x - 1;
+      inst->wrap_pending = true;
+    }
+    else
+    {
+      inst->cursor_x += n;
+    }
   }
 }
 
 void console_set_colors(struct cons_insts_s *inst, uint32_t fg, uint32_t bg)
 {
-  inst->fg = fg;
-  inst->bg = bg;
+  inst->sgr.fg = fg;
+  inst->sgr.bg = bg;
+  inst->sgr.fg_index = -1;
+  inst->sgr.bg_index = -1;
+  inst->sgr.attr |= CONS_ATTR_DEFAULT_BG;
+  console_sgr_apply(inst);
 }
 
 void console_puts_at(struct cons_insts_s *inst, size_t x, size_t y, char *str)
@@ -1075,16 +2079,54 @@ void console_puts_at(struct cons_insts_s *inst, size_t x, size_t y, char *str)
 
 void console_newline(struct cons_insts_s *inst)
 {
-  /* TODO: Shift the character buffer as well */
-  inst->cursor_y++;
-  if (inst->cursor_y >= inst->chars_y)
+  inst->wrap_pending = false;
+
+  /* Below the scrolling region the cursor just stops at the bottom */
+
+  if (inst->cursor_y != inst->scroll_bottom)
+  {
+    if (inst->cursor_y + 1 < inst->chars_y)
+    {
+      inst->cursor_y++;
+    }
+    return;
+  }
+
+  /* Shift the region up one line. The top line goes into the
+   * scrollback when the region starts at the top, unless a full
+   * screen app is using the alternate screen.
+   */
+
+  if (inst->scroll_top == 0 && !inst->alt_screen)
+  {
+    console_scrollback_push(inst, inst->char_alloc);
+  }
+
+  console_scroll_region(inst, inst->scroll_top, inst->scroll_bottom, 1);
+}
+
+/* Moves the cursor up a line, the region scrolls down at its top */
+
+void console_reverse_index(struct cons_insts_s *inst)
+{
+  inst->wrap_pending = false;
+  if (inst->cursor_y == inst->scroll_top)
+  {
+    console_scroll_region(inst, inst->scroll_top, inst->scroll_bottom, -1);
+  }
+  else if (inst->cursor_y > 0)
   {
-    inst->cursor_y = inst->chars_y-1;
-    pax_buf_scroll(inst->paxbuf, 0xFF000000, 0, -inst->char_height);
+    inst->cursor_y--;
   }
 }
 
 void console_put_at(struct cons_insts_s *inst, size_t x, size_t y, char c)
+{
+  console_put_cp_at(inst, x, y, (uint8_t)c);
+}
+
+void console_put_cp_at(struct cons_insts_s *inst, size_t x, size_t y,
+                       uint32_t cp)
 {
   /* Limit the characters to boundries */
 
@@ -1097,19 +2139,13 @@ void console_put_at(struct cons_insts_s *inst, size_t x, size_t y, char c)
 
   struct cons_char_s charstruct =
   {
-    .character = c,
+    .character = cp,
     .bg = inst->bg,
-    .fg = inst->fg
+    .fg = inst->fg,
+    .attr = inst->attr
   };
 
-#if 0 /* We dont use the console buffer right now */
-  size_t addr = x + (y * inst->chars_y);
-  inst->char_alloc[addr] = charstruct;
-#endif
-
-  /* Draw character */
-
-  console_draw_char(inst, x, y, &charstruct);
+  (*console_cell(inst, x, y)) = charstruct;
 }
 
 void console_get_size(struct cons_insts_s *inst, size_t *x, size_t *y)
@@ -1118,6 +2154,125 @@ void console_get_size(struct cons_insts_s *inst, size_t *x, size_t *y)
   (*y) = inst->chars_y;
 }
 
+void console_render(struct cons_insts_s *inst)
+{
+  console_render_scroll(inst);
+
+  /* The cursor cell is drawn with CONS_ATTR_CURSOR, drawn_alloc then
+   * differs from the grid where the cursor was, so leaving a cell draws
+   * it again without the cursor. A moved cursor starts out visible.
+   */
+
+  if (inst->cursor_x != inst->drawn_cursor_x ||
+      inst->cursor_y != inst->drawn_cursor_y)
+  {
+    inst->cursor_blink_off = false;
+    inst->drawn_cursor_x = inst->cursor_x;
+    inst->drawn_cursor_y = inst->cursor_y;
+  }
+
+  size_t cursor_x = SIZE_MAX;
+  size_t cursor_y = SIZE_MAX;
+
+  if (inst->cursor_visible && !inst->cursor_blink_off &&
+      inst->scrollback.view == 0)
+  {
+    cursor_x = inst->cursor_x;
+    cursor_y = inst->cursor_y;
+  }
+
+  for (size_t y = 0; y < inst->chars_y; y++)
+  {
+    /* Columns drawn on this row, x_end is exclusive */
+
+    size_t x_start = inst->chars_x;
+    size_t x_end = 0;
+    const struct cons_char_s *row = console_scrollback_row(inst, y);
+
+    for (size_t x = 0; x < inst->chars_x; x++)
+    {
+      const struct cons_char_s *c = &row[x];
+      struct cons_char_s *drawn = &inst->drawn_alloc[x + (y * inst->chars_x)];
+      struct cons_char_s cursor;
+
+      if (x == cursor_x && y == cursor_y)
+      {
+        cursor = *c;
+        cursor.attr |= CONS_ATTR_CURSOR;
+        c = &cursor;
+      }
+
+      if (!inst->redraw_all && console_cell_equal(c, drawn))
+      {
+        continue;
+      }
+
+      console_draw_char(inst, x, y, c);
+      (*drawn) = (*c);
+
+      if (x < x_start)
+      {
+        x_start = x;
+      }
+      x_end = x + 1;
+    }
+
+    if (x_end > 0)
+    {
+      console_damage_cells(inst, x_start, y, x_end, y + 1);
+    }
+  }
+
+  inst->redraw_all = false;
+}
+
+size_t console_get_damage(struct cons_insts_s *inst, struct cons_rect_s *rects,
+                          size_t max)
+{
+  size_t count = inst->damage_count;
+  if (count > max)
+  {
+    /* Caller can't take them all, hand out one that covers everything */
+
+    for (size_t i = 1; i < count; i++)
+    {
+      console_rect_union(&inst->damage[0], &inst->damage[i], &inst->damage[0]);
+    }
+    count = 1;
+  }
+
+  if (rects == NULL)
+  {
+    count = 0;
+  }
+  else
+  {
+    memcpy(rects, inst->damage, count * sizeof(struct cons_rect_s));
+  }
+
+  inst->damage_count = 0;
+  return count;
+}
+
+void console_redraw(struct cons_insts_s *inst)
+{
+  inst->redraw_all = true;
+  console_render(inst);
+}
+
+void console_recolor(struct cons_insts_s *inst, pax_col_t fg, pax_col_t bg)
+{
+  console_set_colors(inst, fg, bg);
+
+  size_t cells = inst->chars_x * inst->chars_y;
+  for (size_t i = 0; i < cells; i++)
+  {
+    inst->char_alloc[i].fg = inst->fg;
+    inst->char_alloc[i].bg = inst->bg;
+    inst->char_alloc[i].attr |= CONS_ATTR_DEFAULT_BG;
+  }
+}
+
 void console_get_cursor(struct cons_insts_s *inst, int *x, int *y)
 {
   (*x) = inst->cursor_x;
@@ -1148,10 +2303,42 @@ void console_set_cursor(struct cons_insts_s *inst, int x, int y)
     y = inst->chars_y - 1;
   }
 
-  /* Apply */
+  /* Apply, any cursor move cancels a pending wrap */
 
   inst->cursor_x = x;
   inst->cursor_y = y;
+  inst->wrap_pending = false;
+}
+
+void console_set_cursor_style(struct cons_insts_s *inst,
+                              enum cons_cursor_style_e style, bool blink)
+{
+  inst->cursor_style = style;
+  inst->cursor_blink = blink;
+  inst->cursor_blink_off = false;
+
+  /* The shape is not part of the cell. Flipping the flag in drawn_alloc
+   * makes the next render draw the cell again.
+   */
+
+  if (inst->drawn_cursor_x < inst->chars_x &&
+      inst->drawn_cursor_y < inst->chars_y)
+  {
+    inst->drawn_alloc[inst->drawn_cursor_x +
+                      inst->drawn_cursor_y * inst->chars_x].attr ^=
+      CONS_ATTR_CURSOR;
+  }
+}
+
+bool console_cursor_blink(struct cons_insts_s *inst)
+{
+  if (!inst->cursor_blink)
+  {
+    return false;
+  }
+
+  inst->cursor_blink_off = !inst->cursor_blink_off;
+  return inst->cursor_visible && inst->scrollback.view == 0;
 }
 
 int console_init(struct cons_insts_s *instance, const struct cons_config_s *config)
@@ -1166,50 +2353,208 @@ int console_init(struct cons_insts_s *instance, const struct cons_config_s *conf
 
   instance->paxbuf = config->paxbuf;
   instance->font = config->font; // Validate this
-  instance->font_size_mult = config->font_size_mult;
   instance->output_cb = config->output_cb;
+  instance->clear_cb = config->clear_cb;
+  instance->background.pixels = NULL;
 
-  /* Character dimensions */
+  console_metrics(instance, config->font_size_mult);
 
-  instance->font_size =   instance->font->default_size
-                          * instance->font_size_mult;
-  instance->char_width =  instance->font->ranges->bitmap_mono.width
-                          * instance->font_size_mult;
-  instance->char_height = instance->font->ranges->bitmap_mono.height
-                          * instance->font_size_mult;
+  ESP_LOGI(CONS_TAG, "Console size X %zu, Y %zu", instance->paxbuf->width, instance->paxbuf->height);
+  ESP_LOGI(CONS_TAG, "Console chars X %zu, Y %zu", instance->chars_x, instance->chars_y);
 
-  /* Calculate how many chars can fit in the buffer
-   * NOTE: Orientation is forced with direct assignment of height/width.
-   * Depending on actual orientation, we might need to swap
-   * the height and width here.
+  /* Cells hold colors in the format of the display */
+
+  instance->col_format = console_col_format(instance->paxbuf);
+  console_palette_init(instance);
+
+  /* Pre-rasterise the glyphs. Without the atlas everything is
+   * still drawn, just slower.
    */
 
-  instance->chars_x = instance->paxbuf->height / instance->char_width;
-  instance->chars_y = instance->paxbuf->width / instance->char_height;
+  console_glyph_init(instance);
 
-  ESP_LOGI(CONS_TAG, "Console size X %zu, Y %zu", instance->paxbuf->width, instance->paxbuf->height);
-  ESP_LOGI(CONS_TAG, "Console chars X %zu, Y %zu", instance->chars_x, instance->chars_y);
+  /* History, without it the console still works */
+
+  console_scrollback_init(instance, config->scrollback_lines);
 
-  /* Allocate as many characters we can to fit in the buffer */
+  /* Allocate as many characters we can to fit in the buffer.
+   * The grid and the drawn copy are the same size.
+   */
 
-#if 0 /* We dont use the console buffer right now */
   size_t alloc = instance->chars_x * instance->chars_y * sizeof(struct cons_char_s);
-  ESP_LOGI(CONS_TAG, "Allocating %zu bytes", alloc);
+  ESP_LOGI(CONS_TAG, "Allocating 2x %zu bytes, %zu per cell", alloc,
+           sizeof(struct cons_char_s));
+  instance->alt_alloc = NULL;
+  instance->alt_screen = false;
   instance->char_alloc = (struct cons_char_s *)pvPortMalloc(alloc);
-  if (instance->char_alloc == NULL)
+  instance->drawn_alloc = (struct cons_char_s *)pvPortMalloc(alloc);
+  if (instance->char_alloc == NULL || instance->drawn_alloc == NULL)
   {
     ESP_LOGE(CONS_TAG, "Allocation error");
+    console_deinit(instance);
     return -1;
   }
-#endif
 
   /* Defaults */
 
-  instance->fg = 0xFFFFFFFF;
-  instance->bg = 0xFF000000;
+  console_sgr_reset(instance);
+  console_sgr_apply(instance);
+  instance->cursor_x = 0;
+  instance->cursor_y = 0;
+  instance->wrap_pending = false;
+  instance->cursor_style = CONS_CURSOR_BAR;
+  instance->cursor_visible = true;
+  instance->cursor_blink = false;
+  instance->cursor_blink_off = false;
+  instance->drawn_cursor_x = 0;
+  instance->drawn_cursor_y = 0;
+  instance->redraw_all = false;
+  instance->pending_scroll.lines = 0;
+  instance->scroll_top = 0;
+  instance->scroll_bottom = instance->chars_y - 1;
+  instance->damage_count = 0;
+  instance->saved_x = 0;
+  instance->saved_y = 0;
+  instance->saved_sgr = instance->sgr;
+  instance->bracketed_paste = false;
+  instance->title[0] = 0x00;
+  console_parser_reset(instance);
+
+  /* Start out blank, both in the grid and on screen */
+
+  console_clear(instance);
+  memcpy(instance->drawn_alloc, instance->char_alloc, alloc);
+  pax_background(instance->paxbuf, console_col_argb(instance, instance->bg));
+
+  return 0;
+}
+
+/* Rows to drop from the top of a grid so that row y still fits */
+
+static size_t console_crop_skip(size_t y, size_t new_y)
+{
+  return y >= new_y ? y - new_y + 1 : 0;
+}
+
+int console_set_font_size(struct cons_insts_s *inst, float font_size_mult)
+{
+  size_t old_x = inst->chars_x;
+  size_t old_y = inst->chars_y;
+  float old_mult = inst->font_size_mult;
+
+  console_metrics(inst, font_size_mult);
+  size_t new_x = inst->chars_x;
+  size_t new_y = inst->chars_y;
+
+  /* History is unpacked at the new width, room for that comes first */
+
+  if (new_x == 0 || new_y == 0 || console_scrollback_resize(inst, new_x) != 0)
+  {
+    console_metrics(inst, old_mult);
+    return -1;
+  }
+
+  /* Each grid is cropped on its own. The active one keeps the cursor
+   * line on screen. While the alternate screen is active the normal grid
+   * keeps the saved cursor line instead, otherwise the alternate grid
+   * keeps its top rows. The normal lines that no longer fit always go
+   * into the scrollback.
+   */
+
+  size_t active_skip = console_crop_skip(inst->cursor_y, new_y);
+  size_t normal_skip = inst->alt_screen ?
+                       console_crop_skip(inst->saved_y, new_y) : active_skip;
+  size_t inactive_skip = inst->alt_screen ? normal_skip : 0;
+  const struct cons_char_s *normal = inst->alt_screen ? inst->alt_alloc :
+                                     inst->char_alloc;
 
-  pax_background(instance->paxbuf, instance->bg);
+  struct cons_char_s *grid = console_regrid(inst->char_alloc, old_x, old_y,
+                                            new_x, new_y, active_skip);
+  struct cons_char_s *drawn = (struct cons_char_s *)
+    pvPortMalloc(new_x * new_y * sizeof(struct cons_char_s));
+  struct cons_char_s *alt = NULL;
 
+  if (inst->alt_alloc != NULL)
+  {
+    alt = console_regrid(inst->alt_alloc, old_x, old_y, new_x, new_y,
+                         inactive_skip);
+  }
+
+  if (grid == NULL || drawn == NULL || (inst->alt_alloc != NULL && alt == NULL))
+  {
+    ESP_LOGE(CONS_TAG, "No memory to change the font size");
+    vPortFree(grid);
+    vPortFree(drawn);
+    vPortFree(alt);
+    console_metrics(inst, old_mult);
+    return -1;
+  }
+
+  inst->chars_x = old_x;
+  for (size_t y = 0; y < normal_skip; y++)
+  {
+    console_scrollback_push(inst, &normal[y * old_x]);
+  }
+  inst->chars_x = new_x;
+
+  vPortFree(inst->char_alloc);
+  vPortFree(inst->drawn_alloc);
+  vPortFree(inst->alt_alloc);
+  inst->char_alloc = grid;
+  inst->drawn_alloc = drawn;
+  inst->alt_alloc = alt;
+
+  /* Glyphs are rasterised again at the new size */
+
+  console_glyph_deinit(inst);
+  console_glyph_init(inst);
+
+  inst->scroll_top = 0;
+  inst->scroll_bottom = new_y - 1;
+  inst->pending_scroll.lines = 0;
+  inst->damage_count = 0;
+  console_scrollback_live(inst);
+  console_set_cursor(inst, inst->cursor_x, inst->cursor_y - active_skip);
+  inst->saved_y = inst->saved_y >= normal_skip ?
+                  inst->saved_y - normal_skip : 0;
+
+  /* Every cell is drawn on the next render, the margins change too */
+
+  if (inst->background.pixels != NULL)
+  {
+    console_background_fill(inst);
+  }
+  else
+  {
+    pax_background(inst->paxbuf, console_col_argb(inst, inst->bg));
+  }
+  inst->redraw_all = true;
 
+  ESP_LOGI(CONS_TAG, "Console chars X %zu, Y %zu", new_x, new_y);
   return 0;
 }
+
+void console_deinit(struct cons_insts_s *instance)
+{
+  if (instance->char_alloc != NULL)
+  {
+    vPortFree(instance->char_alloc);
+    instance->char_alloc = NULL;
+  }
+
+  if (instance->drawn_alloc != NULL)
+  {
+    vPortFree(instance->drawn_alloc);
+    instance->drawn_alloc = NULL;
+  }
+
+  if (instance->alt_alloc != NULL)
+  {
+    vPortFree(instance->alt_alloc);
+    instance->alt_alloc = NULL;
+  }
+
+  console_scrollback_deinit(instance);
+  console_glyph_deinit(instance);
+  console_background_deinit(instance);
+}
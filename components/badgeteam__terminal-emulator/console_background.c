@@ -0,0 +1,120 @@
+/******************************************************************************
+ * MIT License
+ * 
+ * Copyright (c) 2025 Kevin Witteveen (MartiniMarter)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *****************************************************************************/
+
+/******************************************************************************
+ * Includes
+ *****************************************************************************/
+
+#include "console_internal.h"
+#include "esp_heap_caps.h"
+#include <string.h>
+
+/******************************************************************************
+ * Globals
+ *****************************************************************************/
+
+static const char CONS_BG_TAG[] = "CONS_BG";
+
+/******************************************************************************
+ * Public Functions
+ *****************************************************************************/
+
+int console_set_background(struct cons_insts_s *inst, const pax_buf_t *image)
+{
+  struct cons_background_s *bg = &inst->background;
+  pax_buf_t *buf = inst->paxbuf;
+
+  console_background_deinit(inst);
+  inst->redraw_all = true;
+
+  if (image == NULL)
+  {
+    return 0;
+  }
+
+  /* The plane is copied straight into the framebuffer */
+
+  if (buf->type != PAX_BUF_16_565RGB)
+  {
+    ESP_LOGW(CONS_BG_TAG, "Background images need an RGB565 buffer");
+    return -1;
+  }
+
+  size_t size = buf->width * buf->height * sizeof(uint16_t);
+  uint16_t *pixels = heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+  if (pixels == NULL)
+  {
+    ESP_LOGE(CONS_BG_TAG, "Allocation error, no background");
+    return -1;
+  }
+
+  pax_buf_init(&bg->plane, pixels, buf->width, buf->height,
+               PAX_BUF_16_565RGB);
+  pax_buf_reversed(&bg->plane, buf->reverse_endianness);
+  pax_buf_set_orientation(&bg->plane, pax_buf_get_orientation(buf));
+  pax_background(&bg->plane, console_col_argb(inst, inst->bg));
+  pax_draw_image(&bg->plane, image, 0, 0);
+  bg->pixels = pixels;
+
+  ESP_LOGI(CONS_BG_TAG, "%zu bytes of PSRAM", size);
+
+  console_background_fill(inst);
+  return 0;
+}
+
+void console_background_deinit(struct cons_insts_s *inst)
+{
+  struct cons_background_s *bg = &inst->background;
+
+  if (bg->pixels != NULL)
+  {
+    pax_buf_destroy(&bg->plane);
+    heap_caps_free(bg->pixels);
+    bg->pixels = NULL;
+  }
+}
+
+/* The whole image, also the margins the cells don't cover */
+
+void console_background_fill(struct cons_insts_s *inst)
+{
+  pax_buf_t *buf = inst->paxbuf;
+
+  memcpy(pax_buf_get_pixels_rw(buf), inst->background.pixels,
+         buf->width * buf->height * sizeof(uint16_t));
+}
+
+/* Background of one cell through pax, for when the framebuffer can't be
+ * written directly
+ */
+
+void console_background_draw(struct cons_insts_s *inst, size_t x, size_t y)
+{
+  float screen_x = x * inst->char_width;
+  float screen_y = y * inst->char_height;
+
+  pax_draw_image_part(inst->paxbuf, &inst->background.plane,
+                      screen_x, screen_y, inst->char_width, inst->char_height,
+                      screen_x, screen_y);
+}
@@ -0,0 +1,166 @@
+/******************************************************************************
+ * MIT License
+ * 
+ * Copyright (c) 2025 Kevin Witteveen (MartiniMarter)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *****************************************************************************/
+
+/******************************************************************************
+ * Includes
+ *****************************************************************************/
+
+#include "console_internal.h"
+#include "esp_timer.h"
+
+#if CONSOLE_BENCHMARK == 1
+
+/******************************************************************************
+ * Preprocessors
+ *****************************************************************************/
+
+/* Full screens drawn per measurement */
+
+#define CONS_BENCH_PASSES 4
+
+/* Bytes pushed through the parser per measurement */
+
+#define CONS_BENCH_PARSER_BYTES (256 * 1024)
+
+/******************************************************************************
+ * Globals
+ *****************************************************************************/
+
+static const char CONS_BENCH_TAG[] = "CONS_BENCH";
+
+/* Typical shell and editor output, text mixed with colors and movement */
+
+static const char g_cons_bench_stream[] =
+  "\e[1;32muser@badge\e[0m:\e[1;34m~/src\e[0m$ ls -l\r\n"
+  "-rw-r--r-- 1 user user  4096 Jan  1 00:00 console.c\r\n"
+  "\e[38;5;208mwarning:\e[m unused variable\e[K\r\n"
+  "\e[12;1H\e[2K\e[7m -- INSERT -- \e[27m\e[1;1H\e]0;vim\a";
+
+/******************************************************************************
+ * Private Functions
+ *****************************************************************************/
+
+/* Fills the console with a mix of glyphs and colors, returns the glyphs
+ * drawn per second
+ */
+
+static uint32_t console_bench_run(struct cons_insts_s *inst, bool atlas)
+{
+  struct cons_char_s c =
+  {
+    .attr = 0
+  };
+
+  cons_col_t white = console_col_native(inst, CONSOLE_DEFAULT_FG);
+  cons_col_t black = console_col_native(inst, CONSOLE_DEFAULT_BG);
+  size_t glyphs = 0;
+
+  int64_t start = esp_timer_get_time();
+
+  for (size_t pass = 0; pass < CONS_BENCH_PASSES; pass++)
+  {
+    for (size_t y = 0; y < inst->chars_y; y++)
+    {
+      for (size_t x = 0; x < inst->chars_x; x++)
+      {
+        c.character = '!' + (x + y + pass) % ('~' - '!');
+        c.fg = (pass & 1) ? black : white;
+        c.bg = (pass & 1) ? white : black;
+
+        if (!atlas || !console_glyph_draw(inst, x, y, &c))
+        {
+          console_draw_char_pax(inst, x, y, &c);
+        }
+
+        glyphs++;
+      }
+    }
+  }
+
+  int64_t elapsed = esp_timer_get_time() - start;
+  if (elapsed <= 0)
+  {
+    return 0;
+  }
+
+  return (uint32_t)(glyphs * 1000000LL / elapsed);
+}
+
+/* Feeds the same stream through the parser again and again, returns
+ * kilobytes per second. Includes storing in the grid, not rendering.
+ */
+
+static uint32_t console_bench_parser(struct cons_insts_s *inst)
+{
+  size_t len = sizeof(g_cons_bench_stream) - 1;
+  size_t bytes = 0;
+
+  int64_t start = esp_timer_get_time();
+
+  while (bytes < CONS_BENCH_PARSER_BYTES)
+  {
+    console_write(inst, g_cons_bench_stream, len);
+    bytes += len;
+  }
+
+  int64_t elapsed = esp_timer_get_time() - start;
+  if (elapsed <= 0)
+  {
+    return 0;
+  }
+
+  return (uint32_t)(bytes * 1000000LL / 1024 / elapsed);
+}
+
+/******************************************************************************
+ * Public Functions
+ *****************************************************************************/
+
+void console_benchmark(struct cons_insts_s *instance)
+{
+  uint32_t pax_rate = console_bench_run(instance, false);
+  ESP_LOGI(CONS_BENCH_TAG, "pax: %lu glyphs/s", (unsigned long)pax_rate);
+
+  if (instance->glyphs.bits == NULL)
+  {
+    ESP_LOGI(CONS_BENCH_TAG, "atlas: not available for this buffer");
+  }
+  else
+  {
+    uint32_t atlas_rate = console_bench_run(instance, true);
+    ESP_LOGI(CONS_BENCH_TAG, "atlas: %lu glyphs/s", (unsigned long)atlas_rate);
+  }
+
+  uint32_t parser_rate = console_bench_parser(instance);
+  ESP_LOGI(CONS_BENCH_TAG, "parser: %lu.%02lu MB/s",
+           (unsigned long)(parser_rate / 1024),
+           (unsigned long)(parser_rate % 1024 * 100 / 1024));
+
+  /* Start over with a blank console */
+
+  console_puts(instance, "\ec");
+  console_redraw(instance);
+}
+
+#endif /* CONSOLE_BENCHMARK == 1 */
@@ -0,0 +1,756 @@
+/******************************************************************************
+ * MIT License
+ * 
+ * Copyright (c) 2025 Kevin Witteveen (MartiniMarter)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *****************************************************************************/
+
+/******************************************************************************
+ * Includes
+ *****************************************************************************/
+
+#include "console_internal.h"
+#include "freertos/portable.h"
+#include "pax_gfx.h"
+#include "pax_text.h"
+#include <string.h>
+
+/******************************************************************************
+ * Preprocessors
+ *****************************************************************************/
+
+#define CONS_GLYPH_COUNT (CONSOLE_GLYPH_LAST - CONSOLE_GLYPH_FIRST + 1)
+
+/* Rasterised pixels brighter than this are part of the glyph */
+
+#define CONS_GLYPH_THRESHOLD 0x80
+
+/* Box drawing line weights, two bits per arm */
+
+#define CONS_BOX_LIGHT  1
+#define CONS_BOX_HEAVY  2
+#define CONS_BOX_DOUBLE 3
+
+#define CONS_BOX(left, up, right, down) \
+  (CONS_BOX_##left | (CONS_BOX_##up << 2) | \
+   (CONS_BOX_##right << 4) | (CONS_BOX_##down << 6))
+
+#define CONS_BOX_NONE 0
+
+/******************************************************************************
+ * Datatypes
+ *****************************************************************************/
+
+struct cons_box_glyph_s
+{
+  uint16_t codepoint;
+  uint8_t arms;
+};
+
+/******************************************************************************
+ * Globals
+ *****************************************************************************/
+
+static const char CONS_GLYPH_TAG[] = "CONS_GLYPH";
+
+/* Box drawing characters are drawn from their arms instead of the font,
+ * so lines connect from one cell to the next. Dashed lines are drawn
+ * solid, rounded corners square.
+ */
+
+static const struct cons_box_glyph_s g_cons_box_glyphs[] =
+{
+  {0x2500, CONS_BOX(LIGHT, NONE, LIGHT, NONE)},   /* ─ */
+  {0x2501, CONS_BOX(HEAVY, NONE, HEAVY, NONE)},   /* ━ */
+  {0x2502, CONS_BOX(NONE, LIGHT, NONE, LIGHT)},   /* │ */
+  {0x2503, CONS_BOX(NONE, HEAVY, NONE, HEAVY)},   /* ┃ */
+  {0x2504, CONS_BOX(LIGHT, NONE, LIGHT, NONE)},   /* ┄ */
+  {0x2505, CONS_BOX(HEAVY, NONE, HEAVY, NONE)},   /* ┅ */
+  {0x2506, CONS_BOX(NONE, LIGHT, NONE, LIGHT)},   /* ┆ */
+  {0x2507, CONS_BOX(NONE, HEAVY, NONE, HEAVY)},   /* ┇ */
+  {0x2508, CONS_BOX(LIGHT, NONE, LIGHT, NONE)},   /* ┈ */
+  {0x2509, CONS_BOX(HEAVY, NONE, HEAVY, NONE)},   /* ┉ */
+  {0x250A, CONS_BOX(NONE, LIGHT, NONE, LIGHT)},   /* ┊ */
+  {0x250B, CONS_BOX(NONE, HEAVY, NONE, HEAVY)},   /* ┋ */
+  {0x250C, CONS_BOX(NONE, NONE, LIGHT, LIGHT)},   /* ┌ */
+  {0x250F, CONS_BOX(NONE, NONE, HEAVY, HEAVY)},   /* ┏ */
+  {0x2510, CONS_BOX(LIGHT, NONE, NONE, LIGHT)},   /* ┐ */
+  {0x2513, CONS_BOX(HEAVY, NONE, NONE, HEAVY)},   /* ┓ */
+  {0x2514, CONS_BOX(NONE, LIGHT, LIGHT, NONE)},   /* └ */
+  {0x2517, CONS_BOX(NONE, HEAVY, HEAVY, NONE)},   /* ┗ */
+  {0x2518, CONS_BOX(LIGHT, LIGHT, NONE, NONE)},   /* ┘ */
+  {0x251B, CONS_BOX(HEAVY, HEAVY, NONE, NONE)},   /* ┛ */
+  {0x251C, CONS_BOX(NONE, LIGHT, LIGHT, LIGHT)},  /* ├ */
+  {0x2523, CONS_BOX(NONE, HEAVY, HEAVY, HEAVY)},  /* ┣ */
+  {0x2524, CONS_BOX(LIGHT, LIGHT, NONE, LIGHT)},  /* ┤ */
+  {0x252B, CONS_BOX(HEAVY, HEAVY, NONE, HEAVY)},  /* ┫ */
+  {0x252C, CONS_BOX(LIGHT, NONE, LIGHT, LIGHT)},  /* ┬ */
+  {0x2533, CONS_BOX(HEAVY, NONE, HEAVY, HEAVY)},  /* ┳ */
+  {0x2534, CONS_BOX(LIGHT, LIGHT, LIGHT, NONE)},  /* ┴ */
+  {0x253B, CONS_BOX(HEAVY, HEAVY, HEAVY, NONE)},  /* ┻ */
+  {0x253C, CONS_BOX(LIGHT, LIGHT, LIGHT, LIGHT)}, /* ┼ */
+  {0x254B, CONS_BOX(HEAVY, HEAVY, HEAVY, HEAVY)}, /* ╋ */
+  {0x254C, CONS_BOX(LIGHT, NONE, LIGHT, NONE)},   /* ╌ */
+  {0x254D, CONS_BOX(HEAVY, NONE, HEAVY, NONE)},   /* ╍ */
+  {0x254E, CONS_BOX(NONE, LIGHT, NONE, LIGHT)},   /* ╎ */
+  {0x254F, CONS_BOX(NONE, HEAVY, NONE, HEAVY)},   /* ╏ */
+  {0x2550, CONS_BOX(DOUBLE, NONE, DOUBLE, NONE)}, /* ═ */
+  {0x2551, CONS_BOX(NONE, DOUBLE, NONE, DOUBLE)}, /* ║ */
+  {0x2554, CONS_BOX(NONE, NONE, DOUBLE, DOUBLE)}, /* ╔ */
+  {0x2557, CONS_BOX(DOUBLE, NONE, NONE, DOUBLE)}, /* ╗ */
+  {0x255A, CONS_BOX(NONE, DOUBLE, DOUBLE, NONE)}, /* ╚ */
+  {0x255D, CONS_BOX(DOUBLE, DOUBLE, NONE, NONE)}, /* ╝ */
+  {0x2560, CONS_BOX(NONE, DOUBLE, DOUBLE, DOUBLE)}, /* ╠ */
+  {0x2563, CONS_BOX(DOUBLE, DOUBLE, NONE, DOUBLE)}, /* ╣ */
+  {0x2566, CONS_BOX(DOUBLE, NONE, DOUBLE, DOUBLE)}, /* ╦ */
+  {0x2569, CONS_BOX(DOUBLE, DOUBLE, DOUBLE, NONE)}, /* ╩ */
+  {0x256C, CONS_BOX(DOUBLE, DOUBLE, DOUBLE, DOUBLE)}, /* ╬ */
+  {0x256D, CONS_BOX(NONE, NONE, LIGHT, LIGHT)},   /* ╭ */
+  {0x256E, CONS_BOX(LIGHT, NONE, NONE, LIGHT)},   /* ╮ */
+  {0x256F, CONS_BOX(LIGHT, LIGHT, NONE, NONE)},   /* ╯ */
+  {0x2570, CONS_BOX(NONE, LIGHT, LIGHT, NONE)},   /* ╰ */
+  {0x2574, CONS_BOX(LIGHT, NONE, NONE, NONE)},    /* ╴ */
+  {0x2575, CONS_BOX(NONE, LIGHT, NONE, NONE)},    /* ╵ */
+  {0x2576, CONS_BOX(NONE, NONE, LIGHT, NONE)},    /* ╶ */
+  {0x2577, CONS_BOX(NONE, NONE, NONE, LIGHT)},    /* ╷ */
+};
+
+/******************************************************************************
+ * Private Functions
+ *****************************************************************************/
+
+/* Sets up writing to the framebuffer without pax. The buffer is stored
+ * unrotated, so one pixel right on screen is not always one pixel
+ * further in memory. Same mapping as the pax orientation transform.
+ */
+
+static bool console_glyph_map_buffer(struct cons_insts_s *inst)
+{
+  pax_buf_t *buf = inst->paxbuf;
+  struct cons_glyph_atlas_s *glyphs = &inst->glyphs;
+
+  /* The cell colors have to be framebuffer pixels */
+
+  if (buf->type != PAX_BUF_16_565RGB ||
+      (inst->col_format != CONS_COL_FORMAT_RGB565 &&
+       inst->col_format != CONS_COL_FORMAT_RGB565_SWAP))
+  {
+    return false;
+  }
+
+  glyphs->pixels = pax_buf_get_pixels_rw(buf);
+
+  switch (pax_buf_get_orientation(buf))
+  {
+    case PAX_O_UPRIGHT:
+    {
+      glyphs->step_x = 1;
+      glyphs->step_y = buf->width;
+      return true;
+    }
+
+    case PAX_O_ROT_CCW:
+    {
+      glyphs->step_x = -(ptrdiff_t)buf->width;
+      glyphs->step_y = 1;
+      return true;
+    }
+
+    case PAX_O_ROT_HALF:
+    {
+      glyphs->step_x = -1;
+      glyphs->step_y = -(ptrdiff_t)buf->width;
+      return true;
+    }
+
+    case PAX_O_ROT_CW:
+    {
+      glyphs->step_x = buf->width;
+      glyphs->step_y = -1;
+      return true;
+    }
+
+    /* Mirrored orientations keep using pax */
+
+    default:
+    {
+      return false;
+    }
+  }
+}
+
+/* Framebuffer offset of a pixel on screen */
+
+static inline ptrdiff_t console_glyph_offset(struct cons_insts_s *inst,
+                                             size_t sx, size_t sy)
+{
+  pax_buf_t *buf = inst->paxbuf;
+
+  switch (pax_buf_get_orientation(buf))
+  {
+    case PAX_O_ROT_CCW:
+      return (buf->height - 1 - sx) * buf->width + sy;
+
+    case PAX_O_ROT_HALF:
+      return (buf->height - 1 - sy) * buf->width + (buf->width - 1 - sx);
+
+    case PAX_O_ROT_CW:
+      return sx * buf->width + (buf->width - 1 - sy);
+
+    default:
+      return sy * buf->width + sx;
+  }
+}
+
+/* Sets the bits of a rectangle in a glyph, clipped to the cell */
+
+static void console_glyph_fill(struct cons_insts_s *inst, uint8_t *glyph,
+                               int x, int y, int w, int h)
+{
+  int x2 = x + w;
+  int y2 = y + h;
+
+  x = x < 0 ? 0 : x;
+  y = y < 0 ? 0 : y;
+  x2 = x2 > (int)inst->char_width ? (int)inst->char_width : x2;
+  y2 = y2 > (int)inst->char_height ? (int)inst->char_height : y2;
+
+  for (int py = y; py < y2; py++)
+  {
+    uint8_t *row = &glyph[py * inst->glyphs.stride];
+    for (int px = x; px < x2; px++)
+    {
+      row[px / 8] |= 1 << (px & 7);
+    }
+  }
+}
+
+/* One arm of a box drawing character, from the edge into the center.
+ * dir is 0 left, 1 up, 2 right, 3 down. The two lines of a double arm
+ * stop at the inner or outer line of the arms next to it, so corners
+ * and junctions stay open like in the font.
+ */
+
+static void console_glyph_box_arm(struct cons_insts_s *inst, uint8_t *glyph,
+                                  uint8_t arms, int dir)
+{
+  int w = inst->char_width;
+  int h = inst->char_height;
+  int weight = (arms >> (dir * 2)) & 0x03;
+  int light = w / 8 > 0 ? w / 8 : 1;
+
+  if (weight != CONS_BOX_DOUBLE)
+  {
+    int thick = weight == CONS_BOX_HEAVY ? light * 2 : light;
+    int x = w / 2 - thick / 2;
+    int y = h / 2 - thick / 2;
+
+    switch (dir)
+    {
+      case 0:
+        console_glyph_fill(inst, glyph, 0, y, x + thick, thick);
+        break;
+
+      case 1:
+        console_glyph_fill(inst, glyph, x, 0, thick, y + thick);
+        break;
+
+      case 2:
+        console_glyph_fill(inst, glyph, x, y, w - x, thick);
+        break;
+
+      default:
+        console_glyph_fill(inst, glyph, x, y, thick, h - y);
+        break;
+    }
+
+    return;
+  }
+
+  /* Two light lines with a light line of space, at x0/x1 or y0/y1 */
+
+  bool left = (arms & 0x03) != 0;
+  bool up = ((arms >> 2) & 0x03) != 0;
+  bool right = ((arms >> 4) & 0x03) != 0;
+  bool down = ((arms >> 6) & 0x03) != 0;
+
+  int x0 = w / 2 - (light * 3) / 2;
+  int x1 = x0 + light * 2;
+  int y0 = h / 2 - (light * 3) / 2;
+  int y1 = y0 + light * 2;
+
+  switch (dir)
+  {
+    case 0:
+    {
+      int end0 = (up ? x0 : x1) + light;
+      int end1 = (down ? x0 : x1) + light;
+      console_glyph_fill(inst, glyph, 0, y0, end0, light);
+      console_glyph_fill(inst, glyph, 0, y1, end1, light);
+      break;
+    }
+
+    case 1:
+    {
+      int end0 = (left ? y0 : y1) + light;
+      int end1 = (right ? y0 : y1) + light;
+      console_glyph_fill(inst, glyph, x0, 0, light, end0);
+      console_glyph_fill(inst, glyph, x1, 0, light, end1);
+      break;
+    }
+
+    case 2:
+    {
+      int start0 = up ? x1 : x0;
+      int start1 = down ? x1 : x0;
+      console_glyph_fill(inst, glyph, start0, y0, w - start0, light);
+      console_glyph_fill(inst, glyph, start1, y1, w - start1, light);
+      break;
+    }
+
+    default:
+    {
+      int start0 = left ? y1 : y0;
+      int start1 = right ? y1 : y0;
+      console_glyph_fill(inst, glyph, x0, start0, light, h - start0);
+      console_glyph_fill(inst, glyph, x1, start1, light, h - start1);
+      break;
+    }
+  }
+}
+
+/* Box drawing, block elements and braille patterns. These have to
+ * line up with the neighbouring cells, which fonts rarely get right at
+ * every size. Returns false for other codepoints.
+ */
+
+static bool console_glyph_procedural(struct cons_insts_s *inst,
+                                     uint32_t cp, uint8_t *glyph)
+{
+  int w = inst->char_width;
+  int h = inst->char_height;
+
+  if (cp >= 0x2500 && cp <= 0x257F)
+  {
+    for (size_t i = 0;
+         i < sizeof(g_cons_box_glyphs) / sizeof(g_cons_box_glyphs[0]); i++)
+    {
+      if (g_cons_box_glyphs[i].codepoint != cp)
+      {
+        continue;
+      }
+
+      uint8_t arms = g_cons_box_glyphs[i].arms;
+      for (int dir = 0; dir < 4; dir++)
+      {
+        if (((arms >> (dir * 2)) & 0x03) != CONS_BOX_NONE)
+        {
+          console_glyph_box_arm(inst, glyph, arms, dir);
+        }
+      }
+
+      return true;
+    }
+
+    return false;
+  }
+
+  if (cp == 0x2580) /* ▀ */
+  {
+    console_glyph_fill(inst, glyph, 0, 0, w, h / 2);
+    return true;
+  }
+
+  if (cp >= 0x2581 && cp <= 0x2588) /* ▁ up to █ */
+  {
+    int fill = h * (cp - 0x2580) / 8;
+    console_glyph_fill(inst, glyph, 0, h - fill, w, fill);
+    return true;
+  }
+
+  if (cp >= 0x2589 && cp <= 0x258F) /* ▉ down to ▏ */
+  {
+    console_glyph_fill(inst, glyph, 0, 0, w * (0x2590 - cp) / 8, h);
+    return true;
+  }
+
+  if (cp == 0x2590) /* ▐ */
+  {
+    console_glyph_fill(inst, glyph, w / 2, 0, w - w / 2, h);
+    return true;
+  }
+
+  if (cp >= 0x2591 && cp <= 0x2593) /* ░ ▒ ▓ */
+  {
+    for (int y = 0; y < h; y++)
+    {
+      for (int x = 0; x < w; x++)
+      {
+        bool dot = (cp == 0x2591) ? ((x | y) & 1) == 0 :
+                   (cp == 0x2592) ? ((x + y) & 1) == 0 :
+                                    ((x | y) & 1) != 0;
+        if (dot)
+        {
+          console_glyph_fill(inst, glyph, x, y, 1, 1);
+        }
+      }
+    }
+
+    return true;
+  }
+
+  if (cp == 0x2594) /* ▔ */
+  {
+    console_glyph_fill(inst, glyph, 0, 0, w, h / 8 > 0 ? h / 8 : 1);
+    return true;
+  }
+
+  if (cp == 0x2595) /* ▕ */
+  {
+    int fill = w / 8 > 0 ? w / 8 : 1;
+    console_glyph_fill(inst, glyph, w - fill, 0, fill, h);
+    return true;
+  }
+
+  if (cp >= 0x2800 && cp <= 0x28FF)
+  {
+    /* Braille, dots 1-2-3-7 in the left column and 4-5-6-8 in the
+     * right column, top to bottom
+     */
+
+    static const uint8_t dots[8][2] =
+    {
+      {0, 0}, {0, 1}, {0, 2}, {1, 0}, {1, 1}, {1, 2}, {0, 3}, {1, 3}
+    };
+
+    int size = w / 5 > 0 ? w / 5 : 1;
+    for (int bit = 0; bit < 8; bit++)
+    {
+      if ((cp >> bit) & 1)
+      {
+        int x = w * (dots[bit][0] * 2 + 1) / 4 - size / 2;
+        int y = h * (dots[bit][1] * 2 + 1) / 8 - size / 2;
+        console_glyph_fill(inst, glyph, x, y, size, size);
+      }
+    }
+
+    return true;
+  }
+
+  return false;
+}
+
+/* Draws one glyph with pax, or procedurally, and keeps the bits */
+
+static void console_glyph_rasterise(struct cons_insts_s *inst, uint32_t cp,
+                                    uint8_t *glyph)
+{
+  struct cons_glyph_atlas_s *glyphs = &inst->glyphs;
+
+  memset(glyph, 0, glyphs->glyph_size);
+
+  if (console_glyph_procedural(inst, cp, glyph))
+  {
+    return;
+  }
+
+  char utf8[5];
+  utf8[console_utf8_encode(cp, utf8)] = 0x00;
+
+  pax_background(&glyphs->scratch, 0xFF000000);
+  pax_draw_text(&glyphs->scratch, 0xFFFFFFFF, inst->font, inst->font_size,
+                0, 0, utf8);
+
+  for (size_t y = 0; y < inst->char_height; y++)
+  {
+    for (size_t x = 0; x < inst->char_width; x++)
+    {
+      pax_col_t px = pax_get_pixel(&glyphs->scratch, x, y);
+      if (((px >> 8) & 0xFF) >= CONS_GLYPH_THRESHOLD)
+      {
+        glyph[y * glyphs->stride + x / 8] |= 1 << (x & 7);
+      }
+    }
+  }
+}
+
+/* Returns the bits of a glyph. ASCII is always there. Box drawing,
+ * block elements and braille are drawn again every time: that is a
+ * few fills, and the 416 of them would push each other and everything
+ * else out of the cache in a btop or htop frame. Other codepoints go
+ * through a direct-mapped cache so the pax font ranges are only
+ * searched when a codepoint is first seen or was pushed out.
+ */
+
+static const uint8_t *console_glyph_lookup(struct cons_insts_s *inst,
+                                           uint32_t cp)
+{
+  struct cons_glyph_atlas_s *glyphs = &inst->glyphs;
+
+  if (cp >= CONSOLE_GLYPH_FIRST && cp <= CONSOLE_GLYPH_LAST)
+  {
+    return &glyphs->bits[(cp - CONSOLE_GLYPH_FIRST) * glyphs->glyph_size];
+  }
+
+  if ((cp >= 0x2500 && cp <= 0x259F) || (cp >= 0x2800 && cp <= 0x28FF))
+  {
+    uint8_t *spare = &glyphs->bits[(CONS_GLYPH_COUNT + CONSOLE_GLYPH_CACHE) *
+                                   glyphs->glyph_size];
+    memset(spare, 0, glyphs->glyph_size);
+    if (console_glyph_procedural(inst, cp, spare))
+    {
+      return spare;
+    }
+  }
+
+  /* Folding in the higher bits spreads codepoints from different blocks
+   * over the slots. It doesn't keep them apart: the 128 codepoints of
+   * one block fill every slot by themselves.
+   */
+
+  size_t slot = (cp ^ (cp >> 7)) & (CONSOLE_GLYPH_CACHE - 1);
+  uint8_t *glyph = &glyphs->bits[(CONS_GLYPH_COUNT + slot) *
+                                 glyphs->glyph_size];
+
+  if (glyphs->cache_tags[slot] != cp)
+  {
+    console_glyph_rasterise(inst, cp, glyph);
+    glyphs->cache_tags[slot] = cp;
+  }
+
+  return glyph;
+}
+
+/******************************************************************************
+ * Public Functions
+ *****************************************************************************/
+
+int console_glyph_init(struct cons_insts_s *inst)
+{
+  struct cons_glyph_atlas_s *glyphs = &inst->glyphs;
+
+  memset(glyphs, 0, sizeof(*glyphs));
+
+  if (!console_glyph_map_buffer(inst))
+  {
+    ESP_LOGI(CONS_GLYPH_TAG, "Buffer type not supported, using pax");
+    return -1;
+  }
+
+  glyphs->stride = (inst->char_width + 7) / 8;
+  glyphs->glyph_size = glyphs->stride * inst->char_height;
+
+  /* ASCII, the cache slots and one spare for procedural glyphs */
+
+  size_t alloc = glyphs->glyph_size *
+                 (CONS_GLYPH_COUNT + CONSOLE_GLYPH_CACHE + 1);
+  glyphs->bits = (uint8_t *)pvPortMalloc(alloc);
+  glyphs->cache_tags = (uint32_t *)pvPortMalloc(CONSOLE_GLYPH_CACHE *
+                                                sizeof(uint32_t));
+  pax_buf_init(&glyphs->scratch, NULL, inst->char_width, inst->char_height,
+               PAX_BUF_32_8888ARGB);
+
+  if (glyphs->bits == NULL || glyphs->cache_tags == NULL ||
+      pax_buf_get_pixels(&glyphs->scratch) == NULL)
+  {
+    ESP_LOGE(CONS_GLYPH_TAG, "Allocation error");
+    console_glyph_deinit(inst);
+    return -1;
+  }
+
+  /* No codepoint is cached as 0, that is a control character */
+
+  memset(glyphs->cache_tags, 0, CONSOLE_GLYPH_CACHE * sizeof(uint32_t));
+
+  for (uint32_t cp = CONSOLE_GLYPH_FIRST; cp <= CONSOLE_GLYPH_LAST; cp++)
+  {
+    console_glyph_rasterise(inst, cp,
+      &glyphs->bits[(cp - CONSOLE_GLYPH_FIRST) * glyphs->glyph_size]);
+  }
+
+  ESP_LOGI(CONS_GLYPH_TAG, "%d glyphs and %d cache slots of %zux%zu in %zu bytes",
+           CONS_GLYPH_COUNT, CONSOLE_GLYPH_CACHE, inst->char_width,
+           inst->char_height, alloc);
+  return 0;
+}
+
+void console_glyph_deinit(struct cons_insts_s *inst)
+{
+  struct cons_glyph_atlas_s *glyphs = &inst->glyphs;
+
+  if (glyphs->bits != NULL)
+  {
+    vPortFree(glyphs->bits);
+    glyphs->bits = NULL;
+  }
+
+  if (glyphs->cache_tags != NULL)
+  {
+    vPortFree(glyphs->cache_tags);
+    glyphs->cache_tags = NULL;
+  }
+
+  if (pax_buf_get_pixels(&glyphs->scratch) != NULL)
+  {
+    pax_buf_destroy(&glyphs->scratch);
+    memset(&glyphs->scratch, 0, sizeof(glyphs->scratch));
+  }
+}
+
+/* Returns false when the atlas can't be used, the caller then uses pax */
+
+bool console_glyph_draw(struct cons_insts_s *inst, size_t x, size_t y,
+                        const struct cons_char_s *c)
+{
+  struct cons_glyph_atlas_s *glyphs = &inst->glyphs;
+
+  if (glyphs->bits == NULL)
+  {
+    return false;
+  }
+
+  uint32_t character = c->character;
+  if (character < CONSOLE_GLYPH_FIRST ||
+      (character > CONSOLE_GLYPH_LAST && character < 0xA0))
+  {
+    character = '.';
+  }
+
+  const uint8_t *glyph = console_glyph_lookup(inst, character);
+  uint16_t fg = c->fg;
+  uint16_t bg = c->bg;
+  uint16_t *origin = glyphs->pixels +
+    console_glyph_offset(inst, x * inst->char_width, y * inst->char_height);
+
+  /* Cells with the default background show the image plane behind
+   * them, it has the same layout as the framebuffer
+   */
+
+  const uint16_t *under = NULL;
+  if ((c->attr & CONS_ATTR_DEFAULT_BG) && inst->background.pixels != NULL)
+  {
+    under = inst->background.pixels + (origin - glyphs->pixels);
+  }
+
+  /* Walk along the direction that is contiguous in memory */
+
+  if (glyphs->step_x == 1 || glyphs->step_x == -1)
+  {
+    for (size_t gy = 0; gy < inst->char_height; gy++)
+    {
+      const uint8_t *row = &glyph[gy * glyphs->stride];
+      ptrdiff_t offset = gy * glyphs->step_y;
+
+      for (size_t gx = 0; gx < inst->char_width; gx++)
+      {
+        origin[offset] = (row[gx / 8] >> (gx & 7)) & 1 ? fg :
+                         under != NULL ? under[offset] : bg;
+        offset += glyphs->step_x;
+      }
+    }
+  }
+  else
+  {
+    for (size_t gx = 0; gx < inst->char_width; gx++)
+    {
+      ptrdiff_t offset = gx * glyphs->step_x;
+      uint8_t bit = 1 << (gx & 7);
+
+      for (size_t gy = 0; gy < inst->char_height; gy++)
+      {
+        origin[offset] = glyph[gy * glyphs->stride + gx / 8] & bit ? fg :
+                         under != NULL ? under[offset] : bg;
+        offset += glyphs->step_y;
+      }
+    }
+  }
+
+  /* Underline on the bottom row of the cell */
+
+  if (c->attr & CONS_ATTR_UNDERLINE)
+  {
+    uint16_t *px = origin + (inst->char_height - 1) * glyphs->step_y;
+
+    for (size_t gx = 0; gx < inst->char_width; gx++)
+    {
+      *px = fg;
+      px += glyphs->step_x;
+    }
+  }
+
+  return true;
+}
+
+/* Moves a rectangle on screen by dx and dy pixels, for scrolling part
+ * of the screen. Every line along the direction that is contiguous in
+ * memory is one memmove, in an order that doesn't overwrite lines that
+ * still have to move. Returns false when the framebuffer can't be
+ * written directly, the caller then redraws the cells.
+ */
+
+bool console_glyph_move(struct cons_insts_s *inst, size_t x, size_t y,
+                        size_t w, size_t h, int dx, int dy)
+{
+  struct cons_glyph_atlas_s *glyphs = &inst->glyphs;
+
+  if (glyphs->bits == NULL)
+  {
+    return false;
+  }
+
+  if (glyphs->step_x == 1 || glyphs->step_x == -1)
+  {
+    /* Screen rows are lines in memory, the span starts at the lowest
+     * address
+     */
+
+    size_t first = glyphs->step_x == 1 ? 0 : w - 1;
+
+    for (size_t i = 0; i < h; i++)
+    {
+      size_t r = dy > 0 ? h - 1 - i : i;
+      ptrdiff_t src = console_glyph_offset(inst, x + first, y + r);
+      ptrdiff_t dst = console_glyph_offset(inst, x + dx + first,
+                                           y + dy + r);
+
+      memmove(glyphs->pixels + dst, glyphs->pixels + src,
+              w * sizeof(uint16_t));
+    }
+  }
+  else
+  {
+    /* Rotated, screen columns are lines in memory */
+
+    size_t first = glyphs->step_y == 1 ? 0 : h - 1;
+
+    for (size_t i = 0; i < w; i++)
+    {
+      size_t c = dx > 0 ? w - 1 - i : i;
+      ptrdiff_t src = console_glyph_offset(inst, x + c, y + first);
+      ptrdiff_t dst = console_glyph_offset(inst, x + dx + c,
+                                           y + dy + first);
+
+      memmove(glyphs->pixels + dst, glyphs->pixels + src,
+              h * sizeof(uint16_t));
+    }
+  }
+
+  return true;
+}
@@ -0,0 +1,105 @@
+/******************************************************************************
+ * MIT License
+ * 
+ * Copyright (c) 2025 Kevin Witteveen (MartiniMarter)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *****************************************************************************/
+
+#ifndef _CONSOLE_INTERNAL_H
+#define _CONSOLE_INTERNAL_H
+
+/******************************************************************************
+ * Includes
+ *****************************************************************************/
+
+#include "console.h"
+
+/******************************************************************************
+ * Private Functions
+ *****************************************************************************/
+
+/* Shared between the console source files, not part of the public API */
+
+/* Draws a single cell from the grid, through the glyph atlas when
+ * possible and with pax text drawing otherwise.
+ */
+
+void console_draw_char(struct cons_insts_s *inst, size_t x, size_t y,
+                       const struct cons_char_s *c);
+void console_draw_char_pax(struct cons_insts_s *inst, size_t x, size_t y,
+                           const struct cons_char_s *c);
+
+/* Converts between ARGB and the color format of the cells */
+
+cons_col_t console_col_native(struct cons_insts_s *inst, pax_col_t col);
+pax_col_t console_col_argb(struct cons_insts_s *inst, cons_col_t col);
+
+/* Escape sequence parser, see console_parser.c. Feeds printable
+ * characters to console_print, C0 controls to
+ * console_handle_special_char and completed sequences to the
+ * console_escparse_ dispatchers.
+ */
+
+void console_parser_reset(struct cons_insts_s *inst);
+void console_parser_advance(struct cons_insts_s *inst, char c);
+
+bool console_parser_idle(struct cons_insts_s *inst);
+
+void console_print(struct cons_insts_s *inst, uint32_t cp);
+void console_print_span(struct cons_insts_s *inst, const char *str,
+                        size_t len);
+size_t console_printable_run(const char *buf, size_t len);
+
+/* Writes cp as UTF-8 to buf, which has room for 4 bytes. Returns the
+ * length, without a terminator.
+ */
+
+size_t console_utf8_encode(uint32_t cp, char *buf);
+int console_handle_special_char(struct cons_insts_s *inst, char *c);
+void console_escparse_esc(struct cons_insts_s *inst, char c);
+void console_escparse_csi(struct cons_insts_s *inst, char c);
+void console_escparse_osc(struct cons_insts_s *inst);
+
+/* Scrollback, see console_scrollback.c */
+
+int console_scrollback_init(struct cons_insts_s *inst, size_t lines);
+void console_scrollback_deinit(struct cons_insts_s *inst);
+int console_scrollback_resize(struct cons_insts_s *inst, size_t width);
+void console_scrollback_push(struct cons_insts_s *inst,
+                             const struct cons_char_s *cells);
+const struct cons_char_s *console_scrollback_row(struct cons_insts_s *inst,
+                                                 size_t y);
+
+/* Background image, see console_background.c */
+
+void console_background_deinit(struct cons_insts_s *inst);
+void console_background_fill(struct cons_insts_s *inst);
+void console_background_draw(struct cons_insts_s *inst, size_t x, size_t y);
+
+/* Glyph atlas, see console_glyph.c */
+
+int console_glyph_init(struct cons_insts_s *inst);
+void console_glyph_deinit(struct cons_insts_s *inst);
+bool console_glyph_draw(struct cons_insts_s *inst, size_t x, size_t y,
+                        const struct cons_char_s *c);
+bool console_glyph_move(struct cons_insts_s *inst, size_t x, size_t y,
+                        size_t w, size_t h, int dx, int dy);
+
+#endif /* _CONSOLE_INTERNAL_H */
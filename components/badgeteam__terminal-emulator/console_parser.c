@@ -0,0 +1,591 @@
+/******************************************************************************
+ * MIT License
+ * 
+ * Copyright (c) 2025 Kevin Witteveen (MartiniMarter)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *****************************************************************************/
+
+/******************************************************************************
+ * Includes
+ *****************************************************************************/
+
+#include "console_internal.h"
+#include <stdint.h>
+#include <string.h>
+
+/******************************************************************************
+ * Preprocessors
+ *****************************************************************************/
+
+/* A table entry holds the action in the high nibble and the next state
+ * in the low nibble. CONS_VT_STAY keeps the current state without
+ * running the exit and entry actions.
+ */
+
+#define CONS_VT(action, state) \
+  ((uint8_t)((CONS_VT_ACT_##action << 4) | CONS_VT_##state))
+
+#define CONS_VT_ACTION(entry) ((entry) >> 4)
+#define CONS_VT_STATE(entry)  ((entry) & 0x0F)
+
+/* C0 controls that are executed inside most sequences */
+
+#define CONS_VT_C0(action) \
+  [0x00 ... 0x17] = CONS_VT(action, STAY), \
+  [0x19]          = CONS_VT(action, STAY), \
+  [0x1C ... 0x1F] = CONS_VT(action, STAY)
+
+/* CAN and SUB abort a sequence, ESC starts a new one from any state */
+
+#define CONS_VT_ANYWHERE \
+  [0x18] = CONS_VT(EXECUTE, GROUND), \
+  [0x1A] = CONS_VT(EXECUTE, GROUND), \
+  [0x1B] = CONS_VT(NONE, ESCAPE)
+
+/******************************************************************************
+ * Datatypes
+ *****************************************************************************/
+
+/* Parser states, after the DEC VT500 parser by Paul Williams.
+ * The 8 bit C1 controls are left out, 0x80 and up is UTF-8 text.
+ */
+
+enum cons_vt_state_e
+{
+  CONS_VT_GROUND = 0,
+  CONS_VT_ESCAPE,
+  CONS_VT_ESCAPE_INTERMEDIATE,
+  CONS_VT_CSI_ENTRY,
+  CONS_VT_CSI_PARAM,
+  CONS_VT_CSI_INTERMEDIATE,
+  CONS_VT_CSI_IGNORE,
+  CONS_VT_DCS_ENTRY,
+  CONS_VT_DCS_PARAM,
+  CONS_VT_DCS_INTERMEDIATE,
+  CONS_VT_DCS_PASSTHROUGH,
+  CONS_VT_DCS_IGNORE,
+  CONS_VT_OSC_STRING,
+  CONS_VT_SOS_PM_APC_STRING,
+  CONS_VT_STATE_COUNT,
+
+  CONS_VT_STAY = 0x0F
+};
+
+enum cons_vt_action_e
+{
+  CONS_VT_ACT_NONE = 0,
+  CONS_VT_ACT_IGNORE = 0, /* Same thing, reads better in the table */
+  CONS_VT_ACT_PRINT,
+  CONS_VT_ACT_UTF8,
+  CONS_VT_ACT_EXECUTE,
+  CONS_VT_ACT_COLLECT,
+  CONS_VT_ACT_PARAM,
+  CONS_VT_ACT_ESC_DISPATCH,
+  CONS_VT_ACT_CSI_DISPATCH,
+  CONS_VT_ACT_PUT,
+  CONS_VT_ACT_OSC_PUT
+};
+
+/******************************************************************************
+ * Globals
+ *****************************************************************************/
+
+/* Transitions for every state and byte. Every row covers all 256 bytes
+ * without overlapping ranges, an entry of zero would mean GROUND.
+ */
+
+static const uint8_t g_cons_vt_table[CONS_VT_STATE_COUNT][256] =
+{
+  [CONS_VT_GROUND] =
+  {
+    CONS_VT_C0(EXECUTE),
+    [0x20 ... 0x7E] = CONS_VT(PRINT, STAY),
+    [0x7F]          = CONS_VT(IGNORE, STAY),
+    [0x80 ... 0xFF] = CONS_VT(UTF8, STAY),
+    CONS_VT_ANYWHERE
+  },
+
+  [CONS_VT_ESCAPE] =
+  {
+    CONS_VT_C0(EXECUTE),
+    [0x20 ... 0x2F] = CONS_VT(COLLECT, ESCAPE_INTERMEDIATE),
+    [0x30 ... 0x4F] = CONS_VT(ESC_DISPATCH, GROUND),
+    ['P']           = CONS_VT(NONE, DCS_ENTRY),
+    [0x51 ... 0x57] = CONS_VT(ESC_DISPATCH, GROUND),
+    ['X']           = CONS_VT(NONE, SOS_PM_APC_STRING),
+    [0x59 ... 0x5A] = CONS_VT(ESC_DISPATCH, GROUND),
+    ['[']           = CONS_VT(NONE, CSI_ENTRY),
+    ['\\']          = CONS_VT(ESC_DISPATCH, GROUND),
+    [']']           = CONS_VT(NONE, OSC_STRING),
+    ['^' ... '_']   = CONS_VT(NONE, SOS_PM_APC_STRING),
+    [0x60 ... 0x7E] = CONS_VT(ESC_DISPATCH, GROUND),
+    [0x7F ... 0xFF] = CONS_VT(IGNORE, STAY),
+    CONS_VT_ANYWHERE
+  },
+
+  [CONS_VT_ESCAPE_INTERMEDIATE] =
+  {
+    CONS_VT_C0(EXECUTE),
+    [0x20 ... 0x2F] = CONS_VT(COLLECT, STAY),
+    [0x30 ... 0x7E] = CONS_VT(ESC_DISPATCH, GROUND),
+    [0x7F ... 0xFF] = CONS_VT(IGNORE, STAY),
+    CONS_VT_ANYWHERE
+  },
+
+  [CONS_VT_CSI_ENTRY] =
+  {
+    CONS_VT_C0(EXECUTE),
+    [0x20 ... 0x2F] = CONS_VT(COLLECT, CSI_INTERMEDIATE),
+    [0x30 ... 0x3B] = CONS_VT(PARAM, CSI_PARAM),
+    [0x3C ... 0x3F] = CONS_VT(COLLECT, CSI_PARAM),
+    [0x40 ... 0x7E] = CONS_VT(CSI_DISPATCH, GROUND),
+    [0x7F ... 0xFF] = CONS_VT(IGNORE, STAY),
+    CONS_VT_ANYWHERE
+  },
+
+  [CONS_VT_CSI_PARAM] =
+  {
+    CONS_VT_C0(EXECUTE),
+    [0x20 ... 0x2F] = CONS_VT(COLLECT, CSI_INTERMEDIATE),
+    [0x30 ... 0x3B] = CONS_VT(PARAM, STAY),
+    [0x3C ... 0x3F] = CONS_VT(NONE, CSI_IGNORE),
+    [0x40 ... 0x7E] = CONS_VT(CSI_DISPATCH, GROUND),
+    [0x7F ... 0xFF] = CONS_VT(IGNORE, STAY),
+    CONS_VT_ANYWHERE
+  },
+
+  [CONS_VT_CSI_INTERMEDIATE] =
+  {
+    CONS_VT_C0(EXECUTE),
+    [0x20 ... 0x2F] = CONS_VT(COLLECT, STAY),
+    [0x30 ... 0x3F] = CONS_VT(NONE, CSI_IGNORE),
+    [0x40 ... 0x7E] = CONS_VT(CSI_DISPATCH, GROUND),
+    [0x7F ... 0xFF] = CONS_VT(IGNORE, STAY),
+    CONS_VT_ANYWHERE
+  },
+
+  [CONS_VT_CSI_IGNORE] =
+  {
+    CONS_VT_C0(EXECUTE),
+    [0x20 ... 0x3F] = CONS_VT(IGNORE, STAY),
+    [0x40 ... 0x7E] = CONS_VT(NONE, GROUND),
+    [0x7F ... 0xFF] = CONS_VT(IGNORE, STAY),
+    CONS_VT_ANYWHERE
+  },
+
+  [CONS_VT_DCS_ENTRY] =
+  {
+    CONS_VT_C0(IGNORE),
+    [0x20 ... 0x2F] = CONS_VT(COLLECT, DCS_INTERMEDIATE),
+    [0x30 ... 0x3B] = CONS_VT(PARAM, DCS_PARAM),
+    [0x3C ... 0x3F] = CONS_VT(COLLECT, DCS_PARAM),
+    [0x40 ... 0x7E] = CONS_VT(NONE, DCS_PASSTHROUGH),
+    [0x7F ... 0xFF] = CONS_VT(IGNORE, STAY),
+    CONS_VT_ANYWHERE
+  },
+
+  [CONS_VT_DCS_PARAM] =
+  {
+    CONS_VT_C0(IGNORE),
+    [0x20 ... 0x2F] = CONS_VT(COLLECT, DCS_INTERMEDIATE),
+    [0x30 ... 0x3B] = CONS_VT(PARAM, STAY),
+    [0x3C ... 0x3F] = CONS_VT(NONE, DCS_IGNORE),
+    [0x40 ... 0x7E] = CONS_VT(NONE, DCS_PASSTHROUGH),
+    [0x7F ... 0xFF] = CONS_VT(IGNORE, STAY),
+    CONS_VT_ANYWHERE
+  },
+
+  [CONS_VT_DCS_INTERMEDIATE] =
+  {
+    CONS_VT_C0(IGNORE),
+    [0x20 ... 0x2F] = CONS_VT(COLLECT, STAY),
+    [0x30 ... 0x3F] = CONS_VT(NONE, DCS_IGNORE),
+    [0x40 ... 0x7E] = CONS_VT(NONE, DCS_PASSTHROUGH),
+    [0x7F ... 0xFF] = CONS_VT(IGNORE, STAY),
+    CONS_VT_ANYWHERE
+  },
+
+  [CONS_VT_DCS_PASSTHROUGH] =
+  {
+    CONS_VT_C0(PUT),
+    [0x20 ... 0x7E] = CONS_VT(PUT, STAY),
+    [0x7F]          = CONS_VT(IGNORE, STAY),
+    [0x80 ... 0xFF] = CONS_VT(PUT, STAY),
+    CONS_VT_ANYWHERE
+  },
+
+  [CONS_VT_DCS_IGNORE] =
+  {
+    CONS_VT_C0(IGNORE),
+    [0x20 ... 0xFF] = CONS_VT(IGNORE, STAY),
+    CONS_VT_ANYWHERE
+  },
+
+  /* xterm also ends an OSC string with BEL */
+
+  [CONS_VT_OSC_STRING] =
+  {
+    [0x00 ... 0x06] = CONS_VT(IGNORE, STAY),
+    [0x07]          = CONS_VT(NONE, GROUND),
+    [0x08 ... 0x17] = CONS_VT(IGNORE, STAY),
+    [0x19]          = CONS_VT(IGNORE, STAY),
+    [0x1C ... 0x1F] = CONS_VT(IGNORE, STAY),
+    [0x20 ... 0xFF] = CONS_VT(OSC_PUT, STAY),
+    CONS_VT_ANYWHERE
+  },
+
+  [CONS_VT_SOS_PM_APC_STRING] =
+  {
+    CONS_VT_C0(IGNORE),
+    [0x20 ... 0xFF] = CONS_VT(IGNORE, STAY),
+    CONS_VT_ANYWHERE
+  }
+};
+
+/******************************************************************************
+ * Private Functions
+ *****************************************************************************/
+
+/* Forget everything collected for the previous sequence */
+
+static void console_parser_clear(struct cons_parser_s *parser)
+{
+  parser->ignore = false;
+  parser->private_marker = 0;
+  parser->intermediate_count = 0;
+  parser->param_count = 0;
+  memset(parser->params, 0, sizeof(parser->params));
+}
+
+/* Intermediates and private markers */
+
+static void console_parser_collect(struct cons_parser_s *parser, uint8_t c)
+{
+  if (c >= 0x3C && c <= 0x3F)
+  {
+    parser->private_marker = c;
+    return;
+  }
+
+  if (parser->intermediate_count >= CONSOLE_ESC_INTERMEDIATES)
+  {
+    /* Not a sequence we could know about */
+
+    parser->ignore = true;
+    return;
+  }
+
+  parser->intermediates[parser->intermediate_count++] = c;
+}
+
+/* Numeric parameters are built up while the digits come in. Parameters
+ * past CONSOLE_ESC_PARAMS are dropped, big values saturate.
+ */
+
+static void console_parser_param(struct cons_parser_s *parser, uint8_t c)
+{
+  if (parser->param_count == 0)
+  {
+    parser->param_count = 1;
+  }
+
+  if (c == ';' || c == ':')
+  {
+    if (parser->param_count <= CONSOLE_ESC_PARAMS)
+    {
+      parser->param_count++;
+    }
+
+    return;
+  }
+
+  size_t index = parser->param_count - 1;
+  if (index >= CONSOLE_ESC_PARAMS)
+  {
+    return;
+  }
+
+  uint32_t value = parser->params[index] * 10 + (c - '0');
+  parser->params[index] = value > UINT16_MAX ? UINT16_MAX : value;
+}
+
+/* Streaming UTF-8 decoder. Broken sequences print one replacement
+ * character, overlong encodings and surrogates too.
+ */
+
+static void console_parser_utf8(struct cons_insts_s *inst, uint8_t c)
+{
+  struct cons_parser_s *parser = &inst->parser;
+
+  if ((c & 0xC0) == 0x80)
+  {
+    /* Continuation byte */
+
+    if (parser->utf8_needed == 0)
+    {
+      console_print(inst, CONSOLE_REPLACEMENT_CHAR);
+      return;
+    }
+
+    parser->utf8_codepoint = (parser->utf8_codepoint << 6) | (c & 0x3F);
+    if (--parser->utf8_needed > 0)
+    {
+      return;
+    }
+
+    uint32_t cp = parser->utf8_codepoint;
+    if (cp < parser->utf8_min || cp > 0x10FFFF ||
+        (cp >= 0xD800 && cp <= 0xDFFF))
+    {
+      cp = CONSOLE_REPLACEMENT_CHAR;
+    }
+
+    console_print(inst, cp);
+    return;
+  }
+
+  /* Lead byte, the previous sequence was cut short */
+
+  if (parser->utf8_needed > 0)
+  {
+    parser->utf8_needed = 0;
+    console_print(inst, CONSOLE_REPLACEMENT_CHAR);
+  }
+
+  if (c >= 0xC2 && c <= 0xDF)
+  {
+    parser->utf8_codepoint = c & 0x1F;
+    parser->utf8_min = 0x80;
+    parser->utf8_needed = 1;
+  }
+  else if (c >= 0xE0 && c <= 0xEF)
+  {
+    parser->utf8_codepoint = c & 0x0F;
+    parser->utf8_min = 0x800;
+    parser->utf8_needed = 2;
+  }
+  else if (c >= 0xF0 && c <= 0xF4)
+  {
+    parser->utf8_codepoint = c & 0x07;
+    parser->utf8_min = 0x10000;
+    parser->utf8_needed = 3;
+  }
+  else
+  {
+    console_print(inst, CONSOLE_REPLACEMENT_CHAR);
+  }
+}
+
+static void console_parser_enter(struct cons_insts_s *inst, uint8_t state)
+{
+  struct cons_parser_s *parser = &inst->parser;
+
+  switch (state)
+  {
+    case CONS_VT_ESCAPE:
+    case CONS_VT_CSI_ENTRY:
+    case CONS_VT_DCS_ENTRY:
+    {
+      console_parser_clear(parser);
+      break;
+    }
+
+    case CONS_VT_OSC_STRING:
+    {
+      parser->osc_len = 0;
+      break;
+    }
+
+    default:
+    {
+      break;
+    }
+  }
+
+  parser->state = state;
+}
+
+static void console_parser_exit(struct cons_insts_s *inst, uint8_t c)
+{
+  struct cons_parser_s *parser = &inst->parser;
+
+  /* An OSC string ends with BEL or ST. CAN and SUB throw it away. */
+
+  if (parser->state == CONS_VT_OSC_STRING && c != 0x18 && c != 0x1A)
+  {
+    parser->osc_buf[parser->osc_len] = 0x00;
+    console_escparse_osc(inst);
+  }
+}
+
+/******************************************************************************
+ * Public Functions
+ *****************************************************************************/
+
+void console_parser_reset(struct cons_insts_s *inst)
+{
+  console_parser_clear(&inst->parser);
+  inst->parser.state = CONS_VT_GROUND;
+  inst->parser.osc_len = 0;
+  inst->parser.utf8_needed = 0;
+}
+
+/* True when not inside an escape or UTF-8 sequence, so text can be
+ * printed directly
+ */
+
+bool console_parser_idle(struct cons_insts_s *inst)
+{
+  return inst->parser.state == CONS_VT_GROUND &&
+         inst->parser.utf8_needed == 0;
+}
+
+size_t console_utf8_encode(uint32_t cp, char *buf)
+{
+  if (cp < 0x80)
+  {
+    buf[0] = cp;
+    return 1;
+  }
+
+  if (cp < 0x800)
+  {
+    buf[0] = 0xC0 | (cp >> 6);
+    buf[1] = 0x80 | (cp & 0x3F);
+    return 2;
+  }
+
+  if (cp < 0x10000)
+  {
+    buf[0] = 0xE0 | (cp >> 12);
+    buf[1] = 0x80 | ((cp >> 6) & 0x3F);
+    buf[2] = 0x80 | (cp & 0x3F);
+    return 3;
+  }
+
+  buf[0] = 0xF0 | (cp >> 18);
+  buf[1] = 0x80 | ((cp >> 12) & 0x3F);
+  buf[2] = 0x80 | ((cp >> 6) & 0x3F);
+  buf[3] = 0x80 | (cp & 0x3F);
+  return 4;
+}
+
+void console_parser_advance(struct cons_insts_s *inst, char character)
+{
+  struct cons_parser_s *parser = &inst->parser;
+  uint8_t c = (uint8_t)character;
+  uint8_t entry = g_cons_vt_table[parser->state][c];
+  uint8_t next = CONS_VT_STATE(entry);
+
+  /* Anything but a continuation byte ends a UTF-8 sequence */
+
+  if (parser->utf8_needed > 0 && c < 0x80)
+  {
+    parser->utf8_needed = 0;
+    console_print(inst, CONSOLE_REPLACEMENT_CHAR);
+  }
+
+  if (next != CONS_VT_STAY)
+  {
+    console_parser_exit(inst, c);
+  }
+
+  switch (CONS_VT_ACTION(entry))
+  {
+    case CONS_VT_ACT_PRINT:
+    {
+      console_print(inst, c);
+      break;
+    }
+
+    case CONS_VT_ACT_UTF8:
+    {
+      console_parser_utf8(inst, c);
+      break;
+    }
+
+    case CONS_VT_ACT_EXECUTE:
+    {
+      console_handle_special_char(inst, &character);
+      break;
+    }
+
+    case CONS_VT_ACT_COLLECT:
+    {
+      console_parser_collect(parser, c);
+      break;
+    }
+
+    case CONS_VT_ACT_PARAM:
+    {
+      console_parser_param(parser, c);
+      break;
+    }
+
+    case CONS_VT_ACT_ESC_DISPATCH:
+    {
+      if (!parser->ignore)
+      {
+        console_escparse_esc(inst, character);
+      }
+      break;
+    }
+
+    case CONS_VT_ACT_CSI_DISPATCH:
+    {
+      if (!parser->ignore)
+      {
+        if (parser->param_count > CONSOLE_ESC_PARAMS)
+        {
+          parser->param_count = CONSOLE_ESC_PARAMS;
+        }
+
+        console_escparse_csi(inst, character);
+      }
+      break;
+    }
+
+    case CONS_VT_ACT_OSC_PUT:
+    {
+      /* Keep one byte for the terminator, the rest is cut off */
+
+      if (parser->osc_len < sizeof(parser->osc_buf) - 1)
+      {
+        parser->osc_buf[parser->osc_len++] = character;
+      }
+      break;
+    }
+
+    /* DCS strings (sixel, DECRQSS, ..) are not supported, their
+     * content is consumed without effect
+     */
+
+    case CONS_VT_ACT_PUT:
+    default:
+    {
+      break;
+    }
+  }
+
+  if (next != CONS_VT_STAY)
+  {
+    console_parser_enter(inst, next);
+  }
+}
@@ -0,0 +1,468 @@
+/******************************************************************************
+ * MIT License
+ * 
+ * Copyright (c) 2025 Kevin Witteveen (MartiniMarter)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *****************************************************************************/
+
+/******************************************************************************
+ * Includes
+ *****************************************************************************/
+
+#include "console_internal.h"
+#include "esp_heap_caps.h"
+#include "freertos/portable.h"
+#include <string.h>
+
+/******************************************************************************
+ * Preprocessors
+ *****************************************************************************/
+
+/* Line record: u16 text cells, u16 runs, the runs as u16 length, u8
+ * attributes, fg and bg in the cell format, then the text as UTF-8. The
+ * runs cover the whole width, the text stops at the last non-blank cell.
+ */
+
+#define CONS_SB_HEADER_SIZE 4
+#define CONS_SB_RUN_SIZE    (3 + 2 * sizeof(cons_col_t))
+
+/* Most bytes a line of width cells can take */
+
+#define CONS_SB_MAX_RECORD(width) \
+  (CONS_SB_HEADER_SIZE + (width) * (CONS_SB_RUN_SIZE + 4))
+
+/******************************************************************************
+ * Globals
+ *****************************************************************************/
+
+static const char CONS_SB_TAG[] = "CONS_SB";
+
+/******************************************************************************
+ * Private Functions
+ *****************************************************************************/
+
+/* PSRAM is not always word accessible, so fields go through memcpy */
+
+static inline void console_sb_put16(uint8_t *p, uint16_t v)
+{
+  memcpy(p, &v, sizeof(v));
+}
+
+static inline void console_sb_put_col(uint8_t *p, cons_col_t v)
+{
+  memcpy(p, &v, sizeof(v));
+}
+
+static inline uint16_t console_sb_get16(const uint8_t *p)
+{
+  uint16_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline cons_col_t console_sb_get_col(const uint8_t *p)
+{
+  cons_col_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+/* Run-length encodes the attributes and stores the text. The fg of a
+ * blank cell without underline is invisible, so those blanks join the
+ * run they are in.
+ */
+
+static size_t console_sb_encode(const struct cons_char_s *cells, size_t width,
+                                uint8_t *out)
+{
+  size_t text_cells = width;
+  while (text_cells > 0 && cells[text_cells - 1].character == ' ')
+  {
+    text_cells--;
+  }
+
+  uint8_t *p = out + CONS_SB_HEADER_SIZE;
+  size_t runs = 0;
+  size_t x = 0;
+
+  while (x < width)
+  {
+    size_t start = x;
+    cons_col_t fg = cells[x].fg;
+    cons_col_t bg = cells[x].bg;
+    uint8_t attr = cells[x].attr;
+
+    while (x < width && cells[x].bg == bg && cells[x].attr == attr &&
+           (cells[x].fg == fg ||
+            (cells[x].character == ' ' && !(attr & CONS_ATTR_BLANK_FG))))
+    {
+      x++;
+    }
+
+    console_sb_put16(p, x - start);
+    p[2] = attr;
+    console_sb_put_col(p + 3, fg);
+    console_sb_put_col(p + 3 + sizeof(cons_col_t), bg);
+    p += CONS_SB_RUN_SIZE;
+    runs++;
+  }
+
+  for (size_t i = 0; i < text_cells; i++)
+  {
+    p += console_utf8_encode(cells[i].character, (char *)p);
+  }
+
+  console_sb_put16(out, text_cells);
+  console_sb_put16(out + 2, runs);
+  return p - out;
+}
+
+/* Unpacks a record into width cells. Lines from a wider console are
+ * cut off, narrower ones are padded with the last attributes.
+ */
+
+static void console_sb_decode(const uint8_t *in, struct cons_char_s *cells,
+                              size_t width)
+{
+  size_t text_cells = console_sb_get16(in);
+  size_t runs = console_sb_get16(in + 2);
+  const uint8_t *p = in + CONS_SB_HEADER_SIZE;
+  struct cons_char_s blank =
+  {
+    .character = ' '
+  };
+
+  size_t x = 0;
+  for (size_t r = 0; r < runs; r++)
+  {
+    size_t len = console_sb_get16(p);
+    blank.attr = p[2];
+    blank.fg = console_sb_get_col(p + 3);
+    blank.bg = console_sb_get_col(p + 3 + sizeof(cons_col_t));
+    p += CONS_SB_RUN_SIZE;
+
+    for (size_t i = 0; i < len && x < width; i++)
+    {
+      cells[x++] = blank;
+    }
+  }
+
+  while (x < width)
+  {
+    cells[x++] = blank;
+  }
+
+  /* The text is our own UTF-8, no need to check it */
+
+  for (x = 0; x < text_cells; x++)
+  {
+    uint32_t cp = *p++;
+
+    if (cp >= 0xF0)
+    {
+      cp = ((cp & 0x07) << 18) | ((p[0] & 0x3F) << 12) |
+           ((p[1] & 0x3F) << 6) | (p[2] & 0x3F);
+      p += 3;
+    }
+    else if (cp >= 0xE0)
+    {
+      cp = ((cp & 0x0F) << 12) | ((p[0] & 0x3F) << 6) | (p[1] & 0x3F);
+      p += 2;
+    }
+    else if (cp >= 0xC0)
+    {
+      cp = ((cp & 0x1F) << 6) | (p[0] & 0x3F);
+      p += 1;
+    }
+
+    if (x < width)
+    {
+      cells[x].character = cp;
+    }
+  }
+}
+
+/* Line n, counted from the oldest */
+
+static struct cons_sb_line_s *console_sb_line(struct cons_scrollback_s *sb,
+                                              size_t n)
+{
+  return &sb->lines[(sb->first + n) % sb->max_lines];
+}
+
+static void console_sb_drop_oldest(struct cons_scrollback_s *sb)
+{
+  sb->first = (sb->first + 1) % sb->max_lines;
+  sb->count--;
+
+  if (sb->view > sb->count)
+  {
+    sb->view = sb->count;
+  }
+}
+
+/* Makes room for need bytes at head, dropping the oldest lines that are
+ * in the way. Records never wrap, when the end of the store is reached
+ * writing goes on at the start.
+ */
+
+static void console_sb_reserve(struct cons_scrollback_s *sb, size_t need)
+{
+  if (sb->head + need > sb->size)
+  {
+    /* The lines at the end are the oldest ones */
+
+    while (sb->count > 0 && console_sb_line(sb, 0)->offset >= sb->head)
+    {
+      console_sb_drop_oldest(sb);
+    }
+
+    sb->head = 0;
+  }
+
+  while (sb->count > 0)
+  {
+    struct cons_sb_line_s *oldest = console_sb_line(sb, 0);
+    if (oldest->offset >= sb->head + need ||
+        oldest->offset + oldest->len <= sb->head)
+    {
+      break;
+    }
+
+    console_sb_drop_oldest(sb);
+  }
+
+  if (sb->count == sb->max_lines)
+  {
+    console_sb_drop_oldest(sb);
+  }
+}
+
+/******************************************************************************
+ * Public Functions
+ *****************************************************************************/
+
+int console_scrollback_init(struct cons_insts_s *inst, size_t lines)
+{
+  struct cons_scrollback_s *sb = &inst->scrollback;
+
+  memset(sb, 0, sizeof(*sb));
+  if (lines == 0)
+  {
+    return 0;
+  }
+
+  sb->max_lines = lines;
+  sb->size = lines * CONSOLE_SCROLLBACK_LINE_BYTES;
+
+  /* One line has to fit even when the average is set very low */
+
+  if (sb->size < CONS_SB_MAX_RECORD(inst->chars_x))
+  {
+    sb->size = CONS_SB_MAX_RECORD(inst->chars_x);
+  }
+
+  sb->data = heap_caps_malloc(sb->size, MALLOC_CAP_SPIRAM);
+  sb->lines = heap_caps_malloc(lines * sizeof(struct cons_sb_line_s),
+                               MALLOC_CAP_SPIRAM);
+  sb->row = pvPortMalloc(inst->chars_x * sizeof(struct cons_char_s));
+  sb->row_width = inst->chars_x;
+  if (sb->data == NULL || sb->lines == NULL || sb->row == NULL)
+  {
+    ESP_LOGE(CONS_SB_TAG, "Allocation error, no scrollback");
+    console_scrollback_deinit(inst);
+    return -1;
+  }
+
+  ESP_LOGI(CONS_SB_TAG, "%zu lines in %zu + %zu bytes of PSRAM", lines,
+           sb->size, lines * sizeof(struct cons_sb_line_s));
+  return 0;
+}
+
+void console_scrollback_deinit(struct cons_insts_s *inst)
+{
+  struct cons_scrollback_s *sb = &inst->scrollback;
+
+  if (sb->data != NULL)
+  {
+    heap_caps_free(sb->data);
+  }
+
+  if (sb->lines != NULL)
+  {
+    heap_caps_free(sb->lines);
+  }
+
+  if (sb->row != NULL)
+  {
+    vPortFree(sb->row);
+  }
+
+  memset(sb, 0, sizeof(*sb));
+}
+
+/* Makes room for lines width cells wide before the screen changes to
+ * it. Nothing is shrunk, so a failure leaves everything as it was and
+ * the screen can stay at its old width.
+ */
+
+int console_scrollback_resize(struct cons_insts_s *inst, size_t width)
+{
+  struct cons_scrollback_s *sb = &inst->scrollback;
+
+  if (sb->data == NULL)
+  {
+    return 0;
+  }
+
+  struct cons_char_s *row = NULL;
+  uint8_t *data = NULL;
+
+  if (width > sb->row_width)
+  {
+    row = pvPortMalloc(width * sizeof(struct cons_char_s));
+    if (row == NULL)
+    {
+      return -1;
+    }
+  }
+
+  /* The records stay at the same offsets, the store only gets longer */
+
+  if (sb->size < CONS_SB_MAX_RECORD(width))
+  {
+    data = heap_caps_malloc(CONS_SB_MAX_RECORD(width), MALLOC_CAP_SPIRAM);
+    if (data == NULL)
+    {
+      vPortFree(row);
+      return -1;
+    }
+
+    memcpy(data, sb->data, sb->size);
+    heap_caps_free(sb->data);
+    sb->data = data;
+    sb->size = CONS_SB_MAX_RECORD(width);
+  }
+
+  if (row != NULL)
+  {
+    vPortFree(sb->row);
+    sb->row = row;
+    sb->row_width = width;
+  }
+
+  return 0;
+}
+
+/* Keeps a line that scrolls off the top of the screen */
+
+void console_scrollback_push(struct cons_insts_s *inst,
+                             const struct cons_char_s *cells)
+{
+  struct cons_scrollback_s *sb = &inst->scrollback;
+
+  if (sb->data == NULL)
+  {
+    return;
+  }
+
+  console_sb_reserve(sb, CONS_SB_MAX_RECORD(inst->chars_x));
+
+  struct cons_sb_line_s *line = console_sb_line(sb, sb->count);
+  line->offset = sb->head;
+  line->len = console_sb_encode(cells, inst->chars_x, &sb->data[sb->head]);
+  sb->head += line->len;
+  sb->count++;
+
+  /* Keep showing the same lines while looking back */
+
+  if (sb->view > 0 && sb->view < sb->count)
+  {
+    sb->view++;
+  }
+}
+
+void console_scrollback_clear(struct cons_insts_s *inst)
+{
+  struct cons_scrollback_s *sb = &inst->scrollback;
+
+  if (sb->view > 0)
+  {
+    inst->pending_scroll.lines = 0;
+  }
+
+  sb->first = 0;
+  sb->count = 0;
+  sb->head = 0;
+  sb->view = 0;
+}
+
+size_t console_scrollback_lines(struct cons_insts_s *inst)
+{
+  return inst->scrollback.count;
+}
+
+size_t console_scrollback_view(struct cons_insts_s *inst, int lines)
+{
+  struct cons_scrollback_s *sb = &inst->scrollback;
+  int view = (int)sb->view + lines;
+
+  if (view < 0)
+  {
+    view = 0;
+  }
+
+  if (view > (int)sb->count)
+  {
+    view = sb->count;
+  }
+
+  /* Rendering compares every cell, the pixels can't just be scrolled */
+
+  if ((size_t)view != sb->view)
+  {
+    sb->view = view;
+    inst->pending_scroll.lines = 0;
+  }
+
+  return sb->view;
+}
+
+void console_scrollback_live(struct cons_insts_s *inst)
+{
+  console_scrollback_view(inst, -(int)inst->scrollback.view);
+}
+
+/* The cells shown on screen row y, history while looking back */
+
+const struct cons_char_s *console_scrollback_row(struct cons_insts_s *inst,
+                                                 size_t y)
+{
+  struct cons_scrollback_s *sb = &inst->scrollback;
+
+  if (y >= sb->view)
+  {
+    return &inst->char_alloc[(y - sb->view) * inst->chars_x];
+  }
+
+  struct cons_sb_line_s *line = console_sb_line(sb, sb->count - sb->view + y);
+  console_sb_decode(&sb->data[line->offset], sb->row, inst->chars_x);
+  return sb->row;
+}
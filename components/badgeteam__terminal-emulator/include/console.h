@@ -30,11 +30,14 @@
  *****************************************************************************/
 
 #include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
 #include "pax_fonts.h"
 #include "pax_gfx.h"
 #include "pax_text.h"
 #include "freertos/idf_additions.h"
 #include "esp_log.h"
+#include "sdkconfig.h"
 
 /******************************************************************************
  * Preprocessors
@@ -56,14 +59,71 @@
 
 #define CONSOLE_PACK_CHARACTERS 1
 
+/* Bits of a color in a cell. Cells hold colors in the format of the
+ * display: RGB565 as stored in the framebuffer, or an index in the
+ * palette of a palette display. The e-paper displays only need 8 bits.
+ *
+ * Bytes per cell, including the codepoint and attributes:
+ *   16 bits (Tanmatsu, RGB565): 8
+ *    8 bits (Kami, 2 bit palette): 6
+ */
+
+#if defined(CONFIG_BSP_TARGET_KAMI) || defined(CONFIG_BSP_TARGET_HACKERHOTEL_2024)
+#define CONSOLE_COL_BITS            8
+#else
+#define CONSOLE_COL_BITS            16
+#endif
+
 /* Buffer settings */
 
 #define CONSOLE_PRINTF_MAX_LEN      256
-#define CONSOLE_ASCII_ESC_SEQ_LEN   32
 
-/* The tab size in characters */
+/* Escape sequence limits. Longer sequences are still consumed, the
+ * parameters past the limit are dropped and OSC strings are cut off.
+ */
+
+#define CONSOLE_ESC_PARAMS          16
+#define CONSOLE_ESC_INTERMEDIATES   2
+#define CONSOLE_OSC_LEN             64
+
+/* How many damaged rectangles are kept between two
+ * console_get_damage calls. More get merged.
+ */
+
+#define CONSOLE_DAMAGE_RECTS        8
+
+/* Glyphs rasterised into the glyph atlas at init, ' ' up to '~' */
+
+#define CONSOLE_GLYPH_FIRST         ' '
+#define CONSOLE_GLYPH_LAST          '~'
+
+/* Slots in the glyph cache for codepoints that are neither ASCII nor
+ * box drawing, block elements or braille, a power of 2
+ */
+
+#define CONSOLE_GLYPH_CACHE         128
+
+/* Colors selectable with SGR 38;5;n and 48;5;n */
+
+#define CONSOLE_PALETTE_SIZE        256
+
+/* Shown for broken UTF-8 */
+
+#define CONSOLE_REPLACEMENT_CHAR    0xFFFD
+
+/* Bytes of scrollback store per line, on average. Lines are packed,
+ * a line of plain text takes about its text length plus 14 bytes.
+ */
+
+#define CONSOLE_SCROLLBACK_LINE_BYTES 64
+
+/* Compile in console_benchmark, which compares drawing speeds */
+
+#define CONSOLE_BENCHMARK           0
 
-#define CONSOLE_TABS                4
+/* The tab size in characters, stops are at every multiple of it */
+
+#define CONSOLE_TABS                8
 
 /******************************************************************************
  * Datatypes
@@ -93,11 +153,16 @@ enum console_fg_color_vga_e
   CONS_COL_VGA_B_ERR     = 0x00FF0000
 };
 
-/* ANSII escape code characters */
+/* Supported escape sequences without a CSI, by final character */
 
-enum console_control_codes_e
+enum console_esc_finals_e
 {
-  CONS_CTRL_CSI = '['
+  CONS_ESC_DECSC = '7', /* Save Cursor */
+  CONS_ESC_DECRC = '8', /* Restore Cursor */
+  CONS_ESC_IND   = 'D', /* Index */
+  CONS_ESC_NEL   = 'E', /* Next Line */
+  CONS_ESC_RI    = 'M', /* Reverse Index */
+  CONS_ESC_RIS   = 'c', /* Reset to Initial State */
 };
 
 /* All the supported CSI commands */
@@ -117,8 +182,38 @@ enum console_csi_terminators_e
   CONS_CSI_CUB_TERM = 'D', /* Cursor Down */
   CONS_CSI_CNL_TERM = 'E', /* Cursor Next Line */
   CONS_CSI_CPL_TERM = 'F', /* Cursor Previous Line */
-  CONS_CSI_PBE_TERM = 'h', /* Enable Paste Bracket mode */
-  CONS_CSI_PBD_TERM = 'l', /* Disable Paste Bracket mode */
+  CONS_CSI_SM_TERM  = 'h', /* Set Mode */
+  CONS_CSI_RM_TERM  = 'l', /* Reset Mode */
+  CONS_CSI_IL_TERM  = 'L', /* Insert Lines */
+  CONS_CSI_DL_TERM  = 'M', /* Delete Lines */
+  CONS_CSI_ICH_TERM = '@', /* Insert Characters */
+  CONS_CSI_DCH_TERM = 'P', /* Delete Characters */
+  CONS_CSI_ECH_TERM = 'X', /* Erase Characters */
+  CONS_CSI_SU_TERM  = 'S', /* Scroll Up */
+  CONS_CSI_SD_TERM  = 'T', /* Scroll Down */
+  CONS_CSI_DECSTBM_TERM = 'r', /* Set Top and Bottom Margins */
+  CONS_CSI_DECSCUSR_TERM = 'q', /* Set Cursor Style, after a space */
+};
+
+/* Supported DEC private modes, CSI ? n h/l */
+
+enum console_dec_modes_e
+{
+  CONS_DEC_CURSOR_BLINK     = 12,   /* Blinking cursor */
+  CONS_DEC_CURSOR_VISIBLE   = 25,   /* DECTCEM, show the cursor */
+  CONS_DEC_ALT_SCREEN       = 47,   /* Alternate screen */
+  CONS_DEC_ALT_SCREEN_CLEAR = 1047, /* Same, cleared when leaving */
+  CONS_DEC_SAVE_CURSOR      = 1048, /* Save and restore like DECSC/DECRC */
+  CONS_DEC_ALT_SCREEN_SAVE  = 1049, /* 1048 and 1047 together */
+  CONS_DEC_BRACKETED_PASTE  = 2004,
+};
+
+/* Supported OSC commands, OSC n ; text ST */
+
+enum console_osc_commands_e
+{
+  CONS_OSC_TITLE_ICON = 0, /* Icon name and window title */
+  CONS_OSC_TITLE      = 2, /* Window title */
 };
 
 /* All the supported SGR codes */
@@ -126,12 +221,81 @@ enum console_csi_terminators_e
 enum console_csi_sgr_codes_e
 {
   CONS_CSI_SGR_RESET         = 0,
-  CONS_CSI_SGR_SET_FG        = 38,
-  CONS_CSI_SGR_SET_BG        = 48,
+  CONS_CSI_SGR_BOLD          = 1,
+  CONS_CSI_SGR_DIM           = 2,
+  CONS_CSI_SGR_UNDERLINE     = 4,
+  CONS_CSI_SGR_REVERSE       = 7,
+  CONS_CSI_SGR_NORMAL        = 22, /* Neither bold nor dim */
+  CONS_CSI_SGR_NO_UNDERLINE  = 24,
+  CONS_CSI_SGR_NO_REVERSE    = 27,
+  CONS_CSI_SGR_SET_FG        = 38, /* 38;5;n or 38;2;r;g;b */
+  CONS_CSI_SGR_DEFAULT_FG    = 39,
+  CONS_CSI_SGR_SET_BG        = 48, /* 48;5;n or 48;2;r;g;b */
+  CONS_CSI_SGR_DEFAULT_BG    = 49,
 
   /* Includes FG/BG color palette codes */
 };
 
+/* Second parameter of SGR 38 and 48 */
+
+enum console_csi_sgr_color_e
+{
+  CONS_CSI_SGR_COLOR_RGB     = 2,
+  CONS_CSI_SGR_COLOR_INDEXED = 5,
+};
+
+/* Attributes set by SGR. Bold, dim and reverse change the colors that
+ * go into the cells, only underline is kept in the cell. Cells also note
+ * whether their background is the default one, those show the
+ * background image.
+ */
+
+enum console_attr_e
+{
+  CONS_ATTR_BOLD       = 1 << 0,
+  CONS_ATTR_DIM        = 1 << 1,
+  CONS_ATTR_UNDERLINE  = 1 << 2,
+  CONS_ATTR_REVERSE    = 1 << 3,
+  CONS_ATTR_DEFAULT_BG = 1 << 4,
+
+  CONS_ATTR_CELL       = CONS_ATTR_UNDERLINE | CONS_ATTR_DEFAULT_BG,
+
+  /* Only in drawn_alloc, the cursor is drawn over this cell */
+
+  CONS_ATTR_CURSOR     = 1 << 7,
+
+  /* The fg of a blank cell is only visible with these */
+
+  CONS_ATTR_BLANK_FG   = CONS_ATTR_UNDERLINE | CONS_ATTR_CURSOR,
+};
+
+/* Cursor shapes, set by DECSCUSR */
+
+enum cons_cursor_style_e
+{
+  CONS_CURSOR_BLOCK,     /* Cell drawn with fg and bg swapped */
+  CONS_CURSOR_UNDERLINE, /* Bottom rows of the cell */
+  CONS_CURSOR_BAR,       /* Left columns of the cell */
+};
+
+/* A color as stored in a cell, see CONSOLE_COL_BITS */
+
+#if CONSOLE_COL_BITS == 8
+typedef uint8_t cons_col_t;
+#else
+typedef uint16_t cons_col_t;
+#endif
+
+/* How cons_col_t maps to a color, picked from the pax buffer at init */
+
+enum cons_col_format_e
+{
+  CONS_COL_FORMAT_RGB565,      /* Also the framebuffer format */
+  CONS_COL_FORMAT_RGB565_SWAP, /* Same, bytes swapped like the framebuffer */
+  CONS_COL_FORMAT_RGB332,      /* 8 bit cells on a display without palette */
+  CONS_COL_FORMAT_PALETTE,     /* Index in the palette of the pax buffer */
+};
+
 /* Contains initialization info */
 
 struct cons_config_s
@@ -152,6 +316,16 @@ struct cons_config_s
   /* Console output. Sends a string back. Used by Device Status Raport */
 
   void (*output_cb)(char *str, size_t len);
+
+  /* Lines kept in the scrollback store in PSRAM, 0 for none */
+
+  size_t scrollback_lines;
+
+  /* Optional. Called when the host clears the entire screen (ED 2),
+   * before anything after it is parsed. The grid is already blank.
+   */
+
+  void (*clear_cb)(void);
 };
 
 #if CONSOLE_PACK_CHARACTERS == 1
@@ -159,9 +333,125 @@ struct cons_config_s
 #endif
 struct cons_char_s
 {
-  char character;
+  uint32_t character : 24; /* Unicode codepoint */
+  uint32_t attr : 8; /* CONS_ATTR_CELL bits */
+  cons_col_t fg;
+  cons_col_t bg;
+};
+#if CONSOLE_PACK_CHARACTERS == 1
+#pragma pack()
+#endif
+
+/* Background image, composited behind the cells that have the default
+ * background. Same size, format and orientation as the pax buffer, so a
+ * cell's part of it is at the same offset as in the framebuffer.
+ */
+
+struct cons_background_s
+{
+  uint16_t *pixels; /* In PSRAM, NULL when there is no image */
+  pax_buf_t plane;
+};
+
+/* A rectangle in pixels, used to report which parts
+ * of the pax buffer changed while rendering
+ */
+
+struct cons_rect_s
+{
+  size_t x;
+  size_t y;
+  size_t w;
+  size_t h;
+};
+
+/* Rows top to bottom (included) were moved in the grid by lines, up
+ * when positive. The pixels follow on the next render.
+ */
+
+struct cons_move_s
+{
+  size_t top;
+  size_t bottom;
+  int lines;
+};
+
+/* Colors and attributes as set by SGR, before bold, dim and reverse
+ * are applied
+ */
+
+struct cons_sgr_s
+{
   pax_col_t fg;
   pax_col_t bg;
+  int16_t fg_index; /* Palette index of fg, -1 when set otherwise */
+  int16_t bg_index; /* Same for bg */
+  uint8_t attr;     /* CONS_ATTR_ flags */
+};
+
+/* Glyphs rasterised at the cell size, one bit per pixel. Drawing
+ * expands the bits straight into the framebuffer with the cell colors,
+ * pax is only used to build them. ASCII is rasterised at init, other
+ * codepoints when they are first drawn.
+ */
+
+struct cons_glyph_atlas_s
+{
+  uint8_t *bits; /* ASCII, cache slots, a spare. NULL if not in use */
+  size_t stride; /* Bytes per glyph row */
+  size_t glyph_size; /* Bytes per glyph */
+  uint32_t *cache_tags; /* Codepoint in each cache slot, 0 if empty */
+  pax_buf_t scratch; /* Where pax draws glyphs for rasterising */
+
+  /* Direct framebuffer access, only for RGB565 buffers */
+
+  uint16_t *pixels;
+  ptrdiff_t step_x; /* Pixels to move one pixel right on screen */
+  ptrdiff_t step_y; /* Pixels to move one pixel down on screen */
+};
+
+/* Lines that scrolled off the top, packed into a store in PSRAM. The
+ * oldest lines are dropped when it is full. See console_scrollback.c.
+ */
+
+struct cons_sb_line_s
+{
+  uint32_t offset; /* Where the record starts in data */
+  uint16_t len; /* Bytes */
+};
+
+struct cons_scrollback_s
+{
+  uint8_t *data; /* Line records, NULL without scrollback */
+  size_t size;
+  size_t head; /* Where the next record goes */
+  struct cons_sb_line_s *lines; /* Ring of records, oldest at first */
+  size_t max_lines;
+  size_t first;
+  size_t count;
+  size_t view; /* Lines looked back, 0 shows the live screen */
+  struct cons_char_s *row; /* One line unpacked for rendering */
+  size_t row_width; /* Cells row has room for */
+};
+
+/* Escape sequence parser state. Parameters are built up as the digits
+ * arrive, nothing is kept as text except OSC strings.
+ */
+
+struct cons_parser_s
+{
+  uint8_t state;
+  bool ignore; /* Too many intermediates, don't dispatch */
+  char private_marker; /* One of <=>? or 0 */
+  uint8_t intermediate_count;
+  char intermediates[CONSOLE_ESC_INTERMEDIATES];
+  uint8_t param_count;
+  uint16_t params[CONSOLE_ESC_PARAMS]; /* Missing params are 0 */
+  uint32_t utf8_codepoint; /* Decoded so far */
+  uint32_t utf8_min; /* Anything below is an overlong encoding */
+  uint8_t utf8_needed; /* Continuation bytes still to come */
+  size_t osc_len;
+  char osc_buf[CONSOLE_OSC_LEN];
 };
 
 /* Contains internal console instance data */
@@ -181,32 +471,96 @@ struct cons_insts_s
   size_t chars_x; /* N chars x */
   float font_size; /* Pax font size */
 
-  /* Character allocation */
+  /* Character allocation. char_alloc is the screen model, every cell
+   * written by the parser ends up here. drawn_alloc mirrors what is
+   * currently in the pax buffer, so rendering only touches cells that
+   * differ between the two.
+   */
 
   struct cons_char_s *char_alloc;
-  
+  struct cons_char_s *drawn_alloc;
+
+  /* The screen that is not in use, swapped with char_alloc. NULL until
+   * the host first switches to the alternate screen.
+   */
+
+  struct cons_char_s *alt_alloc;
+  bool alt_screen;
+
+  bool redraw_all; /* Ignore drawn_alloc on the next render */
+  struct cons_move_s pending_scroll; /* Scrolled since the last render */
+  size_t scroll_top;    /* Scrolling region set by DECSTBM, */
+  size_t scroll_bottom; /* both rows included */
+
+  /* History */
+
+  struct cons_scrollback_s scrollback;
+
+  /* Pre-rasterised glyphs */
+
+  struct cons_glyph_atlas_s glyphs;
+
+  /* Image behind the text */
+
+  struct cons_background_s background;
+
+  /* Pixels drawn since the last console_get_damage */
+
+  struct cons_rect_s damage[CONSOLE_DAMAGE_RECTS];
+  size_t damage_count;
+
   /* Console instance info */
 
   const struct pax_font *font;
   size_t cursor_x;
   size_t cursor_y;
-  pax_col_t fg;
-  pax_col_t bg;
 
-  /* ANSII escape code parsing */
+  /* The last column was written and the cursor stays on it. The next
+   * printable wraps first, moving the cursor cancels that (DECAWM).
+   */
+
+  bool wrap_pending;
+
+  /* The cursor is drawn over its cell while rendering, it is not in
+   * the grid. drawn_cursor_x/y is where it was drawn last.
+   */
 
-  struct 
-  {
-    bool esc_mode;
-    enum console_control_codes_e control_code;
-    char seq_buf[CONSOLE_ASCII_ESC_SEQ_LEN];
-    size_t seq_buf_pos;
+  enum cons_cursor_style_e cursor_style;
+  bool cursor_visible; /* DECTCEM */
+  bool cursor_blink;
+  bool cursor_blink_off; /* In the off half of a blink */
+  size_t drawn_cursor_x;
+  size_t drawn_cursor_y;
 
-  } _esc_code_parsing;
+  cons_col_t fg; /* Colors that go into the cells */
+  cons_col_t bg;
+  uint8_t attr; /* And the CONS_ATTR_CELL flags */
+  struct cons_sgr_s sgr;
+
+  /* Cell color format and the 256 color palette in it */
+
+  enum cons_col_format_e col_format;
+  cons_col_t palette[CONSOLE_PALETTE_SIZE];
+
+  /* Saved by DECSC, restored by DECRC */
+
+  size_t saved_x;
+  size_t saved_y;
+  struct cons_sgr_s saved_sgr;
+
+  /* Modes and strings set by the host */
+
+  bool bracketed_paste;
+  char title[CONSOLE_OSC_LEN];
+
+  /* ANSII escape code parsing */
+
+  struct cons_parser_s parser;
 
   /* Console output for responses, such as DSR response */
 
   void (*output_cb)(char *str, size_t len);
+  void (*clear_cb)(void);
 };
 
 /******************************************************************************
@@ -225,10 +579,22 @@ void console_printf(struct cons_insts_s *inst, char *format, ...);
  */
 
 void console_puts(struct cons_insts_s *inst, char *str);
+
+/* Writes len bytes, for output that comes in chunks such as from a
+ * socket. Runs of printable text skip the escape code parser and are
+ * stored a row at a time. A sequence may be split over several calls.
+ */
+
+void console_write(struct cons_insts_s *inst, const char *buf, size_t len);
 void console_put(struct cons_insts_s *inst, char c);
 void console_puts_at(struct cons_insts_s *inst, size_t x, size_t y, char *str);
 void console_put_at(struct cons_insts_s *inst, size_t x, size_t y, char c);
 
+/* Same as console_put_at for any Unicode codepoint */
+
+void console_put_cp_at(struct cons_insts_s *inst, size_t x, size_t y,
+                       uint32_t cp);
+
 /* Advances Y position and shifts console when needed.
  * Does not reset X position.
  * Printing a \n will do both.
@@ -249,13 +615,91 @@ void console_clear(struct cons_insts_s *inst);
 
 void console_get_size(struct cons_insts_s *inst, size_t *x, size_t *y);
 
+/* Rendering. Printing only updates the character grid, nothing is drawn
+ * until console_render is called. It draws the cells that changed since
+ * the previous render. console_redraw draws every cell from the grid,
+ * for when the pax buffer was overwritten by something else.
+ */
+
+void console_render(struct cons_insts_s *inst);
+void console_redraw(struct cons_insts_s *inst);
+
+/* Changes the colors of every cell on screen and the colors
+ * used for new characters. Takes effect on the next render.
+ */
+
+void console_recolor(struct cons_insts_s *inst, pax_col_t fg, pax_col_t bg);
+
+/* Copies the pixel rectangles that were drawn since the previous call
+ * into rects and forgets them. Returns the amount copied. Only these
+ * parts of the pax buffer have to be sent to the display.
+ * Passing NULL discards the damage, for after a full blit.
+ */
+
+size_t console_get_damage(struct cons_insts_s *inst, struct cons_rect_s *rects,
+                          size_t max);
+
+/* Puts an image behind the text. It is drawn over the current
+ * background color into a plane in PSRAM once, after that cells with
+ * the default background copy their part of the plane. Scrolling and
+ * clearing then never need the whole image again. The whole plane is
+ * copied to the pax buffer now and every cell is drawn on the next
+ * render, blit all of it afterwards. NULL removes the image. Returns -1
+ * when the pax buffer is not RGB565 or there is no memory.
+ */
+
+int console_set_background(struct cons_insts_s *inst, const pax_buf_t *image);
+
+/* Scrollback. console_scrollback_view moves the view back (positive)
+ * or forward (negative) through the history and returns how many lines
+ * back it is now. Rendering shows the history until the view is back
+ * at 0, output keeps going to the live screen meanwhile.
+ */
+
+size_t console_scrollback_view(struct cons_insts_s *inst, int lines);
+void console_scrollback_live(struct cons_insts_s *inst);
+size_t console_scrollback_lines(struct cons_insts_s *inst);
+void console_scrollback_clear(struct cons_insts_s *inst);
+
 /* Absolute cursor positioning */
 
 void console_get_cursor(struct cons_insts_s *inst, int *x, int *y); 
 void console_set_cursor(struct cons_insts_s *inst, int x, int y);
 
+/* Cursor shape and blinking, the host can change both with DECSCUSR.
+ * console_cursor_blink flips the blink phase, call it on a timer.
+ * Returns true when the cursor cell has to be drawn again, a render
+ * then only touches that cell.
+ */
+
+void console_set_cursor_style(struct cons_insts_s *inst,
+                              enum cons_cursor_style_e style, bool blink);
+bool console_cursor_blink(struct cons_insts_s *inst);
+
 /* Takes a console config and initializes an instance */
 
 int console_init(struct cons_insts_s *instance, const struct cons_config_s *config);
 
+/* Changes the font size multiplier and resizes the grid to match,
+ * keeping what is on screen. Columns are cut off or padded, lines above
+ * the cursor that no longer fit go into the scrollback. Every cell is
+ * drawn on the next render. Returns -1 and keeps the old size when it
+ * doesn't fit or there is no memory.
+ */
+
+int console_set_font_size(struct cons_insts_s *inst, float font_size_mult);
+
+/* Frees the character grid. Call before initializing an instance again */
+
+void console_deinit(struct cons_insts_s *instance);
+
+#if CONSOLE_BENCHMARK == 1
+/* Draws over the whole console to measure glyphs per second with
+ * pax text drawing and with the glyph atlas, then measures the escape
+ * sequence parser in MB/s. Logs the results and leaves a reset console.
+ */
+
+void console_benchmark(struct cons_insts_s *instance);
+#endif
+
 #endif /* _CONSOLE_H */
@@ -1,6 +1,8 @@
 #include "common/display.h"
+#include <string.h>
 #include "bsp/display.h"
 #include "esp_err.h"
+#include "esp_heap_caps.h"
 #include "esp_lcd_panel_io.h"
 #include "esp_lcd_panel_ops.h"
 #include "freertos/FreeRTOS.h"
@@ -24,6 +26,11 @@ static size_t                       display_v_res        = 0;
 static lcd_color_rgb_pixel_format_t display_color_format = LCD_COLOR_PIXEL_FORMAT_RGB565;
 static lcd_rgb_data_endian_t        display_data_endian  = LCD_RGB_DATA_ENDIAN_LITTLE;
 static pax_buf_t                    fb                   = {0};
+static pax_orientation_t            display_orientation  = PAX_O_UPRIGHT;
+
+// Scratch buffer used to pack partial blits that are not whole framebuffer rows
+static uint8_t* blit_scratch      = NULL;
+static size_t   blit_scratch_size = 0;
 
 #if defined(CONFIG_BSP_TARGET_KAMI) || defined(CONFIG_BSP_TARGET_HACKERHOTEL_2024)
 static pax_col_t palette[] = {0xffffffff, 0xff000000, 0xffff0000};  // white, black, red
@@ -83,6 +90,7 @@ void display_init(void) {
             break;
     }
     pax_buf_set_orientation(&fb, orientation);
+    display_orientation = orientation;
 
 #if CONFIG_IDF_TARGET_ESP32P4
     asp_disp_fb      = pax_buf_get_pixels_rw(&fb);
@@ -100,6 +108,103 @@ void display_blit_buffer(pax_buf_t* fb) {
     ESP_ERROR_CHECK(bsp_display_blit(0, 0, display_h_res, display_v_res, pax_buf_get_pixels(fb)));
 }
 
+static size_t display_bytes_per_pixel(void) {
+#if defined(CONFIG_BSP_TARGET_KAMI) || defined(CONFIG_BSP_TARGET_HACKERHOTEL_2024)
+    return 0;  // Palette based e-paper, always refreshed as a whole
+#else
+    switch (display_color_format) {
+        case LCD_COLOR_PIXEL_FORMAT_RGB565:
+            return 2;
+        case LCD_COLOR_PIXEL_FORMAT_RGB888:
+            return 3;
+        default:
+            return 0;
+    }
+#endif
+}
+
+void display_blit_rect(pax_buf_t* fb, int x, int y, int width, int height) {
+    size_t bytes_per_pixel = display_bytes_per_pixel();
+    if (bytes_per_pixel == 0) {
+        display_blit_buffer(fb);
+        return;
+    }
+
+    // Rectangle in the panel's own coordinates, the pax buffer is stored unrotated
+    int raw_w = display_h_res;
+    int raw_h = display_v_res;
+    int rx, ry, rw, rh;
+    switch (display_orientation) {
+        case PAX_O_ROT_CCW:
+            rx = y;
+            ry = raw_h - x - width;
+            rw = height;
+            rh = width;
+            break;
+        case PAX_O_ROT_HALF:
+            rx = raw_w - x - width;
+            ry = raw_h - y - height;
+            rw = width;
+            rh = height;
+            break;
+        case PAX_O_ROT_CW:
+            rx = raw_w - y - height;
+            ry = x;
+            rw = height;
+            rh = width;
+            break;
+        case PAX_O_UPRIGHT:
+            rx = x;
+            ry = y;
+            rw = width;
+            rh = height;
+            break;
+        default:
+            display_blit_buffer(fb);
+            return;
+    }
+
+    // Clip to the panel
+    if (rx < 0) {
+        rw += rx;
+        rx  = 0;
+    }
+    if (ry < 0) {
+        rh += ry;
+        ry  = 0;
+    }
+    if (rx + rw > raw_w) rw = raw_w - rx;
+    if (ry + rh > raw_h) rh = raw_h - ry;
+    if (rw <= 0 || rh <= 0) {
+        return;
+    }
+
+    const uint8_t* pixels = pax_buf_get_pixels(fb);
+    size_t         stride = raw_w * bytes_per_pixel;
+    size_t         row    = rw * bytes_per_pixel;
+
+    // Whole rows are already contiguous in the framebuffer
+    if (rw == raw_w) {
+        ESP_ERROR_CHECK(bsp_display_blit(rx, ry, rx + rw, ry + rh, pixels + ry * stride));
+        return;
+    }
+
+    if (blit_scratch_size < row * rh) {
+        heap_caps_free(blit_scratch);
+        blit_scratch      = heap_caps_malloc(row * rh, MALLOC_CAP_SPIRAM);
+        blit_scratch_size = blit_scratch ? row * rh : 0;
+        if (blit_scratch == NULL) {
+            display_blit_buffer(fb);
+            return;
+        }
+    }
+
+    for (int line = 0; line < rh; line++) {
+        memcpy(blit_scratch + line * row, pixels + (ry + line) * stride + rx * bytes_per_pixel, row);
+    }
+    ESP_ERROR_CHECK(bsp_display_blit(rx, ry, rx + rw, ry + rh, blit_scratch));
+}
+
 void display_blit(void) {
     display_blit_buffer(&fb);
 }
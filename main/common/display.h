@@ -5,4 +5,5 @@
 void       display_init(void);
 pax_buf_t* display_get_buffer(void);
 void       display_blit_buffer(pax_buf_t* fb);
+void       display_blit_rect(pax_buf_t* fb, int x, int y, int width, int height);
 void       display_blit(void);
\ No newline at end of file
@@ -1,7 +1,10 @@
 #include "icons.h"
 #include "esp_heap_caps.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "pax_codecs.h"
+#include "pax_gfx.h"
+#include <string.h>
 
 static char const TAG[] = "icons";
 
@@ -10,11 +13,13 @@ static char const TAG[] = "icons";
 #define ICON_HEIGHT       32
 #define ICON_BUFFER_SIZE  (ICON_WIDTH * ICON_HEIGHT * 4)  // 32x32 pixels, 2 bits per pixel
 #define ICON_COLOR_FORMAT PAX_BUF_2_PAL
+#define ICON_BPP          2
 #else
 #define ICON_WIDTH        32
 #define ICON_HEIGHT       32
 #define ICON_BUFFER_SIZE  (ICON_WIDTH * ICON_HEIGHT * 4)  // 32x32 pixels, 4 bytes per pixel (ARGB8888)
 #define ICON_COLOR_FORMAT PAX_BUF_32_8888ARGB
+#define ICON_BPP          32
 #endif
 
 #if defined(CONFIG_BSP_TARGET_KAMI)
@@ -87,29 +92,85 @@ const char* icon_paths[] = {
 
 pax_buf_t EXT_RAM_BSS_ATTR icons[ICON_LAST] = {0};
 
+// All icons share one PSRAM block, each is filled in the first time it is asked for
+static uint8_t* icon_pixels           = NULL;
+static bool     icon_ready[ICON_LAST] = {0};
+
+// Pre-decoded icons packed by tools/pack_icons.py at build time and linked into the app, see
+// icons_atlas_header_t. An icon is one copy out of flash. Icons missing from it are decoded from
+// their PNG instead.
+extern uint8_t const icon_atlas_start[] asm("_binary_icon_atlas_bin_start");
+extern uint8_t const icon_atlas_end[] asm("_binary_icon_atlas_bin_end");
+
+static char const ICON_ATLAS_MAGIC[4] = {'I', 'C', 'N', 'A'};
+#define ICON_ATLAS_VERSION 1
+
+typedef struct {
+    char     magic[4];
+    uint16_t version;
+    uint16_t count;   // ICON_LAST of the build that packed it, one present byte each follows
+    uint16_t width;
+    uint16_t height;
+    uint16_t bpp;     // ICON_BPP, pixels as pax stores them in ICON_COLOR_FORMAT
+    uint16_t stride;  // bytes per icon, ICON_BUFFER_SIZE
+} icons_atlas_header_t;
+
+static uint8_t const* icon_atlas_present = NULL;  // one byte per icon, NULL without a usable atlas
+static uint8_t const* icon_atlas_data    = NULL;  // the first icon
+
+static void open_icon_atlas(void) {
+    // the embedded data has no particular alignment, the header is copied out
+    size_t               size = icon_atlas_end - icon_atlas_start;
+    icons_atlas_header_t header;
+    if (size < sizeof(header) + ICON_LAST + (size_t)ICON_LAST * ICON_BUFFER_SIZE) {
+        ESP_LOGW(TAG, "Icon atlas is truncated, icons are decoded from PNG when first used");
+        return;
+    }
+    memcpy(&header, icon_atlas_start, sizeof(header));
+    if (memcmp(header.magic, ICON_ATLAS_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != ICON_ATLAS_VERSION || header.count != ICON_LAST || header.width != ICON_WIDTH ||
+        header.height != ICON_HEIGHT || header.bpp != ICON_BPP || header.stride != ICON_BUFFER_SIZE) {
+        ESP_LOGW(TAG, "Icon atlas does not match this target, icons are decoded from PNG when first used");
+        return;
+    }
+
+    icon_atlas_present = icon_atlas_start + sizeof(header);
+    icon_atlas_data    = icon_atlas_present + ICON_LAST;
+}
+
+static bool read_icon_atlas(icon_t icon) {
+    if (icon_atlas_present == NULL || !icon_atlas_present[icon]) {
+        return false;
+    }
+    memcpy(pax_buf_get_pixels_rw(&icons[icon]), icon_atlas_data + (size_t)icon * ICON_BUFFER_SIZE,
+           ICON_BUFFER_SIZE);
+    return true;
+}
+
+static void decode_icon(icon_t icon) {
+    FILE* fd = fopen(icon_paths[icon], "rb");
+    if (fd == NULL) {
+        ESP_LOGE(TAG, "Failed to open icon file %s", icon_paths[icon]);
+        return;
+    }
+    if (!pax_insert_png_fd(&icons[icon], fd, 0, 0, 0)) {
+        ESP_LOGE(TAG, "Failed to decode icon file %s", icon_paths[icon]);
+    }
+    fclose(fd);
+}
+
+// Only sets up the shared buffer and the atlas, nothing is read or decoded until get_icon
 void load_icons(void) {
-    for (int i = 0; i < ICON_LAST; i++) {
-        FILE* fd = fopen(icon_paths[i], "rb");
-        if (fd == NULL) {
-            ESP_LOGE(TAG, "Failed to open icon file %s", icon_paths[i]);
-            continue;
-        }
-        void* buffer = heap_caps_calloc(1, ICON_BUFFER_SIZE, MALLOC_CAP_SPIRAM);
-        if (buffer == NULL) {
-            ESP_LOGE(TAG, "Failed to allocate memory for icon %s", icon_paths[i]);
-            fclose(fd);
-            continue;
-        }
-        pax_buf_init(&icons[i], buffer, ICON_WIDTH, ICON_HEIGHT, ICON_COLOR_FORMAT);
-#if defined(CONFIG_BSP_TARGET_KAMI)
-        icons[i].palette      = palette;
-        icons[i].palette_size = sizeof(palette) / sizeof(pax_col_t);
-#endif
-        if (!pax_insert_png_fd(&icons[i], fd, 0, 0, 0)) {
-            ESP_LOGE(TAG, "Failed to decode icon file %s", icon_paths[i]);
-        }
-        fclose(fd);
+    int64_t start = esp_timer_get_time();
+
+    icon_pixels = heap_caps_calloc(ICON_LAST, ICON_BUFFER_SIZE, MALLOC_CAP_SPIRAM);
+    if (icon_pixels == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate memory for icons");
+        return;
     }
+    open_icon_atlas();
+
+    ESP_LOGI(TAG, "Icons ready in %lld us", esp_timer_get_time() - start);
 }
 
 pax_buf_t* get_icon(icon_t icon) {
@@ -117,5 +178,18 @@ pax_buf_t* get_icon(icon_t icon) {
         ESP_LOGE(TAG, "Invalid icon index %d", icon);
         return NULL;
     }
+    if (!icon_ready[icon] && icon_pixels != NULL) {
+        // a failed icon stays blank rather than being retried on every redraw
+        icon_ready[icon] = true;
+        pax_buf_init(&icons[icon], icon_pixels + (size_t)icon * ICON_BUFFER_SIZE, ICON_WIDTH, ICON_HEIGHT,
+                     ICON_COLOR_FORMAT);
+#if defined(CONFIG_BSP_TARGET_KAMI)
+        icons[icon].palette      = palette;
+        icons[icon].palette_size = sizeof(palette) / sizeof(pax_col_t);
+#endif
+        if (!read_icon_atlas(icon)) {
+            decode_icon(icon);
+        }
+    }
     return &icons[icon];
 }
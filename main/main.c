@@ -20,6 +20,7 @@
 #include "esp_lcd_panel_ops.h"
 #include "esp_lcd_types.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_vfs_fat.h"
 #include "gui_element_footer.h"
 #include "gui_element_header.h"
@@ -249,6 +250,9 @@ void app_main(void) {
 
     load_icons();
 
+    // Time since boot, to compare icon loading strategies
+    ESP_LOGI(TAG, "Menu reached %lld ms after boot", esp_timer_get_time() / 1000);
+
     //bsp_power_set_usb_host_boost_enabled(true); -- might want to keep this?
 
     menu_ssh(fb, theme);
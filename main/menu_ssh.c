@@ -17,10 +17,16 @@
 #include "menu_ssh.h"
 #include "menu_ssh_edit.h"
 #include "settings_ssh.h"
+#include "ssh_prewarm.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
 static char const TAG[] = "menu_ssh";
 
+// How long an entry has to stay highlighted before it is connected to in advance,
+// so scrolling past entries doesn't start connections
+#define MENU_SSH_PREWARM_DWELL_US 750000
+
 static bool populate_menu_from_ssh_entries(menu_t* menu) {
     bool empty = true;
     for (uint32_t index = 0; index < SSH_SETTINGS_MAX; index++) {
@@ -69,6 +75,18 @@ static void add_connection(pax_buf_t* buffer, gui_theme_t* theme) {
     menu_ssh_edit(buffer, theme, index, true);
 }
 
+// Starts connecting to the highlighted entry in advance if it asks for that
+static void prewarm_highlighted(menu_t* menu) {
+    if (menu_find_item(menu, 0) == NULL) {
+        return;
+    }
+    uint8_t        index    = (uint32_t)menu_get_callback_args(menu, menu_get_position(menu));
+    ssh_settings_t settings = {0};
+    if (ssh_settings_get(index, &settings) == ESP_OK && settings.prewarm) {
+        ssh_prewarm_start(&settings);
+    }
+}
+
 static void keyboard_backlight(void) {
     uint8_t brightness;
     bsp_input_get_backlight_brightness(&brightness);
@@ -111,9 +129,17 @@ void menu_ssh(pax_buf_t* buffer, gui_theme_t* theme) {
     //bool connected      = update_connected((uint32_t)menu_get_callback_args(&menu, menu_get_position(&menu)));
     render(buffer, theme, &menu, position, false, true, false, false);
 
+    // when the highlighted entry gets connected to in advance, INT64_MAX once it was
+    int64_t prewarm_us = esp_timer_get_time() + MENU_SSH_PREWARM_DWELL_US;
+
     while (1) {
         bsp_input_event_t event;
-        if (xQueueReceive(input_event_queue, &event, pdMS_TO_TICKS(1000)) == pdTRUE) {
+        TickType_t        wait = pdMS_TO_TICKS(1000);
+        int64_t           now  = esp_timer_get_time();
+        if (prewarm_us - now < 1000000) {
+            wait = prewarm_us > now ? pdMS_TO_TICKS((prewarm_us - now) / 1000) + 1 : 0;
+        }
+        if (xQueueReceive(input_event_queue, &event, wait) == pdTRUE) {
             switch (event.type) {
                 case INPUT_EVENT_TYPE_NAVIGATION:
                     if (event.args_navigation.state) {
@@ -127,11 +153,15 @@ void menu_ssh(pax_buf_t* buffer, gui_theme_t* theme) {
 				keyboard_backlight();
 				break;
                             case BSP_INPUT_NAVIGATION_KEY_F3:
+                                ssh_prewarm_cancel();
+                                prewarm_us = esp_timer_get_time() + MENU_SSH_PREWARM_DWELL_US;
                                 add_connection(buffer, theme);
                                 break;
                             case BSP_INPUT_NAVIGATION_KEY_F4:
                                 if (menu_find_item(&menu, 0) != NULL) {
                                     uint8_t index = (uint32_t)menu_get_callback_args(&menu, menu_get_position(&menu));
+                                    ssh_prewarm_cancel();
+                                    prewarm_us = esp_timer_get_time() + MENU_SSH_PREWARM_DWELL_US;
                                     menu_ssh_edit(buffer, theme, index, false);
                                     render(buffer, theme, &menu, position, false, false, true, false);
                                 }
@@ -150,15 +180,21 @@ void menu_ssh(pax_buf_t* buffer, gui_theme_t* theme) {
                                 message_dialog_return_type_t msg_ret =
                                     adv_dialog_yes_no(get_icon(ICON_HELP), "Delete SSH connection", message_buffer);
                                 if (msg_ret == MSG_DIALOG_RETURN_OK) {
+                                    ssh_prewarm_cancel();
+                                    prewarm_us = esp_timer_get_time() + MENU_SSH_PREWARM_DWELL_US;
                                     ssh_settings_erase(index);
                                 }
                             	break;
                             case BSP_INPUT_NAVIGATION_KEY_UP:
                                 menu_navigate_previous(&menu);
+                                ssh_prewarm_cancel();
+                                prewarm_us = esp_timer_get_time() + MENU_SSH_PREWARM_DWELL_US;
                                 render(buffer, theme, &menu, position, true, false, false, false);
                                 break;
                             case BSP_INPUT_NAVIGATION_KEY_DOWN:
                                 menu_navigate_next(&menu);
+                                ssh_prewarm_cancel();
+                                prewarm_us = esp_timer_get_time() + MENU_SSH_PREWARM_DWELL_US;
                                 render(buffer, theme, &menu, position, true, false, false, false);
                                 break;
                             case BSP_INPUT_NAVIGATION_KEY_RETURN:
@@ -169,6 +205,7 @@ void menu_ssh(pax_buf_t* buffer, gui_theme_t* theme) {
                                     uint8_t index = (uint32_t)menu_get_callback_args(&menu, menu_get_position(&menu));
 				    ssh_settings_get(index, &settings);
 				    util_ssh(buffer, theme, &settings);
+                                    prewarm_us = esp_timer_get_time() + MENU_SSH_PREWARM_DWELL_US;
                                     render(buffer, theme, &menu, position, false, false, false, false);
                                 }
                                 break;
@@ -180,6 +217,9 @@ void menu_ssh(pax_buf_t* buffer, gui_theme_t* theme) {
                 default:
                     break;
             }
+        } else if (esp_timer_get_time() >= prewarm_us) {
+            prewarm_highlighted(&menu);
+            prewarm_us = INT64_MAX;
         } else {
             //prev_connected = connected;
             //uint8_t index  = (uint32_t)menu_get_callback_args(&menu, menu_get_position(&menu));
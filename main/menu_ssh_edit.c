@@ -1,6 +1,8 @@
 //
 // Derived from nicolaielectronics/wifi-manager
 //
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "bsp/input.h"
 #include "common/display.h"
@@ -35,6 +37,15 @@ typedef enum {
     ACTION_USERNAME,
     ACTION_AUTH_MODE,
     ACTION_PASSWORD,
+    ACTION_TCP_NODELAY,
+    ACTION_KEEPALIVE,
+    ACTION_RCVBUF,
+    ACTION_CONNECT_TIMEOUT,
+    ACTION_PREWARM,
+    ACTION_KEX_PREFS,
+    ACTION_HOSTKEY_PREFS,
+    ACTION_CIPHER_PREFS,
+    ACTION_MAC_PREFS,
     ACTION_LAST,
 } menu_ssh_edit_action_t;
 
@@ -113,6 +124,26 @@ static void menu_populate(menu_t* menu, ssh_settings_t* settings) {
     ESP_LOGI(TAG, "password: <redacted>");
     menu_insert_item_value(menu, "Password", temp, NULL, (void*)ACTION_PASSWORD, -1);
 
+    menu_insert_item_value(menu, "TCP no delay", settings->tcp_nodelay ? "On" : "Off", NULL, (void*)ACTION_TCP_NODELAY,
+                           -1);
+
+    snprintf(temp, sizeof(temp), "%lu", (unsigned long)settings->keepalive_interval);
+    menu_insert_item_value(menu, "Keepalive (s)", temp, NULL, (void*)ACTION_KEEPALIVE, -1);
+
+    snprintf(temp, sizeof(temp), "%lu", (unsigned long)settings->rcvbuf_size);
+    menu_insert_item_value(menu, "Receive buffer", temp, NULL, (void*)ACTION_RCVBUF, -1);
+
+    snprintf(temp, sizeof(temp), "%lu", (unsigned long)settings->connect_timeout);
+    menu_insert_item_value(menu, "Connect timeout (s)", temp, NULL, (void*)ACTION_CONNECT_TIMEOUT, -1);
+
+    menu_insert_item_value(menu, "Connect in advance", settings->prewarm ? "On" : "Off", NULL, (void*)ACTION_PREWARM,
+                           -1);
+
+    menu_insert_item_value(menu, "Key exchange", settings->kex_prefs, NULL, (void*)ACTION_KEX_PREFS, -1);
+    menu_insert_item_value(menu, "Host key", settings->hostkey_prefs, NULL, (void*)ACTION_HOSTKEY_PREFS, -1);
+    menu_insert_item_value(menu, "Cipher", settings->cipher_prefs, NULL, (void*)ACTION_CIPHER_PREFS, -1);
+    menu_insert_item_value(menu, "MAC", settings->mac_prefs, NULL, (void*)ACTION_MAC_PREFS, -1);
+
     if (previous_position >= menu_get_length(menu)) {
         previous_position = menu_get_length(menu) - 1;
         ESP_LOGI(TAG, "  updated previous menu position: %d", (int)previous_position);
@@ -256,6 +287,55 @@ static void edit_password(pax_buf_t* buffer, gui_theme_t* theme, menu_t* menu, s
     }
 }
 
+static void edit_tcp_nodelay(menu_t* menu, ssh_settings_t* settings) {
+    settings->tcp_nodelay = !settings->tcp_nodelay;
+    ESP_LOGI(TAG, "updated tcp_nodelay: %d", settings->tcp_nodelay);
+    menu_set_value(menu, 5, settings->tcp_nodelay ? "On" : "Off");
+}
+
+static void edit_prewarm(menu_t* menu, ssh_settings_t* settings) {
+    settings->prewarm = !settings->prewarm;
+    ESP_LOGI(TAG, "updated prewarm: %d", settings->prewarm);
+    menu_set_value(menu, 9, settings->prewarm ? "On" : "Off");
+}
+
+// Numbers are edited as text, anything that isn't one leaves the value as it was
+static void edit_u32(pax_buf_t* buffer, gui_theme_t* theme, menu_t* menu, size_t item, char const* title,
+                     uint32_t* value) {
+    char temp[16] = {0};
+    bool accepted = false;
+    snprintf(temp, sizeof(temp), "%lu", (unsigned long)*value);
+
+    menu_textedit(buffer, theme, title, temp, sizeof(temp), true, &accepted);
+    if (accepted) {
+        char*         end;
+        unsigned long parsed = strtoul(temp, &end, 10);
+        if (end == temp || *end != '\0' || parsed > UINT32_MAX) {
+            message_dialog(get_icon(ICON_ERROR), "Error", "Not a number", "Go back");
+            return;
+        }
+        *value = parsed;
+        ESP_LOGI(TAG, "updated %s: %lu", title, parsed);
+        snprintf(temp, sizeof(temp), "%lu", parsed);
+        menu_set_value(menu, item, temp);
+    }
+}
+
+// Algorithm lists are edited as text, whether libssh2 knows the names is only found out when connecting
+static void edit_prefs(pax_buf_t* buffer, gui_theme_t* theme, menu_t* menu, size_t item, char const* title,
+                       char* value, size_t size) {
+    char temp[129] = {0};
+    bool accepted  = false;
+    strlcpy(temp, value, sizeof(temp));
+
+    menu_textedit(buffer, theme, title, temp, size, true, &accepted);
+    if (accepted) {
+        strlcpy(value, temp, size);
+        ESP_LOGI(TAG, "updated %s: %s", title, value);
+        menu_set_value(menu, item, value);
+    }
+}
+
 bool menu_ssh_edit(pax_buf_t* buffer, gui_theme_t* theme, uint8_t index, bool new_entry) {
     QueueHandle_t input_event_queue = NULL;
     ESP_ERROR_CHECK(bsp_input_get_queue(&input_event_queue));
@@ -264,6 +344,7 @@ bool menu_ssh_edit(pax_buf_t* buffer, gui_theme_t* theme, uint8_t index, bool ne
     ssh_settings_t settings = {0};
     if (new_entry) {
 	ESP_LOGI(TAG, "making new ssh connection");
+	ssh_settings_transport_defaults(&settings);
 	//memcpy(settings.connection_name, "Conn", 4);
 	//memcpy(settings.dest_host, "Host", 4);
 	//memcpy(settings.dest_port, "Port", 4);
@@ -366,6 +447,38 @@ bool menu_ssh_edit(pax_buf_t* buffer, gui_theme_t* theme, uint8_t index, bool ne
                                     case ACTION_PASSWORD:
                                         edit_password(buffer, theme, &menu, &settings);
                                         break;
+                                    case ACTION_TCP_NODELAY:
+                                        edit_tcp_nodelay(&menu, &settings);
+                                        break;
+                                    case ACTION_KEEPALIVE:
+                                        edit_u32(buffer, theme, &menu, 6, "Keepalive (s)", &settings.keepalive_interval);
+                                        break;
+                                    case ACTION_RCVBUF:
+                                        edit_u32(buffer, theme, &menu, 7, "Receive buffer", &settings.rcvbuf_size);
+                                        break;
+                                    case ACTION_CONNECT_TIMEOUT:
+                                        edit_u32(buffer, theme, &menu, 8, "Connect timeout (s)",
+                                                 &settings.connect_timeout);
+                                        break;
+                                    case ACTION_PREWARM:
+                                        edit_prewarm(&menu, &settings);
+                                        break;
+                                    case ACTION_KEX_PREFS:
+                                        edit_prefs(buffer, theme, &menu, 10, "Key exchange", settings.kex_prefs,
+                                                   sizeof(settings.kex_prefs));
+                                        break;
+                                    case ACTION_HOSTKEY_PREFS:
+                                        edit_prefs(buffer, theme, &menu, 11, "Host key", settings.hostkey_prefs,
+                                                   sizeof(settings.hostkey_prefs));
+                                        break;
+                                    case ACTION_CIPHER_PREFS:
+                                        edit_prefs(buffer, theme, &menu, 12, "Cipher", settings.cipher_prefs,
+                                                   sizeof(settings.cipher_prefs));
+                                        break;
+                                    case ACTION_MAC_PREFS:
+                                        edit_prefs(buffer, theme, &menu, 13, "MAC", settings.mac_prefs,
+                                                   sizeof(settings.mac_prefs));
+                                        break;
                                     default:
                                         break;
                                 }
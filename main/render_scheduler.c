@@ -0,0 +1,65 @@
+#include "render_scheduler.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+static char const TAG[] = "render_scheduler";
+
+// How long after a key press output is treated as its echo
+#define ECHO_WINDOW_US (250 * 1000)
+
+void render_scheduler_init(render_scheduler_t* scheduler, uint32_t max_fps) {
+    if (max_fps == 0) {
+        max_fps = 1;
+    }
+    scheduler->frame_interval_us = 1000000 / max_fps;
+    scheduler->last_frame_us     = 0;
+    scheduler->flush_until_us    = 0;
+    scheduler->pending_chunks    = 0;
+    scheduler->frames_rendered   = 0;
+    scheduler->frames_skipped    = 0;
+}
+
+// New output was parsed into the console but not drawn yet
+void render_scheduler_output(render_scheduler_t* scheduler) {
+    scheduler->pending_chunks++;
+}
+
+// Input was sent to the server, the echo should be drawn without waiting for the next frame
+void render_scheduler_input(render_scheduler_t* scheduler) {
+    scheduler->flush_until_us = esp_timer_get_time() + ECHO_WINDOW_US;
+}
+
+bool render_scheduler_due(render_scheduler_t* scheduler) {
+    if (scheduler->pending_chunks == 0) {
+        return false;
+    }
+    int64_t now = esp_timer_get_time();
+    if (now < scheduler->flush_until_us) {
+        return true;
+    }
+    return (now - scheduler->last_frame_us) >= scheduler->frame_interval_us;
+}
+
+// When render_scheduler_due() turns true without further input, INT64_MAX while nothing is pending
+int64_t render_scheduler_next_us(render_scheduler_t* scheduler) {
+    if (scheduler->pending_chunks == 0) {
+        return INT64_MAX;
+    }
+    if (esp_timer_get_time() < scheduler->flush_until_us) {
+        return 0;
+    }
+    return scheduler->last_frame_us + scheduler->frame_interval_us;
+}
+
+void render_scheduler_rendered(render_scheduler_t* scheduler) {
+    scheduler->frames_rendered++;
+    scheduler->frames_skipped += scheduler->pending_chunks - 1;
+    scheduler->pending_chunks  = 0;
+    scheduler->flush_until_us  = 0;  // the echo is on screen, back to pacing
+    scheduler->last_frame_us   = esp_timer_get_time();
+}
+
+void render_scheduler_log_stats(render_scheduler_t* scheduler) {
+    ESP_LOGI(TAG, "frames rendered: %lu, skipped: %lu", (unsigned long)scheduler->frames_rendered,
+             (unsigned long)scheduler->frames_skipped);
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Gathers terminal output into frames drawn at most max_fps times per second.
+// Output that arrives right after a key press is drawn at once, so typing
+// stays responsive while a flood of output is paced.
+typedef struct {
+    int64_t  frame_interval_us;
+    int64_t  last_frame_us;
+    int64_t  flush_until_us;   // draw immediately until this time, set by input
+    uint32_t pending_chunks;   // output chunks parsed since the last frame
+    uint32_t frames_rendered;
+    uint32_t frames_skipped;   // chunks folded into a later frame instead of getting their own
+} render_scheduler_t;
+
+void render_scheduler_init(render_scheduler_t* scheduler, uint32_t max_fps);
+void render_scheduler_output(render_scheduler_t* scheduler);
+void render_scheduler_input(render_scheduler_t* scheduler);
+bool render_scheduler_due(render_scheduler_t* scheduler);
+int64_t render_scheduler_next_us(render_scheduler_t* scheduler);
+void render_scheduler_rendered(render_scheduler_t* scheduler);
+void render_scheduler_log_stats(render_scheduler_t* scheduler);
@@ -56,6 +56,39 @@ static esp_err_t ssh_settings_set_parameter_u32(nvs_handle_t nvs_handle, uint8_t
     return nvs_set_u32(nvs_handle, nvs_key, value);
 }
 
+static esp_err_t ssh_settings_get_parameter_str_default(nvs_handle_t nvs_handle, uint8_t index, const char* parameter,
+                                                         char* out_string, size_t max_length, const char* default_value) {
+    esp_err_t res = ssh_settings_get_parameter_str(nvs_handle, index, parameter, out_string, max_length);
+    if (res == ESP_ERR_NVS_NOT_FOUND) {
+        strlcpy(out_string, default_value, max_length);
+        return ESP_OK;
+    }
+    return res;
+}
+
+// Connections saved before a setting existed read as its default
+static esp_err_t ssh_settings_get_parameter_u32_default(nvs_handle_t nvs_handle, uint8_t index, const char* parameter,
+                                                         uint32_t* out_value, uint32_t default_value) {
+    esp_err_t res = ssh_settings_get_parameter_u32(nvs_handle, index, parameter, out_value);
+    if (res == ESP_ERR_NVS_NOT_FOUND) {
+        *out_value = default_value;
+        return ESP_OK;
+    }
+    return res;
+}
+
+void ssh_settings_transport_defaults(ssh_settings_t* settings) {
+    settings->tcp_nodelay        = SSH_DEFAULT_TCP_NODELAY;
+    settings->keepalive_interval = SSH_DEFAULT_KEEPALIVE_INTERVAL;
+    settings->rcvbuf_size        = SSH_DEFAULT_RCVBUF_SIZE;
+    settings->connect_timeout    = SSH_DEFAULT_CONNECT_TIMEOUT;
+    settings->prewarm            = SSH_DEFAULT_PREWARM;
+    strlcpy(settings->kex_prefs, SSH_DEFAULT_KEX_PREFS, sizeof(settings->kex_prefs));
+    strlcpy(settings->hostkey_prefs, SSH_DEFAULT_HOSTKEY_PREFS, sizeof(settings->hostkey_prefs));
+    strlcpy(settings->cipher_prefs, SSH_DEFAULT_CIPHER_PREFS, sizeof(settings->cipher_prefs));
+    strlcpy(settings->mac_prefs, SSH_DEFAULT_MAC_PREFS, sizeof(settings->mac_prefs));
+}
+
 static esp_err_t _ssh_settings_get(nvs_handle_t nvs_handle, uint8_t index, ssh_settings_t* out_settings) {
     //ESP_LOGI(TAG, "_ssh_settings_get()");
     char buffer[128 + sizeof('\0')] = {0};
@@ -113,6 +146,57 @@ static esp_err_t _ssh_settings_get(nvs_handle_t nvs_handle, uint8_t index, ssh_s
     }
     out_settings->auth_mode = (ssh_auth_mode_t)auth_mode;
 
+    // Read transport tuning (stored as u32)
+    uint32_t tcp_nodelay = 0;
+    res = ssh_settings_get_parameter_u32_default(nvs_handle, index, "nodelay", &tcp_nodelay, SSH_DEFAULT_TCP_NODELAY);
+    if (res != ESP_OK) {
+        return res;
+    }
+    out_settings->tcp_nodelay = tcp_nodelay != 0;
+    res = ssh_settings_get_parameter_u32_default(nvs_handle, index, "keepalive", &out_settings->keepalive_interval,
+                                                 SSH_DEFAULT_KEEPALIVE_INTERVAL);
+    if (res != ESP_OK) {
+        return res;
+    }
+    res = ssh_settings_get_parameter_u32_default(nvs_handle, index, "rcvbuf", &out_settings->rcvbuf_size,
+                                                 SSH_DEFAULT_RCVBUF_SIZE);
+    if (res != ESP_OK) {
+        return res;
+    }
+    res = ssh_settings_get_parameter_u32_default(nvs_handle, index, "conn_tmo", &out_settings->connect_timeout,
+                                                 SSH_DEFAULT_CONNECT_TIMEOUT);
+    if (res != ESP_OK) {
+        return res;
+    }
+    uint32_t prewarm = 0;
+    res = ssh_settings_get_parameter_u32_default(nvs_handle, index, "prewarm", &prewarm, SSH_DEFAULT_PREWARM);
+    if (res != ESP_OK) {
+        return res;
+    }
+    out_settings->prewarm = prewarm != 0;
+
+    // Read algorithm preferences
+    res = ssh_settings_get_parameter_str_default(nvs_handle, index, "kex", out_settings->kex_prefs,
+                                                 sizeof(out_settings->kex_prefs), SSH_DEFAULT_KEX_PREFS);
+    if (res != ESP_OK) {
+        return res;
+    }
+    res = ssh_settings_get_parameter_str_default(nvs_handle, index, "hostkey", out_settings->hostkey_prefs,
+                                                 sizeof(out_settings->hostkey_prefs), SSH_DEFAULT_HOSTKEY_PREFS);
+    if (res != ESP_OK) {
+        return res;
+    }
+    res = ssh_settings_get_parameter_str_default(nvs_handle, index, "cipher", out_settings->cipher_prefs,
+                                                 sizeof(out_settings->cipher_prefs), SSH_DEFAULT_CIPHER_PREFS);
+    if (res != ESP_OK) {
+        return res;
+    }
+    res = ssh_settings_get_parameter_str_default(nvs_handle, index, "mac", out_settings->mac_prefs,
+                                                 sizeof(out_settings->mac_prefs), SSH_DEFAULT_MAC_PREFS);
+    if (res != ESP_OK) {
+        return res;
+    }
+
     // Read connection name - XXX moved to the end because the function was crashing when this was first
     //ESP_LOGI(TAG, "  getting connection_name");
     memset(buffer, 0, sizeof(buffer));
@@ -180,6 +264,48 @@ static esp_err_t _ssh_settings_set(nvs_handle_t nvs_handle, uint8_t index, ssh_s
         return res;
     }
 
+    // Write transport tuning
+    res = ssh_settings_set_parameter_u32(nvs_handle, index, "nodelay", settings->tcp_nodelay ? 1 : 0);
+    if (res != ESP_OK) {
+        return res;
+    }
+    res = ssh_settings_set_parameter_u32(nvs_handle, index, "keepalive", settings->keepalive_interval);
+    if (res != ESP_OK) {
+        return res;
+    }
+    res = ssh_settings_set_parameter_u32(nvs_handle, index, "rcvbuf", settings->rcvbuf_size);
+    if (res != ESP_OK) {
+        return res;
+    }
+    res = ssh_settings_set_parameter_u32(nvs_handle, index, "conn_tmo", settings->connect_timeout);
+    if (res != ESP_OK) {
+        return res;
+    }
+    res = ssh_settings_set_parameter_u32(nvs_handle, index, "prewarm", settings->prewarm ? 1 : 0);
+    if (res != ESP_OK) {
+        return res;
+    }
+
+    // Write algorithm preferences
+    res = ssh_settings_set_parameter_str(nvs_handle, index, "kex", settings->kex_prefs, sizeof(settings->kex_prefs));
+    if (res != ESP_OK) {
+        return res;
+    }
+    res = ssh_settings_set_parameter_str(nvs_handle, index, "hostkey", settings->hostkey_prefs,
+                                         sizeof(settings->hostkey_prefs));
+    if (res != ESP_OK) {
+        return res;
+    }
+    res = ssh_settings_set_parameter_str(nvs_handle, index, "cipher", settings->cipher_prefs,
+                                         sizeof(settings->cipher_prefs));
+    if (res != ESP_OK) {
+        return res;
+    }
+    res = ssh_settings_set_parameter_str(nvs_handle, index, "mac", settings->mac_prefs, sizeof(settings->mac_prefs));
+    if (res != ESP_OK) {
+        return res;
+    }
+
     // Write connection name
     memset(buffer, 0, sizeof(buffer));
     memcpy(buffer, settings->connection_name, member_size(ssh_settings_t, connection_name));
@@ -209,6 +335,24 @@ static esp_err_t _ssh_settings_erase(nvs_handle_t nvs_handle, uint8_t index) {
     nvs_erase_key(nvs_handle, nvs_key);
     ssh_settings_combine_key(index, "auth_mode", nvs_key);
     nvs_erase_key(nvs_handle, nvs_key);
+    ssh_settings_combine_key(index, "nodelay", nvs_key);
+    nvs_erase_key(nvs_handle, nvs_key);
+    ssh_settings_combine_key(index, "keepalive", nvs_key);
+    nvs_erase_key(nvs_handle, nvs_key);
+    ssh_settings_combine_key(index, "rcvbuf", nvs_key);
+    nvs_erase_key(nvs_handle, nvs_key);
+    ssh_settings_combine_key(index, "conn_tmo", nvs_key);
+    nvs_erase_key(nvs_handle, nvs_key);
+    ssh_settings_combine_key(index, "prewarm", nvs_key);
+    nvs_erase_key(nvs_handle, nvs_key);
+    ssh_settings_combine_key(index, "kex", nvs_key);
+    nvs_erase_key(nvs_handle, nvs_key);
+    ssh_settings_combine_key(index, "hostkey", nvs_key);
+    nvs_erase_key(nvs_handle, nvs_key);
+    ssh_settings_combine_key(index, "cipher", nvs_key);
+    nvs_erase_key(nvs_handle, nvs_key);
+    ssh_settings_combine_key(index, "mac", nvs_key);
+    nvs_erase_key(nvs_handle, nvs_key);
     return ESP_OK;
 }
 
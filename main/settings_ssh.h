@@ -2,6 +2,8 @@
 // Derived from nicolaielectronics/wifi-manager
 //
 #pragma once
+#include <stdbool.h>
+#include <stdint.h>
 #include "esp_err.h"
 
 #define SSH_SETTINGS_MAX 0xFF
@@ -21,10 +23,38 @@ typedef struct {
     // Password, if not using key based authentication
     char                      password[64];
     ssh_auth_mode_t           auth_mode;
+    // Transport tuning
+    bool                      tcp_nodelay;         // send keystrokes without waiting for Nagle
+    uint32_t                  keepalive_interval;  // seconds between keepalives, 0 disables them
+    uint32_t                  rcvbuf_size;         // socket receive buffer in bytes, 0 keeps the lwIP default
+    uint32_t                  connect_timeout;     // seconds to wait for the TCP connection, 0 uses the default
+    bool                      prewarm;             // connect in the background while highlighted in the menu
+    // Algorithm preferences, comma separated and most preferred first, empty leaves the choice to libssh2
+    char                      kex_prefs[128];
+    char                      hostkey_prefs[128];
+    char                      cipher_prefs[128];
+    char                      mac_prefs[128];
     // TODO: Store dest host fingerprints
     // TODO: Store dest host public keys
 } ssh_settings_t;
 
+#define SSH_DEFAULT_TCP_NODELAY        true
+#define SSH_DEFAULT_KEEPALIVE_INTERVAL 30
+#define SSH_DEFAULT_RCVBUF_SIZE        0
+#define SSH_DEFAULT_CONNECT_TIMEOUT    10
+#define SSH_DEFAULT_PREWARM            false
+
+// The fastest first on the ESP32-P4: its ECC, AES and SHA accelerators are used by
+// mbedTLS. Names the libssh2 build doesn't support are skipped, so curve25519 and
+// AES-GCM are picked up once the mbedTLS backend has them. The host key order is
+// left to libssh2 by default, a different one makes servers answer with a key type
+// that isn't in known_hosts yet.
+#define SSH_DEFAULT_KEX_PREFS     "ecdh-sha2-nistp256,curve25519-sha256,curve25519-sha256@libssh.org,diffie-hellman-group14-sha256"
+#define SSH_DEFAULT_HOSTKEY_PREFS ""
+#define SSH_DEFAULT_CIPHER_PREFS  "aes128-gcm@openssh.com,aes128-ctr,aes256-gcm@openssh.com,aes256-ctr"
+#define SSH_DEFAULT_MAC_PREFS     "hmac-sha2-256-etm@openssh.com,hmac-sha2-256,hmac-sha1"
+
+void      ssh_settings_transport_defaults(ssh_settings_t* settings);
 esp_err_t ssh_settings_get(uint8_t index, ssh_settings_t* out_settings);
 esp_err_t ssh_settings_set(uint8_t index, ssh_settings_t* settings);
 esp_err_t ssh_settings_erase(uint8_t index);
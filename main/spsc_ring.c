@@ -0,0 +1,67 @@
+#include "spsc_ring.h"
+#include "esp_heap_caps.h"
+
+bool spsc_ring_init(spsc_ring_t* ring, size_t size) {
+    // the index arithmetic masks instead of dividing
+    if (size == 0 || (size & (size - 1)) != 0) {
+        return false;
+    }
+    ring->data = heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+    if (ring->data == NULL) {
+        return false;
+    }
+    ring->size = size;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    return true;
+}
+
+void spsc_ring_free(spsc_ring_t* ring) {
+    heap_caps_free(ring->data);
+    ring->data = NULL;
+    ring->size = 0;
+}
+
+uint8_t* spsc_ring_write_ptr(spsc_ring_t* ring, size_t* len) {
+    size_t head   = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail   = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t offset = head & (ring->size - 1);
+    size_t free   = ring->size - (head - tail);
+
+    // up to the end of the buffer, the rest comes with the next call
+    if (free > ring->size - offset) {
+        free = ring->size - offset;
+    }
+    *len = free;
+    return free ? ring->data + offset : NULL;
+}
+
+void spsc_ring_commit(spsc_ring_t* ring, size_t len) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    // publishes the bytes written before it to the consumer
+    atomic_store_explicit(&ring->head, head + len, memory_order_release);
+}
+
+uint8_t const* spsc_ring_read_ptr(spsc_ring_t* ring, size_t* len) {
+    size_t tail   = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head   = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t offset = tail & (ring->size - 1);
+    size_t used   = head - tail;
+
+    if (used > ring->size - offset) {
+        used = ring->size - offset;
+    }
+    *len = used;
+    return used ? ring->data + offset : NULL;
+}
+
+void spsc_ring_release(spsc_ring_t* ring, size_t len) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    // the producer may overwrite these bytes from now on
+    atomic_store_explicit(&ring->tail, tail + len, memory_order_release);
+}
+
+size_t spsc_ring_used(spsc_ring_t* ring) {
+    return atomic_load_explicit(&ring->head, memory_order_acquire) -
+           atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Byte ring for exactly one producer task and one consumer task, without locks.
+// head and tail count every byte ever written and read and wrap freely, the
+// producer only moves head and the consumer only moves tail.
+typedef struct {
+    uint8_t*      data;
+    size_t        size;  // a power of two
+    atomic_size_t head;
+    atomic_size_t tail;
+} spsc_ring_t;
+
+bool spsc_ring_init(spsc_ring_t* ring, size_t size);
+void spsc_ring_free(spsc_ring_t* ring);
+
+// Producer side: the contiguous free space, then how much of it was filled
+uint8_t* spsc_ring_write_ptr(spsc_ring_t* ring, size_t* len);
+void     spsc_ring_commit(spsc_ring_t* ring, size_t len);
+
+// Consumer side: the contiguous data, then how much of it was used
+uint8_t const* spsc_ring_read_ptr(spsc_ring_t* ring, size_t* len);
+void           spsc_ring_release(spsc_ring_t* ring, size_t len);
+
+size_t spsc_ring_used(spsc_ring_t* ring);
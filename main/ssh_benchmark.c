@@ -0,0 +1,114 @@
+#include "ssh_benchmark.h"
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "ssh_connect.h"
+
+static char const TAG[] = "ssh_benchmark";
+
+// Everything libssh2 might offer, the ones the build or the server lacks are reported as such
+#define SSH_BENCHMARK_CIPHERS                                                                                   \
+    "aes128-gcm@openssh.com,aes256-gcm@openssh.com,chacha20-poly1305@openssh.com,aes128-ctr,aes192-ctr,"        \
+    "aes256-ctr,aes128-cbc,aes192-cbc,aes256-cbc,3des-cbc"
+#define SSH_BENCHMARK_BYTES      (4 * 1024 * 1024)
+#define SSH_BENCHMARK_TIMEOUT_MS 30000
+#define SSH_BENCHMARK_POLL_MS    100
+
+static char ssh_benchmark_buffer[16384];
+
+// Sets the connection up as far as the command running, false when it failed
+static bool ssh_benchmark_connect(ssh_connect_t* conn, LIBSSH2_SESSION* verified, char const* password,
+                                  ssh_benchmark_result_t* result) {
+    while (1) {
+        ssh_connect_phase_t phase = ssh_connect_step(conn);
+        if (phase == SSH_CONNECT_DONE) {
+            return true;
+        }
+        if (phase == SSH_CONNECT_FAILED) {
+            if (result->error == NULL) {
+                result->error = conn->error;
+            }
+            return false;
+        }
+        if (phase == SSH_CONNECT_VERIFY_HOST) {
+            result->kex_us = conn->kex_us;
+
+            // a list without a single supported name leaves the choice to libssh2
+            if (strcmp(libssh2_session_methods(conn->session, LIBSSH2_METHOD_CRYPT_CS), result->cipher) != 0) {
+                result->error = "not supported";
+                ssh_connect_cancel(conn, result->error);
+                continue;
+            }
+
+            // only logs in to the server the session was verified with
+            size_t      len, verified_len;
+            int         type, verified_type;
+            char const* key          = libssh2_session_hostkey(conn->session, &len, &type);
+            char const* verified_key = libssh2_session_hostkey(verified, &verified_len, &verified_type);
+            if (key == NULL || verified_key == NULL || type != verified_type || len != verified_len ||
+                memcmp(key, verified_key, len) != 0) {
+                result->error = "host key differs";
+                ssh_connect_cancel(conn, result->error);
+                continue;
+            }
+            ssh_connect_authenticate(conn, password);
+            continue;
+        }
+        ssh_connect_wait(conn, SSH_BENCHMARK_POLL_MS);
+    }
+}
+
+static void ssh_benchmark_cipher(ssh_settings_t const* settings, LIBSSH2_SESSION* verified, char const* password,
+                                 char const* command, ssh_benchmark_result_t* result) {
+    ssh_settings_t only = *settings;
+    strlcpy(only.cipher_prefs, result->cipher, sizeof(only.cipher_prefs));
+
+    ssh_connect_t conn;
+    ssh_connect_init(&conn);
+    conn.command = command;
+    ssh_connect_begin(&conn, &only, "dumb", 80, 24);
+    if (ssh_benchmark_connect(&conn, verified, password, result)) {
+        libssh2_session_set_blocking(conn.session, 1);
+        libssh2_session_set_timeout(conn.session, SSH_BENCHMARK_TIMEOUT_MS);
+
+        int64_t start = esp_timer_get_time();
+        ssize_t n;
+        while ((n = libssh2_channel_read(conn.channel, ssh_benchmark_buffer, sizeof(ssh_benchmark_buffer))) > 0) {
+            result->bytes += n;
+        }
+        result->transfer_us = esp_timer_get_time() - start;
+        if (n < 0) {
+            result->error = "transfer failed";
+        } else if (result->bytes != SSH_BENCHMARK_BYTES) {
+            result->error = "short transfer";
+        }
+    }
+    ssh_connect_close(&conn, "Benchmark done");
+
+    if (result->error != NULL) {
+        ESP_LOGW(TAG, "%s: %s", result->cipher, result->error);
+    } else {
+        ESP_LOGI(TAG, "%s: key exchange %lld ms, %lu bytes in %lld ms", result->cipher, result->kex_us / 1000,
+                 (unsigned long)result->bytes, result->transfer_us / 1000);
+    }
+}
+
+int ssh_benchmark(ssh_settings_t const* settings, LIBSSH2_SESSION* verified, char const* password,
+                  ssh_benchmark_result_t* results, int max_results) {
+    char command[48];
+    snprintf(command, sizeof(command), "head -c %d /dev/zero", SSH_BENCHMARK_BYTES);
+
+    int         count = 0;
+    char const* next  = SSH_BENCHMARK_CIPHERS;
+    while (*next != '\0' && count < max_results) {
+        size_t len = strcspn(next, ",");
+        ssh_benchmark_result_t* result = &results[count++];
+        memset(result, 0, sizeof(*result));
+        snprintf(result->cipher, sizeof(result->cipher), "%.*s", (int)len, next);
+        next += len + (next[len] == ',');
+
+        ssh_benchmark_cipher(settings, verified, password, command, result);
+    }
+    return count;
+}
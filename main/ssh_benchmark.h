@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+#include <libssh2.h>
+#include "settings_ssh.h"
+
+// Set to 1 to measure every cipher before the session starts. Each one gets its own
+// connection to the server, which logs in and pulls SSH_BENCHMARK_BYTES through
+// the channel, so point it at a test sshd rather than a server that matters.
+#define SSH_BENCHMARK 0
+
+#define SSH_BENCHMARK_MAX_RESULTS 16
+
+typedef struct {
+    char        cipher[32];
+    char const* error;  // why it wasn't measured, NULL when it was
+    int64_t     kex_us;
+    uint32_t    bytes;
+    int64_t     transfer_us;
+} ssh_benchmark_result_t;
+
+// Measures key exchange time and channel throughput per cipher, against the host key the
+// verified session was accepted with. Returns how many results were filled in.
+int ssh_benchmark(ssh_settings_t const* settings, LIBSSH2_SESSION* verified, char const* password,
+                  ssh_benchmark_result_t* results, int max_results);
@@ -0,0 +1,491 @@
+#include "ssh_connect.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+
+static char const TAG[] = "ssh_connect";
+
+// Per phase timeouts in seconds, the TCP connection uses the one in the settings.
+// Key exchange and password checks can take a few seconds each on a slow server.
+#define SSH_CONNECT_RESOLVE_S   10
+#define SSH_CONNECT_HANDSHAKE_S 20
+#define SSH_CONNECT_AUTH_S      30
+#define SSH_CONNECT_CHANNEL_S   10
+
+// Connection Attempt Delay from RFC 8305, how long an attempt has before the next address gets one too
+#define SSH_CONNECT_ATTEMPT_DELAY_US 250000
+
+// Closing is done blocking, but a dead server must not hold it up for long
+#define SSH_CONNECT_CLOSE_TIMEOUT_MS 2000
+
+// Applies the connection's transport settings before connecting
+static void ssh_connect_configure(libssh2_socket_t sock, ssh_settings_t const* settings) {
+    int on = 1;
+    if (settings->tcp_nodelay && setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on))) {
+        ESP_LOGW(TAG, "failed to set TCP_NODELAY: %d", errno);
+    }
+    if (settings->rcvbuf_size > 0) {
+        int size = settings->rcvbuf_size;
+        if (setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size))) {
+            ESP_LOGW(TAG, "failed to set SO_RCVBUF: %d", errno);
+        }
+    }
+    if (settings->keepalive_interval > 0) {
+        // the SSH keepalives keep NAT state alive, these notice a peer that went away without them
+        int idle  = settings->keepalive_interval;
+        int count = 3;
+        if (setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) ||
+            setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) ||
+            setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &idle, sizeof(idle)) ||
+            setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count))) {
+            ESP_LOGW(TAG, "failed to set TCP keepalive: %d", errno);
+        }
+    }
+}
+
+static void ssh_connect_enter(ssh_connect_t* conn, ssh_connect_phase_t phase, uint32_t timeout_s) {
+    conn->phase       = phase;
+    conn->deadline_us = esp_timer_get_time() + (int64_t)timeout_s * 1000000;
+}
+
+static void ssh_connect_fail(ssh_connect_t* conn, char const* error) {
+    ESP_LOGE(TAG, "%s failed: %s", ssh_connect_phase_name(conn->phase), error);
+    conn->error        = error;
+    conn->failed_phase = conn->phase;
+    conn->phase        = SSH_CONNECT_FAILED;
+}
+
+void ssh_connect_init(ssh_connect_t* conn) {
+    memset(conn, 0, sizeof(*conn));
+    conn->sock  = LIBSSH2_INVALID_SOCKET;
+    conn->phase = SSH_CONNECT_FAILED;
+    for (int i = 0; i < SSH_RESOLVE_MAX_ADDRS; i++) {
+        conn->attempt[i] = LIBSSH2_INVALID_SOCKET;
+    }
+}
+
+static void ssh_connect_resolved(ssh_connect_t* conn) {
+    conn->resolve = NULL;
+    if (conn->addrs.count == 0) {
+        ssh_connect_fail(conn, "host not found");
+        return;
+    }
+    uint32_t timeout = conn->settings->connect_timeout;
+    ssh_connect_enter(conn, SSH_CONNECT_TCP, timeout > 0 ? timeout : SSH_DEFAULT_CONNECT_TIMEOUT);
+    conn->tcp_start_us    = esp_timer_get_time();
+    conn->next_attempt_us = conn->tcp_start_us;
+}
+
+bool ssh_connect_begin(ssh_connect_t* conn, ssh_settings_t const* settings, char const* term, int cols, int rows) {
+    conn->settings = settings;
+    conn->term     = term;
+    conn->cols     = cols;
+    conn->rows     = rows;
+    ssh_connect_enter(conn, SSH_CONNECT_RESOLVE, SSH_CONNECT_RESOLVE_S);
+    if (ssh_resolve(settings->dest_host, settings->dest_port, &conn->addrs, &conn->resolve)) {
+        ssh_connect_resolved(conn);
+    }
+    return conn->phase != SSH_CONNECT_FAILED;
+}
+
+static void ssh_connect_drop_attempt(ssh_connect_t* conn, int i, int error) {
+    char name[INET6_ADDRSTRLEN];
+    struct sockaddr* addr = (struct sockaddr*)&conn->addrs.addr[i];
+    void* ip = addr->sa_family == AF_INET6 ? (void*)&((struct sockaddr_in6*)addr)->sin6_addr
+                                           : (void*)&((struct sockaddr_in*)addr)->sin_addr;
+    inet_ntop(addr->sa_family, ip, name, sizeof(name));
+    ESP_LOGW(TAG, "connecting to %s failed: %d", name, error);
+
+    close(conn->attempt[i]);
+    conn->attempt[i] = LIBSSH2_INVALID_SOCKET;
+    conn->tcp_error  = error;
+}
+
+// Starts a connection to the next address
+static void ssh_connect_start_attempt(ssh_connect_t* conn) {
+    int              i    = conn->attempts++;
+    struct sockaddr* addr = (struct sockaddr*)&conn->addrs.addr[i];
+    conn->next_attempt_us = esp_timer_get_time() + SSH_CONNECT_ATTEMPT_DELAY_US;
+
+    libssh2_socket_t sock = socket(addr->sa_family, SOCK_STREAM, 0);
+    if (sock == LIBSSH2_INVALID_SOCKET) {
+        conn->tcp_error = errno;
+        return;
+    }
+    ssh_connect_configure(sock, conn->settings);
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    conn->attempt[i] = sock;
+
+    // connected at once happens on loopback, it is picked up with the others
+    if (connect(sock, addr, conn->addrs.len[i]) != 0 && errno != EINPROGRESS) {
+        ssh_connect_drop_attempt(conn, i, errno);
+    }
+}
+
+// Adds the attempts in flight to fds, returns the highest socket or -1 when there are none
+static int ssh_connect_attempt_fds(ssh_connect_t* conn, fd_set* fds) {
+    int max = -1;
+    FD_ZERO(fds);
+    for (int i = 0; i < conn->attempts; i++) {
+        if (conn->attempt[i] != LIBSSH2_INVALID_SOCKET) {
+            FD_SET(conn->attempt[i], fds);
+            if (conn->attempt[i] > max) {
+                max = conn->attempt[i];
+            }
+        }
+    }
+    return max;
+}
+
+// Races the addresses, false while it has to wait for them
+static bool ssh_connect_tcp(ssh_connect_t* conn) {
+    fd_set fds;
+    int    max = ssh_connect_attempt_fds(conn, &fds);
+
+    // the next address gets a go when the earlier ones are taking long or all failed
+    if (conn->attempts < conn->addrs.count && (max < 0 || esp_timer_get_time() >= conn->next_attempt_us)) {
+        ssh_connect_start_attempt(conn);
+        return true;
+    }
+    if (max < 0) {
+        ssh_connect_fail(conn, conn->tcp_error == ECONNREFUSED ? "connection refused" : "host unreachable");
+        return true;
+    }
+
+    struct timeval poll = {0};
+    if (select(max + 1, NULL, &fds, NULL, &poll) <= 0) {
+        return false;
+    }
+
+    for (int i = 0; i < conn->attempts; i++) {
+        if (conn->attempt[i] == LIBSSH2_INVALID_SOCKET || !FD_ISSET(conn->attempt[i], &fds)) {
+            continue;
+        }
+        int       error = 0;
+        socklen_t len   = sizeof(error);
+        if (getsockopt(conn->attempt[i], SOL_SOCKET, SO_ERROR, &error, &len) || error) {
+            ssh_connect_drop_attempt(conn, i, error ? error : errno);
+            continue;
+        }
+
+        // the winner, the rest are given up on
+        conn->sock       = conn->attempt[i];
+        conn->attempt[i] = LIBSSH2_INVALID_SOCKET;
+        for (int j = 0; j < conn->attempts; j++) {
+            if (conn->attempt[j] != LIBSSH2_INVALID_SOCKET) {
+                close(conn->attempt[j]);
+                conn->attempt[j] = LIBSSH2_INVALID_SOCKET;
+            }
+        }
+        ESP_LOGI(TAG, "connected to address %d of %d in %lld ms", i + 1, conn->addrs.count,
+                 (esp_timer_get_time() - conn->tcp_start_us) / 1000);
+        ssh_connect_enter(conn, SSH_CONNECT_HANDSHAKE, SSH_CONNECT_HANDSHAKE_S);
+        return true;
+    }
+    return true;
+}
+
+// Hands the connection's algorithm preferences to libssh2 before the key exchange.
+// A list none of whose names libssh2 knows is ignored, it picks the algorithm then.
+static void ssh_connect_method_prefs(ssh_connect_t* conn) {
+    static struct {
+        int         method;
+        size_t      offset;
+        char const* name;
+    } const prefs[] = {
+        {LIBSSH2_METHOD_KEX, offsetof(ssh_settings_t, kex_prefs), "key exchange"},
+        {LIBSSH2_METHOD_HOSTKEY, offsetof(ssh_settings_t, hostkey_prefs), "host key"},
+        {LIBSSH2_METHOD_CRYPT_CS, offsetof(ssh_settings_t, cipher_prefs), "cipher"},
+        {LIBSSH2_METHOD_CRYPT_SC, offsetof(ssh_settings_t, cipher_prefs), "cipher"},
+        {LIBSSH2_METHOD_MAC_CS, offsetof(ssh_settings_t, mac_prefs), "MAC"},
+        {LIBSSH2_METHOD_MAC_SC, offsetof(ssh_settings_t, mac_prefs), "MAC"},
+    };
+    for (size_t i = 0; i < sizeof(prefs) / sizeof(prefs[0]); i++) {
+        char const* list = (char const*)conn->settings + prefs[i].offset;
+        if (list[0] != '\0' && libssh2_session_method_pref(conn->session, prefs[i].method, list) != 0) {
+            ESP_LOGW(TAG, "no supported %s in \"%s\"", prefs[i].name, list);
+        }
+    }
+}
+
+// One attempt at the current phase, false when it has to wait for the socket
+static bool ssh_connect_advance(ssh_connect_t* conn) {
+    int rc;
+
+    switch (conn->phase) {
+        case SSH_CONNECT_RESOLVE:
+            if (!ssh_resolve_poll(conn->resolve, &conn->addrs, 0)) {
+                return false;
+            }
+            ssh_connect_resolved(conn);
+            return true;
+
+        case SSH_CONNECT_TCP:
+            if (!ssh_connect_tcp(conn)) {
+                return false;
+            }
+            if (conn->phase == SSH_CONNECT_FAILED) {
+                // don't hand out the same addresses again straight away
+                ssh_resolve_forget(conn->settings->dest_host, conn->settings->dest_port);
+            }
+            return true;
+
+        case SSH_CONNECT_HANDSHAKE:
+            if (conn->session == NULL) {
+                conn->session = libssh2_session_init();
+                if (conn->session == NULL) {
+                    ssh_connect_fail(conn, "out of memory");
+                    return true;
+                }
+                libssh2_session_set_blocking(conn->session, 0);
+                ssh_connect_method_prefs(conn);
+                conn->kex_start_us = esp_timer_get_time();
+            }
+            rc = libssh2_session_handshake(conn->session, conn->sock);
+            if (rc == LIBSSH2_ERROR_EAGAIN) {
+                return false;
+            }
+            if (rc) {
+                ESP_LOGE(TAG, "handshake: %d", rc);
+                ssh_connect_fail(conn, "SSH handshake failed");
+                return true;
+            }
+            conn->kex_us = esp_timer_get_time() - conn->kex_start_us;
+            ESP_LOGI(TAG, "key exchange %s, host key %s, cipher %s, MAC %s in %lld ms",
+                     libssh2_session_methods(conn->session, LIBSSH2_METHOD_KEX),
+                     libssh2_session_methods(conn->session, LIBSSH2_METHOD_HOSTKEY),
+                     libssh2_session_methods(conn->session, LIBSSH2_METHOD_CRYPT_CS),
+                     libssh2_session_methods(conn->session, LIBSSH2_METHOD_MAC_CS), conn->kex_us / 1000);
+            // keepalives want a reply, so a NAT mapping sees traffic both ways
+            libssh2_keepalive_config(conn->session, 1, conn->settings->keepalive_interval);
+            conn->phase = SSH_CONNECT_VERIFY_HOST;
+            return true;
+
+        case SSH_CONNECT_AUTH:
+            if (conn->auth_methods == NULL) {
+                char const* username = conn->settings->username;
+                conn->auth_methods   = libssh2_userauth_list(conn->session, username, strlen(username));
+                if (conn->auth_methods == NULL) {
+                    if (libssh2_userauth_authenticated(conn->session)) {
+                        // the server let us in without any
+                        conn->auth_methods = "none";
+                        ssh_connect_enter(conn, SSH_CONNECT_CHANNEL, SSH_CONNECT_CHANNEL_S);
+                        return true;
+                    }
+                    if (libssh2_session_last_errno(conn->session) == LIBSSH2_ERROR_EAGAIN) {
+                        return false;
+                    }
+                    ssh_connect_fail(conn, "no authentication methods offered");
+                    return true;
+                }
+                ESP_LOGI(TAG, "user auth methods list: %s", conn->auth_methods);
+            }
+            rc = libssh2_userauth_password(conn->session, conn->settings->username, conn->password);
+            if (rc == LIBSSH2_ERROR_EAGAIN) {
+                return false;
+            }
+            if (rc) {
+                ssh_connect_fail(conn, "authentication failed");
+                return true;
+            }
+            ssh_connect_enter(conn, SSH_CONNECT_CHANNEL, SSH_CONNECT_CHANNEL_S);
+            return true;
+
+        case SSH_CONNECT_CHANNEL:
+            if (conn->channel == NULL) {
+                conn->channel = libssh2_channel_open_session(conn->session);
+                if (conn->channel == NULL) {
+                    if (libssh2_session_last_errno(conn->session) == LIBSSH2_ERROR_EAGAIN) {
+                        return false;
+                    }
+                    ssh_connect_fail(conn, "unable to open a session");
+                    return true;
+                }
+            }
+            if (!conn->env_sent) {
+                // servers commonly refuse environment variables, that's fine
+                rc = libssh2_channel_setenv(conn->channel, "LANG", "en_US.UTF-8");
+                if (rc == LIBSSH2_ERROR_EAGAIN) {
+                    return false;
+                }
+                conn->env_sent = true;
+            }
+            // a command runs without a terminal
+            ssh_connect_enter(conn, conn->command != NULL ? SSH_CONNECT_SHELL : SSH_CONNECT_PTY, SSH_CONNECT_CHANNEL_S);
+            return true;
+
+        case SSH_CONNECT_PTY:
+            rc = libssh2_channel_request_pty_ex(conn->channel, conn->term, strlen(conn->term), NULL, 0, conn->cols,
+                                                conn->rows, 0, 0);
+            if (rc == LIBSSH2_ERROR_EAGAIN) {
+                return false;
+            }
+            if (rc) {
+                ssh_connect_fail(conn, "pseudoterminal refused");
+                return true;
+            }
+            ssh_connect_enter(conn, SSH_CONNECT_SHELL, SSH_CONNECT_CHANNEL_S);
+            return true;
+
+        case SSH_CONNECT_SHELL:
+            if (conn->command != NULL) {
+                rc = libssh2_channel_exec(conn->channel, conn->command);
+            } else {
+                rc = libssh2_channel_shell(conn->channel);
+            }
+            if (rc == LIBSSH2_ERROR_EAGAIN) {
+                return false;
+            }
+            if (rc) {
+                ssh_connect_fail(conn, conn->command != NULL ? "command refused" : "shell refused");
+                return true;
+            }
+            conn->phase = SSH_CONNECT_DONE;
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+ssh_connect_phase_t ssh_connect_step(ssh_connect_t* conn) {
+    while (conn->phase != SSH_CONNECT_VERIFY_HOST && conn->phase != SSH_CONNECT_DONE &&
+           conn->phase != SSH_CONNECT_FAILED) {
+        if (esp_timer_get_time() > conn->deadline_us) {
+            ssh_connect_fail(conn, "timed out");
+            break;
+        }
+        if (!ssh_connect_advance(conn)) {
+            break;
+        }
+    }
+    return conn->phase;
+}
+
+// Sleeps until the socket is ready for what the current phase is waiting on, the
+// phase deadline or max_ms, whichever comes first
+void ssh_connect_wait(ssh_connect_t* conn, int max_ms) {
+    int64_t now     = esp_timer_get_time();
+    int64_t wait_us = conn->deadline_us - now;
+    if (wait_us > (int64_t)max_ms * 1000) {
+        wait_us = (int64_t)max_ms * 1000;
+    }
+    if (conn->phase == SSH_CONNECT_TCP && conn->attempts < conn->addrs.count && conn->next_attempt_us - now < wait_us) {
+        wait_us = conn->next_attempt_us - now;
+    }
+    if (wait_us < 0) {
+        wait_us = 0;
+    }
+
+    if (conn->phase == SSH_CONNECT_RESOLVE) {
+        // the next step picks the answer up
+        if (ssh_resolve_poll(conn->resolve, &conn->addrs, wait_us / 1000)) {
+            ssh_connect_resolved(conn);
+        }
+        return;
+    }
+
+    fd_set         read_fds, write_fds;
+    struct timeval timeout = {.tv_sec = wait_us / 1000000, .tv_usec = wait_us % 1000000};
+    int            max;
+    FD_ZERO(&read_fds);
+    if (conn->phase == SSH_CONNECT_TCP) {
+        max = ssh_connect_attempt_fds(conn, &write_fds);
+    } else {
+        if (conn->sock == LIBSSH2_INVALID_SOCKET) {
+            return;
+        }
+        bool inbound  = true;
+        bool outbound = false;
+        int  directions = conn->session != NULL ? libssh2_session_block_directions(conn->session) : 0;
+        if (directions != 0) {
+            inbound  = directions & LIBSSH2_SESSION_BLOCK_INBOUND;
+            outbound = directions & LIBSSH2_SESSION_BLOCK_OUTBOUND;
+        }
+        FD_ZERO(&write_fds);
+        if (inbound) {
+            FD_SET(conn->sock, &read_fds);
+        }
+        if (outbound) {
+            FD_SET(conn->sock, &write_fds);
+        }
+        max = conn->sock;
+    }
+    select(max + 1, &read_fds, &write_fds, NULL, &timeout);
+}
+
+void ssh_connect_authenticate(ssh_connect_t* conn, char const* password) {
+    if (conn->phase != SSH_CONNECT_VERIFY_HOST) {
+        return;
+    }
+    conn->password = password;
+    ssh_connect_enter(conn, SSH_CONNECT_AUTH, SSH_CONNECT_AUTH_S);
+}
+
+void ssh_connect_cancel(ssh_connect_t* conn, char const* reason) {
+    if (conn->phase != SSH_CONNECT_FAILED) {
+        ssh_connect_fail(conn, reason);
+    }
+}
+
+// The one place a connection is torn down, it may have got anywhere between no socket
+// and a running shell
+void ssh_connect_close(ssh_connect_t* conn, char const* reason) {
+    if (conn->resolve != NULL) {
+        ssh_resolve_abandon(conn->resolve);
+        conn->resolve = NULL;
+    }
+    for (int i = 0; i < conn->attempts; i++) {
+        if (conn->attempt[i] != LIBSSH2_INVALID_SOCKET) {
+            close(conn->attempt[i]);
+            conn->attempt[i] = LIBSSH2_INVALID_SOCKET;
+        }
+    }
+    if (conn->session != NULL) {
+        libssh2_session_set_timeout(conn->session, SSH_CONNECT_CLOSE_TIMEOUT_MS);
+        libssh2_session_set_blocking(conn->session, 1);
+        if (conn->channel != NULL) {
+            libssh2_channel_send_eof(conn->channel);
+            libssh2_channel_close(conn->channel);
+            libssh2_channel_free(conn->channel);
+            conn->channel = NULL;
+        }
+        libssh2_session_disconnect(conn->session, reason);
+        libssh2_session_free(conn->session);
+        conn->session = NULL;
+    }
+    if (conn->sock != LIBSSH2_INVALID_SOCKET) {
+        shutdown(conn->sock, 2);
+        LIBSSH2_SOCKET_CLOSE(conn->sock);
+        conn->sock = LIBSSH2_INVALID_SOCKET;
+    }
+}
+
+char const* ssh_connect_phase_name(ssh_connect_phase_t phase) {
+    switch (phase) {
+        case SSH_CONNECT_RESOLVE:
+            return "Looking up host";
+        case SSH_CONNECT_TCP:
+            return "Connecting";
+        case SSH_CONNECT_HANDSHAKE:
+            return "Session handshake";
+        case SSH_CONNECT_VERIFY_HOST:
+            return "Checking host key";
+        case SSH_CONNECT_AUTH:
+            return "Authenticating";
+        case SSH_CONNECT_CHANNEL:
+            return "Requesting ssh session";
+        case SSH_CONNECT_PTY:
+            return "Requesting pseudoterminal";
+        case SSH_CONNECT_SHELL:
+            return "Starting shell";
+        case SSH_CONNECT_DONE:
+            return "Connected";
+        default:
+            return "Connection failed";
+    }
+}
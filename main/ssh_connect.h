@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <libssh2.h>
+#include "lwip/sockets.h"
+#include "settings_ssh.h"
+#include "ssh_resolve.h"
+
+typedef enum {
+    SSH_CONNECT_RESOLVE,
+    SSH_CONNECT_TCP,
+    SSH_CONNECT_HANDSHAKE,
+    SSH_CONNECT_VERIFY_HOST,  // waits for the caller to check the host key
+    SSH_CONNECT_AUTH,
+    SSH_CONNECT_CHANNEL,
+    SSH_CONNECT_PTY,
+    SSH_CONNECT_SHELL,
+    SSH_CONNECT_DONE,
+    SSH_CONNECT_FAILED,
+} ssh_connect_phase_t;
+
+// Sets up an interactive session without ever blocking. ssh_connect_step()
+// goes as far as the socket allows, ssh_connect_wait() sleeps until it can
+// go on. Every phase has its own timeout, and whatever was opened is closed
+// by ssh_connect_close(), however far setup got. The TCP connection races the
+// host's addresses Happy Eyeballs style: a new attempt starts every 250 ms
+// while the earlier ones are still pending, and the first to connect wins.
+typedef struct {
+    ssh_connect_phase_t     phase;
+    int64_t                 deadline_us;  // the current phase fails after this
+    ssh_settings_t const*   settings;
+    ssh_resolve_job_t*      resolve;
+    ssh_addr_list_t         addrs;
+    libssh2_socket_t        attempt[SSH_RESOLVE_MAX_ADDRS];  // one per address tried so far
+    int                     attempts;
+    int64_t                 next_attempt_us;
+    int64_t                 tcp_start_us;
+    int                     tcp_error;  // of the last attempt that failed
+    libssh2_socket_t        sock;
+    LIBSSH2_SESSION*        session;
+    LIBSSH2_CHANNEL*        channel;
+    char const*             password;
+    char const*             auth_methods;  // offered by the server, NULL until known
+    char const*             term;
+    int                     cols;
+    int                     rows;
+    char const*             command;  // run instead of a shell when set before the channel is opened
+    bool                    env_sent;
+    int64_t                 kex_start_us;
+    int64_t                 kex_us;  // how long the key exchange took
+    char const*             error;  // why it failed
+    ssh_connect_phase_t     failed_phase;
+} ssh_connect_t;
+
+void                ssh_connect_init(ssh_connect_t* conn);
+bool                ssh_connect_begin(ssh_connect_t* conn, ssh_settings_t const* settings, char const* term, int cols,
+                                      int rows);
+ssh_connect_phase_t ssh_connect_step(ssh_connect_t* conn);
+void                ssh_connect_wait(ssh_connect_t* conn, int max_ms);
+// The host key was accepted, log in with this password, which has to stay valid until done
+void                ssh_connect_authenticate(ssh_connect_t* conn, char const* password);
+void                ssh_connect_cancel(ssh_connect_t* conn, char const* reason);
+void                ssh_connect_close(ssh_connect_t* conn, char const* reason);
+char const*         ssh_connect_phase_name(ssh_connect_phase_t phase);
@@ -0,0 +1,253 @@
+#include "ssh_io.h"
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+
+static char const TAG[] = "ssh_io";
+
+// Room for several full screens of output, so a flood is read off the socket
+// while the consumer is busy drawing
+#define SSH_IO_RING_SIZE (64 * 1024)
+// Decrypting runs on this stack
+#define SSH_IO_TASK_STACK    8192
+#define SSH_IO_TASK_PRIORITY (tskIDLE_PRIORITY + 5)
+// Upper bound on a wait for the socket, libssh2 may also have read data
+// off it while the other task was writing
+#define SSH_IO_SELECT_MS 20
+// Wait before retrying input the channel didn't take, its window may be full
+#define SSH_IO_RETRY_US 10000
+// Input sent this long after the last data received is timed to its echo, anything
+// arriving later than the upper bound wasn't one, like a typed password
+#define SSH_IO_RTT_QUIET_US 200000
+#define SSH_IO_RTT_MAX_US   2000000
+
+static void ssh_io_measure_rtt(ssh_io_t* io) {
+    uint32_t now = (uint32_t)esp_timer_get_time();
+    atomic_store(&io->received_us, now);
+    uint32_t sent = atomic_exchange(&io->echo_sent_us, 0);
+    if (sent == 0 || now - sent > SSH_IO_RTT_MAX_US) {
+        return;
+    }
+
+    uint32_t rtt = now - sent;
+    io->rtt_last_us = rtt;
+    if (io->rtt_count == 0 || rtt < io->rtt_min_us) {
+        io->rtt_min_us = rtt;
+    }
+    io->rtt_sum_us += rtt;
+    io->rtt_count++;
+}
+
+static void ssh_io_task(void* arg) {
+    ssh_io_t* io = arg;
+
+    while (!io->stop) {
+        size_t   room;
+        uint8_t* dst = spsc_ring_write_ptr(&io->ring, &room);
+        if (dst == NULL) {
+            // full, leave the data in the socket until the consumer catches up
+            io->ring_full++;
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(SSH_IO_SELECT_MS));
+            continue;
+        }
+
+        xSemaphoreTake(io->lock, portMAX_DELAY);
+        ssize_t nbytes = libssh2_channel_read(io->channel, (char*)dst, room);
+        bool    eof    = nbytes <= 0 && libssh2_channel_eof(io->channel);
+        xSemaphoreGive(io->lock);
+
+        if (nbytes > 0) {
+            spsc_ring_commit(&io->ring, nbytes);
+            io->bytes_received += nbytes;
+            xSemaphoreGive(io->received);
+            ssh_io_measure_rtt(io);
+            continue;
+        }
+        if (eof || (nbytes < 0 && nbytes != LIBSSH2_ERROR_EAGAIN)) {
+            if (!eof) {
+                ESP_LOGE(TAG, "channel read failed: %d", (int)nbytes);
+            }
+            io->eof = true;
+            xSemaphoreGive(io->received);
+            break;
+        }
+
+        // nothing buffered, sleep until the socket has something
+        fd_set         fds;
+        struct timeval timeout = {.tv_sec = 0, .tv_usec = SSH_IO_SELECT_MS * 1000};
+        FD_ZERO(&fds);
+        FD_SET(io->sock, &fds);
+        select(io->sock + 1, &fds, NULL, NULL, &timeout);
+    }
+
+    // stay around until stopped, the consumer still notifies this task
+    while (!io->stop) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+    xSemaphoreGive(io->stopped);
+    vTaskDelete(NULL);
+}
+
+bool ssh_io_start(ssh_io_t* io, LIBSSH2_SESSION* session, LIBSSH2_CHANNEL* channel, libssh2_socket_t sock,
+                  QueueSetHandle_t wake, int64_t tx_window_us) {
+    io->session        = session;
+    io->channel        = channel;
+    io->wake           = wake;
+    io->sock           = sock;
+    io->stop           = false;
+    io->eof            = false;
+    io->bytes_received = 0;
+    io->ring_full      = 0;
+    io->task           = NULL;
+    io->tx_len         = 0;
+    io->tx_window_us   = tx_window_us;
+    io->tx_flush_us    = INT64_MAX;
+    io->keystrokes     = 0;
+    io->packets        = 0;
+    atomic_init(&io->echo_sent_us, 0);
+    atomic_init(&io->received_us, (uint32_t)esp_timer_get_time());
+    io->rtt_count      = 0;
+    io->rtt_sum_us     = 0;
+
+    if (!spsc_ring_init(&io->ring, SSH_IO_RING_SIZE)) {
+        ESP_LOGE(TAG, "no memory for the receive ring");
+        return false;
+    }
+    io->lock     = xSemaphoreCreateMutex();
+    io->stopped  = xSemaphoreCreateBinary();
+    io->received = xSemaphoreCreateBinary();
+    if (io->lock == NULL || io->stopped == NULL || io->received == NULL ||
+        xQueueAddToSet(io->received, io->wake) != pdPASS ||
+        xTaskCreate(ssh_io_task, "ssh_io", SSH_IO_TASK_STACK, io, SSH_IO_TASK_PRIORITY, &io->task) != pdPASS) {
+        ESP_LOGE(TAG, "failed to start the receive task");
+        if (io->lock != NULL) {
+            vSemaphoreDelete(io->lock);
+        }
+        if (io->stopped != NULL) {
+            vSemaphoreDelete(io->stopped);
+        }
+        if (io->received != NULL) {
+            xQueueRemoveFromSet(io->received, io->wake);
+            vSemaphoreDelete(io->received);
+        }
+        spsc_ring_free(&io->ring);
+        return false;
+    }
+    return true;
+}
+
+// Waits for the task to let go of the channel, so it can be closed and freed
+void ssh_io_stop(ssh_io_t* io) {
+    io->stop = true;
+    xTaskNotifyGive(io->task);
+    xSemaphoreTake(io->stopped, portMAX_DELAY);
+    ESP_LOGI(TAG, "received %lu bytes, waited %lu times for a full ring", (unsigned long)io->bytes_received,
+             (unsigned long)io->ring_full);
+    if (io->keystrokes > 0) {
+        ESP_LOGI(TAG, "sent %lu keystrokes in %lu packets, %.2f packets per keystroke", (unsigned long)io->keystrokes,
+                 (unsigned long)io->packets, (double)io->packets / io->keystrokes);
+    }
+    if (io->rtt_count > 0) {
+        ESP_LOGI(TAG, "round trip: last %lu ms, min %lu ms, average %llu ms over %lu", (unsigned long)io->rtt_last_us / 1000,
+                 (unsigned long)io->rtt_min_us / 1000, io->rtt_sum_us / io->rtt_count / 1000,
+                 (unsigned long)io->rtt_count);
+    }
+    // only an empty semaphore can leave the set
+    xSemaphoreTake(io->received, 0);
+    xQueueRemoveFromSet(io->received, io->wake);
+    vSemaphoreDelete(io->lock);
+    vSemaphoreDelete(io->stopped);
+    vSemaphoreDelete(io->received);
+    spsc_ring_free(&io->ring);
+}
+
+void ssh_io_send(ssh_io_t* io, char const* data, size_t len) {
+    io->keystrokes++;
+    if (io->tx_len + len > sizeof(io->tx)) {
+        ssh_io_flush(io);
+        if (io->tx_len + len > sizeof(io->tx)) {
+            // the server isn't taking input, don't hold up the session for it
+            ESP_LOGW(TAG, "dropped %u bytes of input", (unsigned)len);
+            return;
+        }
+    }
+    memcpy(io->tx + io->tx_len, data, len);
+    io->tx_len += len;
+
+    bool control = len == 1 && ((unsigned char)data[0] < 0x20 || data[0] == 0x7f);
+    if (control || io->tx_len == sizeof(io->tx)) {
+        ssh_io_flush(io);
+    } else if (io->tx_flush_us == INT64_MAX) {
+        io->tx_flush_us = esp_timer_get_time() + io->tx_window_us;
+    }
+}
+
+void ssh_io_flush(ssh_io_t* io) {
+    size_t sent = 0;
+    while (sent < io->tx_len) {
+        xSemaphoreTake(io->lock, portMAX_DELAY);
+        ssize_t rc = libssh2_channel_write(io->channel, io->tx + sent, io->tx_len - sent);
+        xSemaphoreGive(io->lock);
+        if (rc <= 0) {
+            if (rc != LIBSSH2_ERROR_EAGAIN) {
+                ESP_LOGE(TAG, "channel write failed: %d", (int)rc);
+                sent = io->tx_len;
+            }
+            break;
+        }
+        io->packets++;
+        sent += rc;
+
+        // while output is streaming the next data to arrive says nothing about the echo
+        uint32_t now  = (uint32_t)esp_timer_get_time();
+        uint32_t idle = 0;
+        if (now - atomic_load(&io->received_us) >= SSH_IO_RTT_QUIET_US && spsc_ring_used(&io->ring) == 0) {
+            atomic_compare_exchange_strong(&io->echo_sent_us, &idle, now | 1);
+        }
+    }
+
+    io->tx_len -= sent;
+    memmove(io->tx, io->tx + sent, io->tx_len);
+    io->tx_flush_us = io->tx_len ? esp_timer_get_time() + SSH_IO_RETRY_US : INT64_MAX;
+}
+
+int64_t ssh_io_flush_us(ssh_io_t* io) {
+    return io->tx_flush_us;
+}
+
+int ssh_io_keepalive(ssh_io_t* io) {
+    int next = 0;
+    xSemaphoreTake(io->lock, portMAX_DELAY);
+    int rc = libssh2_keepalive_send(io->session, &next);
+    xSemaphoreGive(io->lock);
+    if (rc != 0 && rc != LIBSSH2_ERROR_EAGAIN) {
+        ESP_LOGW(TAG, "keepalive failed: %d", rc);
+    }
+    return next;
+}
+
+int ssh_io_pty_size(ssh_io_t* io, int width, int height) {
+    xSemaphoreTake(io->lock, portMAX_DELAY);
+    int rc = libssh2_channel_request_pty_size(io->channel, width, height);
+    xSemaphoreGive(io->lock);
+    return rc;
+}
+
+char const* ssh_io_peek(ssh_io_t* io, size_t* len) {
+    return (char const*)spsc_ring_read_ptr(&io->ring, len);
+}
+
+void ssh_io_consume(ssh_io_t* io, size_t len) {
+    spsc_ring_release(&io->ring, len);
+    // in case the task is waiting for room
+    xTaskNotifyGive(io->task);
+}
+
+size_t ssh_io_pending(ssh_io_t* io) {
+    return spsc_ring_used(&io->ring);
+}
+
+bool ssh_io_ended(ssh_io_t* io) {
+    return io->eof && spsc_ring_used(&io->ring) == 0;
+}
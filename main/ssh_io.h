@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <libssh2.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "spsc_ring.h"
+
+// Outbound bytes gathered into one packet
+#define SSH_IO_TX_SIZE 256
+
+// Takes receiving off the render path. A task drains the channel into a PSRAM
+// ring as soon as data arrives, the session loop parses it from there at its
+// own pace. A slow redraw then no longer holds up TCP receive. libssh2 is not
+// thread safe, so every libssh2 call of either task is made under the lock.
+// Outbound input is gathered for a short window, so a burst of typing or key
+// repeat goes out as a few packets instead of one per character.
+typedef struct {
+    LIBSSH2_SESSION*  session;
+    LIBSSH2_CHANNEL*  channel;
+    libssh2_socket_t  sock;
+    SemaphoreHandle_t lock;
+    SemaphoreHandle_t stopped;  // given by the task on its way out
+    SemaphoreHandle_t received; // given when data arrives or the channel ends, a member of the wake set
+    QueueSetHandle_t  wake;
+    TaskHandle_t      task;
+    spsc_ring_t       ring;
+    volatile bool     stop;
+    volatile bool     eof;      // nothing more will arrive, the ring may still hold data
+    uint32_t          bytes_received;
+    uint32_t          ring_full;  // times the task had to wait for the consumer
+    char              tx[SSH_IO_TX_SIZE];
+    size_t            tx_len;
+    int64_t           tx_window_us;
+    int64_t           tx_flush_us;  // when the queued input is sent at the latest
+    uint32_t          keystrokes;
+    uint32_t          packets;
+    // Round trip from sending input to the next data received. Only measured when input goes
+    // out while the server has been quiet, so that data is the echo and not more output.
+    // Times are the low bits of esp_timer_get_time(), shared between both tasks.
+    atomic_uint       echo_sent_us;  // 0 while not measuring
+    atomic_uint       received_us;   // when data last arrived
+    uint32_t          rtt_last_us;
+    uint32_t          rtt_min_us;
+    uint64_t          rtt_sum_us;
+    uint32_t          rtt_count;
+} ssh_io_t;
+
+// received is added to wake, so the session loop can block on it and its input together
+// Input is held back for at most tx_window_us
+bool ssh_io_start(ssh_io_t* io, LIBSSH2_SESSION* session, LIBSSH2_CHANNEL* channel, libssh2_socket_t sock,
+                  QueueSetHandle_t wake, int64_t tx_window_us);
+void ssh_io_stop(ssh_io_t* io);
+int  ssh_io_pty_size(ssh_io_t* io, int width, int height);
+// Sends a keepalive if one is due, returns the seconds until the next one
+int  ssh_io_keepalive(ssh_io_t* io);
+
+// Queues the bytes of one key. A single control character, like Enter, Ctrl-C or Esc, sends
+// everything queued at once, as does a full buffer. Otherwise it waits for ssh_io_flush().
+void    ssh_io_send(ssh_io_t* io, char const* data, size_t len);
+void    ssh_io_flush(ssh_io_t* io);
+// When ssh_io_flush() is due, INT64_MAX while nothing is queued
+int64_t ssh_io_flush_us(ssh_io_t* io);
+
+// Received data, contiguous, then how much of it was used
+char const* ssh_io_peek(ssh_io_t* io, size_t* len);
+void        ssh_io_consume(ssh_io_t* io, size_t len);
+// Received bytes not consumed yet
+size_t      ssh_io_pending(ssh_io_t* io);
+
+// The server closed the channel and everything it sent has been consumed
+bool ssh_io_ended(ssh_io_t* io);
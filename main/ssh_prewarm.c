@@ -0,0 +1,223 @@
+#include "ssh_prewarm.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "wifi_connection.h"
+
+static char const TAG[] = "ssh_prewarm";
+
+extern bool wifi_stack_get_initialized(void);
+
+// A server drops a connection that doesn't log in within its grace time, OpenSSH
+// allows two minutes, so a parked one is given up on well before that
+#define SSH_PREWARM_PARK_US (30 * 1000000LL)
+
+// The task looks for a claim between steps, only Wi-Fi or closing keep it longer
+#define SSH_PREWARM_POLL_MS       50
+#define SSH_PREWARM_CLAIM_WAIT_MS 200
+#define SSH_PREWARM_TASK_STACK    8192
+
+typedef enum {
+    SSH_PREWARM_RUN,
+    SSH_PREWARM_CANCEL,
+    SSH_PREWARM_CLAIM,
+    SSH_PREWARM_HANDED,    // the claimer owns the connection
+    SSH_PREWARM_FINISHED,  // gave up by itself, nothing to claim
+} ssh_prewarm_state_t;
+
+// One per pre-warm, held by its task and by the menu until each lets go
+typedef struct {
+    ssh_settings_t settings;
+    ssh_connect_t  conn;
+    TaskHandle_t   task;
+    atomic_int     state;
+    atomic_int     refs;
+} ssh_prewarm_t;
+
+static ssh_prewarm_t*    ssh_prewarm_current;  // only touched by the menu task
+static SemaphoreHandle_t ssh_prewarm_wifi;
+static bool              ssh_prewarm_libssh2_ready;
+
+static void ssh_prewarm_release(ssh_prewarm_t* prewarm) {
+    if (atomic_fetch_sub(&prewarm->refs, 1) == 1) {
+        free(prewarm);
+    }
+}
+
+// Moves from one state to another, false when something else moved it first
+static bool ssh_prewarm_move(ssh_prewarm_t* prewarm, ssh_prewarm_state_t from, ssh_prewarm_state_t to) {
+    int expected = from;
+    return atomic_compare_exchange_strong(&prewarm->state, &expected, to);
+}
+
+// Created on the menu task before any pre-warm task exists
+static bool ssh_prewarm_wifi_ready(void) {
+    if (ssh_prewarm_wifi == NULL) {
+        ssh_prewarm_wifi = xSemaphoreCreateMutex();
+    }
+    return ssh_prewarm_wifi != NULL;
+}
+
+esp_err_t ssh_prewarm_wifi_connect(void) {
+    if (!ssh_prewarm_wifi_ready()) {
+        return ESP_ERR_NO_MEM;
+    }
+    xSemaphoreTake(ssh_prewarm_wifi, portMAX_DELAY);
+    esp_err_t res = wifi_connection_is_connected() ? ESP_OK : wifi_connect_try_all();
+    xSemaphoreGive(ssh_prewarm_wifi);
+    return res;
+}
+
+static void ssh_prewarm_task(void* arg) {
+    ssh_prewarm_t* prewarm = arg;
+    int64_t        start   = esp_timer_get_time();
+
+    if (!wifi_stack_get_initialized() || ssh_prewarm_wifi_connect() != ESP_OK) {
+        ESP_LOGW(TAG, "not connected to WiFi");
+        goto finish;
+    }
+    if (atomic_load(&prewarm->state) != SSH_PREWARM_RUN) {
+        goto finish;
+    }
+
+    // terminal and size are filled in by whoever claims it, they are only needed after the login
+    ssh_connect_begin(&prewarm->conn, &prewarm->settings, NULL, 0, 0);
+    while (atomic_load(&prewarm->state) == SSH_PREWARM_RUN) {
+        ssh_connect_phase_t phase = ssh_connect_step(&prewarm->conn);
+        if (phase == SSH_CONNECT_VERIFY_HOST || phase == SSH_CONNECT_FAILED) {
+            break;
+        }
+        ssh_connect_wait(&prewarm->conn, SSH_PREWARM_POLL_MS);
+    }
+    ESP_LOGI(TAG, "%s: %s after %lld ms", prewarm->settings.connection_name,
+             ssh_connect_phase_name(prewarm->conn.phase), (esp_timer_get_time() - start) / 1000);
+
+    // parked until it is claimed, given up on or has waited too long
+    int64_t park_until = esp_timer_get_time() + SSH_PREWARM_PARK_US;
+    while (atomic_load(&prewarm->state) == SSH_PREWARM_RUN && prewarm->conn.phase != SSH_CONNECT_FAILED) {
+        int64_t wait_us = park_until - esp_timer_get_time();
+        if (wait_us <= 0) {
+            ESP_LOGI(TAG, "%s: unused, closing", prewarm->settings.connection_name);
+            break;
+        }
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(wait_us / 1000) + 1);
+    }
+
+finish:
+    // a claim that is still being waited for gets the connection if it is any use, it is
+    // closed here otherwise so the claimer never waits on that
+    if (!ssh_prewarm_move(prewarm, SSH_PREWARM_RUN, SSH_PREWARM_FINISHED) &&
+        prewarm->conn.phase != SSH_CONNECT_FAILED && ssh_prewarm_move(prewarm, SSH_PREWARM_CLAIM, SSH_PREWARM_HANDED)) {
+        ssh_prewarm_release(prewarm);
+        vTaskDelete(NULL);
+    }
+    ssh_prewarm_move(prewarm, SSH_PREWARM_CLAIM, SSH_PREWARM_FINISHED);
+    ssh_connect_close(&prewarm->conn, "User closed session");
+    ssh_prewarm_release(prewarm);
+    vTaskDelete(NULL);
+}
+
+// Everything that decides how the connection was made has to be the same
+static bool ssh_prewarm_matches(ssh_prewarm_t const* prewarm, ssh_settings_t const* settings) {
+    ssh_settings_t const* prewarmed = &prewarm->settings;
+    return strcmp(prewarmed->dest_host, settings->dest_host) == 0 &&
+           strcmp(prewarmed->dest_port, settings->dest_port) == 0 &&
+           strcmp(prewarmed->username, settings->username) == 0 &&
+           prewarmed->tcp_nodelay == settings->tcp_nodelay &&
+           prewarmed->keepalive_interval == settings->keepalive_interval &&
+           prewarmed->rcvbuf_size == settings->rcvbuf_size &&
+           prewarmed->connect_timeout == settings->connect_timeout &&
+           strcmp(prewarmed->kex_prefs, settings->kex_prefs) == 0 &&
+           strcmp(prewarmed->hostkey_prefs, settings->hostkey_prefs) == 0 &&
+           strcmp(prewarmed->cipher_prefs, settings->cipher_prefs) == 0 &&
+           strcmp(prewarmed->mac_prefs, settings->mac_prefs) == 0;
+}
+
+void ssh_prewarm_start(ssh_settings_t const* settings) {
+    if (ssh_prewarm_current != NULL && atomic_load(&ssh_prewarm_current->state) == SSH_PREWARM_RUN &&
+        ssh_prewarm_matches(ssh_prewarm_current, settings)) {
+        return;
+    }
+    ssh_prewarm_cancel();
+
+    // kept for as long as the app runs, so tasks never init or exit libssh2 alongside the menu
+    if (!ssh_prewarm_libssh2_ready) {
+        if (libssh2_init(0) != 0) {
+            return;
+        }
+        ssh_prewarm_libssh2_ready = true;
+    }
+    if (!ssh_prewarm_wifi_ready()) {
+        return;
+    }
+
+    ssh_prewarm_t* prewarm = calloc(1, sizeof(ssh_prewarm_t));
+    if (prewarm == NULL) {
+        return;
+    }
+    prewarm->settings = *settings;
+    ssh_connect_init(&prewarm->conn);
+    atomic_init(&prewarm->state, SSH_PREWARM_RUN);
+    atomic_init(&prewarm->refs, 2);
+    if (xTaskCreate(ssh_prewarm_task, "ssh_prewarm", SSH_PREWARM_TASK_STACK, prewarm, tskIDLE_PRIORITY + 2,
+                    &prewarm->task) != pdPASS) {
+        ESP_LOGE(TAG, "failed to start the task");
+        free(prewarm);
+        return;
+    }
+    ssh_prewarm_current = prewarm;
+    ESP_LOGI(TAG, "%s: connecting in advance", settings->connection_name);
+}
+
+void ssh_prewarm_cancel(void) {
+    ssh_prewarm_t* prewarm = ssh_prewarm_current;
+    if (prewarm == NULL) {
+        return;
+    }
+    ssh_prewarm_current = NULL;
+
+    // the task notices at its next poll and closes by itself
+    if (ssh_prewarm_move(prewarm, SSH_PREWARM_RUN, SSH_PREWARM_CANCEL)) {
+        xTaskNotifyGive(prewarm->task);
+    }
+    ssh_prewarm_release(prewarm);
+}
+
+bool ssh_prewarm_claim(ssh_settings_t const* settings, char const* term, int cols, int rows, ssh_connect_t* conn) {
+    ssh_prewarm_t* prewarm = ssh_prewarm_current;
+    if (prewarm == NULL || !ssh_prewarm_matches(prewarm, settings) ||
+        !ssh_prewarm_move(prewarm, SSH_PREWARM_RUN, SSH_PREWARM_CLAIM)) {
+        ssh_prewarm_cancel();
+        return false;
+    }
+    ssh_prewarm_current = NULL;
+    xTaskNotifyGive(prewarm->task);
+
+    // busy with Wi-Fi most likely, connecting from scratch doesn't wait for it
+    TickType_t asked = xTaskGetTickCount();
+    while (atomic_load(&prewarm->state) == SSH_PREWARM_CLAIM &&
+           xTaskGetTickCount() - asked < pdMS_TO_TICKS(SSH_PREWARM_CLAIM_WAIT_MS)) {
+        vTaskDelay(1);
+    }
+    if (ssh_prewarm_move(prewarm, SSH_PREWARM_CLAIM, SSH_PREWARM_CANCEL)) {
+        ESP_LOGI(TAG, "%s: not ready to hand over", settings->connection_name);
+    }
+
+    // the task closes anything but a handed over connection itself
+    bool claimed = atomic_load(&prewarm->state) == SSH_PREWARM_HANDED;
+    if (claimed) {
+        *conn          = prewarm->conn;
+        conn->settings = settings;
+        conn->term     = term;
+        conn->cols     = cols;
+        conn->rows     = rows;
+        ESP_LOGI(TAG, "%s: claimed while %s", settings->connection_name, ssh_connect_phase_name(conn->phase));
+    }
+    ssh_prewarm_release(prewarm);
+    return claimed;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdbool.h>
+#include "esp_err.h"
+#include "settings_ssh.h"
+#include "ssh_connect.h"
+
+// Sets a connection up in the background while its menu entry is highlighted:
+// Wi-Fi, host lookup, TCP and key exchange. It stops short of the host key check
+// and the login, which need the user, and is parked until claimed or until it
+// has been left unused for a while. None of these wait for the background task,
+// one that is given up on closes by itself while the next one starts.
+void ssh_prewarm_start(ssh_settings_t const* settings);
+void ssh_prewarm_cancel(void);
+// Takes over the connection set up for these settings, however far it got. False
+// when there is none or it didn't let go quickly, after which the caller connects
+// from scratch.
+bool ssh_prewarm_claim(ssh_settings_t const* settings, char const* term, int cols, int rows, ssh_connect_t* conn);
+// wifi_connect_try_all() for one task at a time, a pre-warm may be at it as well
+esp_err_t ssh_prewarm_wifi_connect(void);
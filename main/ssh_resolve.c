@@ -0,0 +1,210 @@
+#include "ssh_resolve.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "lwip/netdb.h"
+
+static char const TAG[] = "ssh_resolve";
+
+// getaddrinfo() doesn't pass record TTLs on, lwIP applies them in its own table
+// underneath. This cache only saves the lookups through it when reconnecting, so
+// it keeps an answer for a short fixed time, and not at all once it failed.
+#define SSH_RESOLVE_CACHE_SIZE   4
+#define SSH_RESOLVE_CACHE_TTL_US (60 * 1000000LL)
+
+#define SSH_RESOLVE_TASK_STACK 4096
+
+typedef struct {
+    char            host[128];
+    char            port[6];
+    ssh_addr_list_t addrs;
+    int64_t         expires_us;
+} ssh_resolve_entry_t;
+
+// A pre-warm that is being given up on may still use it while the next connection
+// starts, so it is only touched under the lock. Lookup tasks hand results back
+// through their job.
+static ssh_resolve_entry_t ssh_resolve_cache[SSH_RESOLVE_CACHE_SIZE];
+static portMUX_TYPE        ssh_resolve_lock = portMUX_INITIALIZER_UNLOCKED;
+
+struct ssh_resolve_job_s {
+    char              host[128];
+    char              port[6];
+    ssh_addr_list_t   addrs;
+    SemaphoreHandle_t done;
+    atomic_int        refs;  // the lookup task and the caller, whoever lets go last frees it
+};
+
+static void ssh_resolve_release(ssh_resolve_job_t* job) {
+    if (atomic_fetch_sub(&job->refs, 1) == 1) {
+        vSemaphoreDelete(job->done);
+        free(job);
+    }
+}
+
+// lwIP answers one address per family, so both are asked for. The results alternate
+// between the families, IPv6 first, the way Happy Eyeballs (RFC 8305) orders them.
+static void ssh_resolve_lookup(char const* host, char const* port, int flags, ssh_addr_list_t* out) {
+    static int const families[2] = {AF_INET6, AF_INET};
+    struct addrinfo* found[2]    = {NULL, NULL};
+    struct addrinfo* next[2];
+
+    for (int f = 0; f < 2; f++) {
+        struct addrinfo hints = {.ai_family = families[f], .ai_socktype = SOCK_STREAM, .ai_flags = flags};
+        if (getaddrinfo(host, port, &hints, &found[f]) != 0) {
+            found[f] = NULL;
+        }
+        next[f] = found[f];
+    }
+
+    out->count = 0;
+    while (out->count < SSH_RESOLVE_MAX_ADDRS && (next[0] != NULL || next[1] != NULL)) {
+        for (int f = 0; f < 2 && out->count < SSH_RESOLVE_MAX_ADDRS; f++) {
+            if (next[f] == NULL) {
+                continue;
+            }
+            memcpy(&out->addr[out->count], next[f]->ai_addr, next[f]->ai_addrlen);
+            out->len[out->count] = next[f]->ai_addrlen;
+            out->count++;
+            next[f] = next[f]->ai_next;
+        }
+    }
+
+    for (int f = 0; f < 2; f++) {
+        if (found[f] != NULL) {
+            freeaddrinfo(found[f]);
+        }
+    }
+}
+
+static void ssh_resolve_task(void* arg) {
+    ssh_resolve_job_t* job   = arg;
+    int64_t            start = esp_timer_get_time();
+    ssh_resolve_lookup(job->host, job->port, 0, &job->addrs);
+    ESP_LOGI(TAG, "%s: %d addresses in %lld ms", job->host, job->addrs.count, (esp_timer_get_time() - start) / 1000);
+    xSemaphoreGive(job->done);
+    ssh_resolve_release(job);
+    vTaskDelete(NULL);
+}
+
+static ssh_resolve_entry_t* ssh_resolve_find(char const* host, char const* port) {
+    for (int i = 0; i < SSH_RESOLVE_CACHE_SIZE; i++) {
+        ssh_resolve_entry_t* entry = &ssh_resolve_cache[i];
+        if (entry->addrs.count > 0 && strcmp(entry->host, host) == 0 && strcmp(entry->port, port) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void ssh_resolve_store(char const* host, char const* port, ssh_addr_list_t const* addrs) {
+    if (addrs->count == 0 || strlen(host) >= sizeof(ssh_resolve_cache[0].host) ||
+        strlen(port) >= sizeof(ssh_resolve_cache[0].port)) {
+        return;
+    }
+
+    // the same name again, else a free slot, else the one closest to expiring
+    ssh_resolve_entry_t* entry = ssh_resolve_find(host, port);
+    for (int i = 0; entry == NULL && i < SSH_RESOLVE_CACHE_SIZE; i++) {
+        if (ssh_resolve_cache[i].addrs.count == 0) {
+            entry = &ssh_resolve_cache[i];
+        }
+    }
+    if (entry == NULL) {
+        entry = &ssh_resolve_cache[0];
+        for (int i = 1; i < SSH_RESOLVE_CACHE_SIZE; i++) {
+            if (ssh_resolve_cache[i].expires_us < entry->expires_us) {
+                entry = &ssh_resolve_cache[i];
+            }
+        }
+    }
+
+    strcpy(entry->host, host);
+    strcpy(entry->port, port);
+    entry->addrs      = *addrs;
+    entry->expires_us = esp_timer_get_time() + SSH_RESOLVE_CACHE_TTL_US;
+}
+
+bool ssh_resolve(char const* host, char const* port, ssh_addr_list_t* out, ssh_resolve_job_t** job) {
+    *job = NULL;
+
+    // an address literal needs no lookup
+    struct addrinfo  hints   = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_NUMERICHOST};
+    struct addrinfo* numeric = NULL;
+    if (getaddrinfo(host, port, &hints, &numeric) == 0) {
+        memcpy(&out->addr[0], numeric->ai_addr, numeric->ai_addrlen);
+        out->len[0] = numeric->ai_addrlen;
+        out->count  = 1;
+        freeaddrinfo(numeric);
+        return true;
+    }
+
+    bool                 cached = false;
+    taskENTER_CRITICAL(&ssh_resolve_lock);
+    ssh_resolve_entry_t* entry = ssh_resolve_find(host, port);
+    if (entry != NULL) {
+        if (esp_timer_get_time() < entry->expires_us) {
+            *out   = entry->addrs;
+            cached = true;
+        } else {
+            entry->addrs.count = 0;
+        }
+    }
+    taskEXIT_CRITICAL(&ssh_resolve_lock);
+    if (cached) {
+        ESP_LOGI(TAG, "%s: cached", host);
+        return true;
+    }
+
+    ssh_resolve_job_t* started = calloc(1, sizeof(ssh_resolve_job_t));
+    if (started != NULL) {
+        strlcpy(started->host, host, sizeof(started->host));
+        strlcpy(started->port, port, sizeof(started->port));
+        atomic_init(&started->refs, 2);
+        started->done = xSemaphoreCreateBinary();
+    }
+    if (started == NULL || started->done == NULL ||
+        xTaskCreate(ssh_resolve_task, "ssh_resolve", SSH_RESOLVE_TASK_STACK, started, tskIDLE_PRIORITY + 2, NULL) !=
+            pdPASS) {
+        ESP_LOGE(TAG, "failed to start a lookup");
+        if (started != NULL && started->done != NULL) {
+            vSemaphoreDelete(started->done);
+        }
+        free(started);
+        out->count = 0;
+        return true;
+    }
+
+    *job = started;
+    return false;
+}
+
+bool ssh_resolve_poll(ssh_resolve_job_t* job, ssh_addr_list_t* out, uint32_t wait_ms) {
+    if (xSemaphoreTake(job->done, pdMS_TO_TICKS(wait_ms)) != pdTRUE) {
+        return false;
+    }
+    *out = job->addrs;
+    taskENTER_CRITICAL(&ssh_resolve_lock);
+    ssh_resolve_store(job->host, job->port, out);
+    taskEXIT_CRITICAL(&ssh_resolve_lock);
+    ssh_resolve_release(job);
+    return true;
+}
+
+void ssh_resolve_abandon(ssh_resolve_job_t* job) {
+    ssh_resolve_release(job);
+}
+
+void ssh_resolve_forget(char const* host, char const* port) {
+    taskENTER_CRITICAL(&ssh_resolve_lock);
+    ssh_resolve_entry_t* entry = ssh_resolve_find(host, port);
+    if (entry != NULL) {
+        entry->addrs.count = 0;
+    }
+    taskEXIT_CRITICAL(&ssh_resolve_lock);
+}
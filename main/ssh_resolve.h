@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "lwip/sockets.h"
+
+// Addresses tried per connection, IPv6 and IPv4 together
+#define SSH_RESOLVE_MAX_ADDRS 6
+
+typedef struct {
+    struct sockaddr_storage addr[SSH_RESOLVE_MAX_ADDRS];
+    socklen_t               len[SSH_RESOLVE_MAX_ADDRS];
+    int                     count;
+} ssh_addr_list_t;
+
+typedef struct ssh_resolve_job_s ssh_resolve_job_t;
+
+// Resolves host and port to the addresses a connection should try, in the order
+// to try them: IPv6 and IPv4 interleaved, IPv6 first. Literal addresses and
+// cached names are answered at once, true then and out is filled in. Otherwise a
+// lookup is started on its own task and *job is set, DNS can take seconds and
+// the caller should stay responsive.
+bool ssh_resolve(char const* host, char const* port, ssh_addr_list_t* out, ssh_resolve_job_t** job);
+// True once the lookup is done, out is filled in and the job is gone then. An empty
+// list means the name didn't resolve.
+bool ssh_resolve_poll(ssh_resolve_job_t* job, ssh_addr_list_t* out, uint32_t wait_ms);
+// Gives up on a lookup, the task cleans up after itself when it finishes
+void ssh_resolve_abandon(ssh_resolve_job_t* job);
+// None of the addresses worked, don't hand them out again
+void ssh_resolve_forget(char const* host, char const* port);
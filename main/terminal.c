@@ -81,6 +81,7 @@ void menu_terminal(pax_buf_t* buffer, gui_theme_t* theme) {
     install_uart_driver();
 
     console_put(&console_instance, '@');
+    console_render(&console_instance);
     display_blit_buffer(buffer);
 
     while (1) {
@@ -96,6 +97,7 @@ void menu_terminal(pax_buf_t* buffer, gui_theme_t* theme) {
                                     bsp_power_set_radio_state(BSP_POWER_RADIO_STATE_OFF);
                                 } else {
                                     uart_driver_delete(TERMINAL_UART);
+                                    console_deinit(&console_instance);
                                     return;
                                 }
                                 break;
@@ -139,10 +141,9 @@ void menu_terminal(pax_buf_t* buffer, gui_theme_t* theme) {
                 case UART_DATA: {
                     int read = uart_read_bytes(TERMINAL_UART, read_buffer, uart_event.size, 0);
                     if (read > 0) {
-                        for (int pos = 0; pos < read; pos++) {
-                            console_put(&console_instance, read_buffer[pos]);
-                            putc(read_buffer[pos], stdout);
-                        }
+                        console_write(&console_instance, (char const*)read_buffer, read);
+                        fwrite(read_buffer, 1, read, stdout);
+                        console_render(&console_instance);
                         display_blit_buffer(buffer);
                     }
                     break;
@@ -183,6 +184,7 @@ void menu_terminal(pax_buf_t* buffer, gui_theme_t* theme) {
                 console_put(&console_instance, read_buffer[pos]);
                 putc(read_buffer[pos], stdout);
             }
+            console_render(&console_instance);
             display_blit_buffer(buffer);
         }
     }
@@ -1,7 +1,10 @@
 //
 // Derived from badgeteam/terminal-emulator, libssh2 example code, nicolaielectronics/tanmatsu-launcher
 //
+#include <errno.h>
 #include <string.h>
+#include <strings.h>
+#include <unistd.h>
 #include <sys/_intsup.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -15,6 +18,7 @@
 #include "driver/uart.h"
 #include "freertos/idf_additions.h"
 #include "freertos/projdefs.h"
+#include "freertos/semphr.h"
 #include "gui_element_footer.h"
 #include "gui_style.h"
 #include "icons.h"
@@ -25,11 +29,17 @@
 #include "tanmatsu_coprocessor.h"
 #include "wifi_connection.h"
 #include "esp_random.h"
+#include "esp_timer.h"
 #include <libssh2.h>
 #include "libssh2_setup.h"
 #include "lwip/sockets.h"
 #include "util_ssh.h"
 #include "settings_ssh.h"
+#include "render_scheduler.h"
+#include "ssh_connect.h"
+#include "ssh_benchmark.h"
+#include "ssh_io.h"
+#include "ssh_prewarm.h"
 
 extern bool wifi_stack_get_initialized(void);
 
@@ -59,6 +69,39 @@ static char const CHR_NL[] = "\n";
 
 #define BUFFER_SIZE 4096
 
+// Upper limit on how often server output is drawn, output in between is gathered into one frame
+#define SSH_RENDER_MAX_FPS 30
+
+// Lines of history kept in PSRAM, shift + up/down pages through them
+#define SSH_SCROLLBACK_LINES 2000
+
+// Font size multiplier steps for volume up/down
+#define SSH_FONT_SIZE_STEP 0.3f
+#define SSH_FONT_SIZE_MIN  0.6f
+#define SSH_FONT_SIZE_MAX  4.0f
+
+// Half a cursor blink period, each flip only redraws and sends the cursor cell
+#define SSH_CURSOR_BLINK_US 500000
+
+// PNG decoding needs a fair bit of stack
+#define SSH_BG_TASK_STACK 8192
+
+// How often the idle loop looks again at work nothing wakes it for: a window change the
+// server didn't take yet, and the background loader
+#define SSH_RETRY_US   10000
+
+// While connecting, how often keys are checked for ESC and how often a progress dot is added
+#define SSH_SETUP_POLL_MS 50
+#define SSH_SETUP_DOT_US  1000000
+
+// Key events typed before the shell is up, sent once it is
+#define SSH_TYPEAHEAD_EVENTS 32
+
+// Typing is held back this long to share a packet with the next key, control characters
+// like Enter go out at once
+#define SSH_WRITE_COALESCE_US 10000
+#define SSH_BG_POLL_US 100000
+
 //static uint8_t       read_buffer[BUFFER_SIZE] = {0};
 
 struct cons_insts_s console_instance;
@@ -69,27 +112,119 @@ void ssh_console_write_cb(char* str, size_t len) {
 
 pax_buf_t ssh_bg_pax_buf = {0};
 
+// Send only the parts of the framebuffer the console redrew since the last blit
+static void ssh_blit_damage(pax_buf_t* buffer) {
+    struct cons_rect_s damage[CONSOLE_DAMAGE_RECTS];
+    size_t count = console_get_damage(&console_instance, damage, CONSOLE_DAMAGE_RECTS);
+    for (size_t i = 0; i < count; i++) {
+        display_blit_rect(buffer, damage[i].x, damage[i].y, damage[i].w, damage[i].h);
+    }
+}
+
+// Zoom in or out. The console keeps its grid and draws it again at the new size, over its own copy
+// of the background image, so nothing has to come from the server. Returns false when the size
+// doesn't change.
+static bool ssh_set_font_size(float font_size_mult) {
+    if (font_size_mult < SSH_FONT_SIZE_MIN || font_size_mult > SSH_FONT_SIZE_MAX) {
+        return false;
+    }
+    if (console_set_font_size(&console_instance, font_size_mult) != 0) {
+        return false;
+    }
+    console_render(&console_instance);
+    return true;
+}
+
 LIBSSH2_KNOWNHOSTS *nh;
 static char const KNOWN_HOSTS_FILE[] = "/sd/ssh/known_hosts";
 
 
+// Raw RGB565 copy of a decoded background, stored next to the PNG as NN.565
+typedef struct {
+    char     magic[4];
+    uint16_t width;
+    uint16_t height;
+} ssh_bg_cache_header_t;
+
+static char const SSH_BG_CACHE_MAGIC[4] = {'R', '5', '6', '5'};
+
+// Loads the cache when it is at least as new as the PNG
+static bool ssh_bg_read_cache(char const* png_path, char const* cache_path) {
+    struct stat png_stat;
+    struct stat cache_stat;
+    if (stat(cache_path, &cache_stat) != 0 || stat(png_path, &png_stat) != 0 ||
+        cache_stat.st_mtime < png_stat.st_mtime) {
+        return false;
+    }
+
+    FILE* fd = fopen(cache_path, "rb");
+    if (fd == NULL) {
+        return false;
+    }
+
+    ssh_bg_cache_header_t header;
+    bool ok = fread(&header, sizeof(header), 1, fd) == 1 &&
+              memcmp(header.magic, SSH_BG_CACHE_MAGIC, sizeof(header.magic)) == 0 &&
+              header.width > 0 && header.height > 0;
+    if (ok) {
+        pax_buf_init(&ssh_bg_pax_buf, NULL, header.width, header.height, PAX_BUF_16_565RGB);
+        void* pixels = pax_buf_get_pixels_rw(&ssh_bg_pax_buf);
+        size_t size = (size_t)header.width * header.height * sizeof(uint16_t);
+        ok = pixels != NULL && fread(pixels, 1, size, fd) == size;
+        if (!ok) {
+            pax_buf_destroy(&ssh_bg_pax_buf);
+        }
+    }
+    fclose(fd);
+
+    if (!ok) {
+        ESP_LOGW(TAG, "ignoring broken background cache %s", cache_path);
+    }
+    return ok;
+}
+
+static void ssh_bg_write_cache(char const* cache_path) {
+    FILE* fd = fopen(cache_path, "wb");
+    if (fd == NULL) {
+        ESP_LOGW(TAG, "can't create background cache %s", cache_path);
+        return;
+    }
+
+    ssh_bg_cache_header_t header = {
+        .width  = ssh_bg_pax_buf.width,
+        .height = ssh_bg_pax_buf.height,
+    };
+    memcpy(header.magic, SSH_BG_CACHE_MAGIC, sizeof(header.magic));
+    size_t size = (size_t)header.width * header.height * sizeof(uint16_t);
+    bool ok = fwrite(&header, sizeof(header), 1, fd) == 1 &&
+              fwrite(pax_buf_get_pixels(&ssh_bg_pax_buf), 1, size, fd) == size;
+    fclose(fd);
+
+    // a half written cache would be picked up next time
+    if (!ok) {
+        ESP_LOGW(TAG, "failed to write background cache %s", cache_path);
+        unlink(cache_path);
+    }
+}
+
 static bool load_ssh_bg(void) {
     int backgrounds = 0;
     int randbgno = 0;
     DIR *d;
     struct dirent *dir;
     char bgfilename[PATH_MAX];
-    
-    //ESP_LOGI(TAG, "trying to opendir(/sd/bg)`");
+    char cachefilename[PATH_MAX];
+
     d = opendir("/sd/bg");
     if (!d) {
 	ESP_LOGI(TAG, "no background images directory found");
 	return false;
     }
 
+    // only the PNGs count, the caches live in the same directory
     while ((dir = readdir(d)) != NULL) {
-        if (dir->d_type==DT_REG) {
-            //ESP_LOGI(TAG, "found file %s\n", dir->d_name);
+        size_t len = strlen(dir->d_name);
+        if (dir->d_type == DT_REG && len > 4 && strcasecmp(dir->d_name + len - 4, ".png") == 0) {
             backgrounds++;
         }
     }
@@ -100,170 +235,110 @@ static bool load_ssh_bg(void) {
 	return false;
     }
 
-    //ESP_LOGI(TAG, "choosing a random background from %d", backgrounds + 1);
-    randbgno = rand() % (backgrounds + 1);
-    //ESP_LOGI(TAG, "picked number %d", randbgno);
+    randbgno = rand() % backgrounds;
     sprintf(bgfilename, "/sd/bg/%02d.png", randbgno);
-    //ESP_LOGI(TAG, "which is filename %s", bgfilename);
+    sprintf(cachefilename, "/sd/bg/%02d.565", randbgno);
+
+    if (ssh_bg_read_cache(bgfilename, cachefilename)) {
+        ESP_LOGI(TAG, "background loaded from %s", cachefilename);
+        return true;
+    }
 
     FILE* fd = fopen(bgfilename, "rb");
     if (fd == NULL) {
         ESP_LOGE(TAG, "Failed to open background image file");
         return false;
     }
-    if (!pax_decode_png_fd(&ssh_bg_pax_buf, fd, PAX_BUF_32_8888ARGB, 0)) {  // CODEC_FLAG_EXISTING)) {
+    // the console keeps the background as RGB565, decode straight into that
+    bool decoded = pax_decode_png_fd(&ssh_bg_pax_buf, fd, PAX_BUF_16_565RGB, 0);
+    fclose(fd);
+    if (!decoded) {
         ESP_LOGE(TAG, "Failed to decode png file");
         return false;
     }
-    fclose(fd);
+
+    ssh_bg_write_cache(cachefilename);
     return true;
 }
 
-static void keyboard_backlight(void) {
-    uint8_t brightness;
-    bsp_input_get_backlight_brightness(&brightness);
-    if (brightness != 100) {
-        brightness = 100;
-    } else {
-        brightness = 0;
-    }
-    ESP_LOGI(TAG, "Keyboard brightness: %u%%\r\n", brightness);
-    bsp_input_set_backlight_brightness(brightness);
+// The background is chosen and decoded on the other core while the connection is set up.
+// ssh_bg_done is given when the task is finished, ssh_bg_pax_buf is only touched by the
+// task until then.
+static SemaphoreHandle_t ssh_bg_done = NULL;
+static bool ssh_bg_running = false;
+static bool ssh_bg_loaded = false;
+
+static void ssh_bg_task(void* arg) {
+    int64_t start = esp_timer_get_time();
+    ssh_bg_loaded = load_ssh_bg();
+    ESP_LOGI(TAG, "background loader done in %lld ms", (esp_timer_get_time() - start) / 1000);
+    xSemaphoreGive(ssh_bg_done);
+    vTaskDelete(NULL);
 }
 
-static void display_backlight(void) {
-    uint8_t brightness;
-    bsp_display_get_backlight_brightness(&brightness);
-    brightness += 15;
-    if (brightness > 100) {
-        brightness = 10;
+static void ssh_bg_start(void) {
+    if (ssh_bg_done == NULL) {
+        ssh_bg_done = xSemaphoreCreateBinary();
+        if (ssh_bg_done == NULL) {
+            return;
+        }
+    }
+
+    // a session that ended early may have left its loader running, the pick is random anyway
+    // so this session takes over that image instead of waiting for it or loading another one
+    if (ssh_bg_running) {
+        ESP_LOGI(TAG, "background loader still running, using its image");
+        return;
+    }
+
+    ssh_bg_loaded = false;
+    if (xTaskCreatePinnedToCore(ssh_bg_task, "ssh_bg", SSH_BG_TASK_STACK, NULL, tskIDLE_PRIORITY + 1,
+                                NULL, CONFIG_SOC_CPU_CORES_NUM - 1) == pdPASS) {
+        ssh_bg_running = true;
     }
-    ESP_LOGI(TAG, "Display brightness: %u%%\r\n", brightness);
-    bsp_display_set_backlight_brightness(brightness);
 }
 
-// XXX this is the main function but it's getting a bit unwieldy - consider breaking up into functional parts
-void util_ssh(pax_buf_t* buffer, gui_theme_t* theme, ssh_settings_t* settings) {
-    QueueHandle_t input_event_queue = NULL;
-    ESP_ERROR_CHECK(bsp_input_get_queue(&input_event_queue));
+// True once, when the loader has finished with an image in ssh_bg_pax_buf
+static bool ssh_bg_poll(void) {
+    if (!ssh_bg_running || xSemaphoreTake(ssh_bg_done, 0) != pdTRUE) {
+        return false;
+    }
+    ssh_bg_running = false;
+    return ssh_bg_loaded;
+}
 
-    struct cons_config_s con_conf = {
-        .font = pax_font_sky_mono, 
-	.font_size_mult = 1.5, 
-	.paxbuf = display_get_buffer(), 
-	.output_cb = ssh_console_write_cb
-    };
+// Ticks until deadline_us, rounded up so the loop doesn't spin through the last partial tick
+static TickType_t ssh_wait_ticks(int64_t deadline_us) {
+    int64_t wait_us = deadline_us - esp_timer_get_time();
+    if (wait_us <= 0) {
+        return 0;
+    }
+    int64_t wait_ms = (wait_us + 999) / 1000;
+    return (wait_ms + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS;
+}
 
-    ssize_t nbytes; // bytes read from ssh server
-    int rc; // return code from libssh2 library calls
+// Checks the server's host key against the known hosts and asks the user about one that
+// isn't known or has changed. False when the user doesn't want to go on.
+static bool ssh_verify_host(pax_buf_t* buffer, ssh_settings_t* settings, LIBSSH2_SESSION* ssh_session) {
+    int rc;
     int i;
     int known_hosts = 0;
-    struct sockaddr_in ssh_addr;
-    char ssh_buffer[1024];
     char dialog_buffer[256];
     char ssh_comment[128];
-    char ssh_password[128];
-    LIBSSH2_SESSION *ssh_session;
-    LIBSSH2_CHANNEL *ssh_channel;
-    libssh2_socket_t ssh_sock;
     struct libssh2_knownhost *libssh2_knownhost;
-    char ssh_out = '\0';
     const char *ssh_hostkey = '\0';
     const char *ssh_hostkey_fingerprint = '\0';
     char ssh_printable_fingerprint[128];
     size_t ssh_hostkey_len;
     int ssh_hostkey_type;
-    char *ssh_userauthlist = '\0';
-    int cx = 0; // old cursor x position
-    int cy = 0; // old cursor y position
-    int ocx = 0; // old cursor x position
-    int ocy = 0; // old cursor y position
     int check = 0; // host key server check result
 
-    console_init(&console_instance, &con_conf);
-    //console_set_colors(&console_instance, CONS_COL_VGA_GREEN, CONS_COL_VGA_BLACK);
-    console_instance.fg = 0xff00ff00;
-    console_instance.bg = 0xff000000;
-    keyboard_backlight();
-
-    //busy_dialog(get_icon(ICON_REPOSITORY), "SSH", "Connecting to WiFi...");
-    console_printf(&console_instance, "\nConnecting to WiFi...\n");
-    display_blit_buffer(buffer);
-
-    if (!wifi_stack_get_initialized()) {
-        ESP_LOGE(TAG, "WiFi stack not initialized");
-        message_dialog(get_icon(ICON_REPOSITORY), "SSH: fatal error", "WiFi stack not initialized", "Quit");
-        return;
-    }
-
-    if (!wifi_connection_is_connected()) {
-        if (wifi_connect_try_all() != ESP_OK) {
-            ESP_LOGE(TAG, "Not connected to WiFi");
-            message_dialog(get_icon(ICON_REPOSITORY), "SSH: fatal error", "Failed to connect to WiFi network", "Quit");
-            return;
-        }
-    }
-
-    //ESP_LOGI(TAG, "initialising libssh2");
-    console_printf(&console_instance, "Initialising libssh2...\n");
-    display_blit_buffer(buffer);
-    rc = libssh2_init(0);
-    if (rc) {
-        ESP_LOGE(TAG, "libssh2 initialization failed (%d)", rc);
-        return;
-    }
-
-    ESP_LOGI(TAG, "setting up destination host IP address and port");
-    // TODO: check if any changes needed for IPv6 support
-    // TODO: check if any changes needed for DNS lookup of hostnames
-    inet_pton(AF_INET, settings->dest_host, &ssh_addr.sin_addr);
-    ssh_addr.sin_port = htons(atoi(settings->dest_port));
-    ssh_addr.sin_family = AF_INET;
-
-    ESP_LOGI(TAG, "creating socket to use for ssh session");
-    ssh_sock = socket(AF_INET, SOCK_STREAM, 0);
-    /*if (ssh_sock == LIBSSH2_INVALID_SOCKET) {
-        ESP_LOGE(TAG, "failed to create socket");
-        return;
-    }*/
-
-    ESP_LOGI(TAG, "connecting...");
-    console_printf(&console_instance, "Connecting...\n");
-    display_blit_buffer(buffer);
-    if (connect(ssh_sock, (struct sockaddr*)&ssh_addr, sizeof(ssh_addr))) {
-        ESP_LOGE(TAG, "failed to connect.");
-        return;
-    }
-
-    console_printf(&console_instance, "Starting SSH session...\n");
-    display_blit_buffer(buffer);
-    ESP_LOGI(TAG, "initialising session");
-    ssh_session = libssh2_session_init();
-    if (!ssh_session) {
-        ESP_LOGE(TAG, "could not initialize SSH session");
-        return;
-    }
-
-    // XXX we can do verbose ssh debugging if needed... 
-    //libssh2_trace(ssh_session, ~0);
-    // TODO: display server banner?
-    // TODO: display the info we're currently logging about connection setup
-    // TODO: condense multiple dialogs at connection time down to one
-
-    ESP_LOGI(TAG, "session handshake");
-    console_printf(&console_instance, "Session handshake...\n");
-    rc = libssh2_session_handshake(ssh_session, ssh_sock);
-    if (rc) {
-        ESP_LOGE(TAG, "failure establishing SSH session: %d", rc);
-        return;
-    }
-
     ESP_LOGI(TAG, "initialising known host database");
     console_printf(&console_instance, "Initialising known host database...\n");
     nh = libssh2_knownhost_init(ssh_session);
     if (!nh) {
-        ESP_LOGE(TAG, "failure initialising known hosts database: %d", rc);
-        return;
+        ESP_LOGE(TAG, "failure initialising known hosts database");
+        return false;
     }
 
     ESP_LOGI(TAG, "checking to see if we have any saved known hosts");
@@ -333,13 +408,6 @@ void util_ssh(pax_buf_t* buffer, gui_theme_t* theme, ssh_settings_t* settings) {
     ESP_LOGI(TAG, "Host key fingerprint... %s\n", ssh_printable_fingerprint);
     console_printf(&console_instance, "Host key fingerprint... %s\n", ssh_printable_fingerprint);
   
-    ESP_LOGI(TAG, "user auth methods check");
-    ssh_userauthlist = libssh2_userauth_list(ssh_session, settings->username, (unsigned int)strlen(settings->username));
-    ESP_LOGI(TAG, "user auth methods list: %s", ssh_userauthlist);
-    console_printf(&console_instance, "Host supports auth methods... %s\n", ssh_userauthlist);
-    // TODO: Check list of supported auth methods
-    // TODO: UI for user to pick their preferred auth method
-
     ESP_LOGI(TAG, "checking host key against known hosts data");
     console_printf(&console_instance, "Checking to see if we have seen this host key before...\n");
     ESP_LOGI(TAG, "ssh_hostkey: %s", ssh_hostkey);
@@ -376,14 +444,7 @@ void util_ssh(pax_buf_t* buffer, gui_theme_t* theme, ssh_settings_t* settings) {
             int dialog_rc = adv_dialog_yes_no(get_icon(ICON_REPOSITORY), "SSH server key/fingerprint check", dialog_buffer);
             if (dialog_rc == MSG_DIALOG_RETURN_NO) {
                 ESP_LOGI(TAG, "user decided not to carry on with connection after seeing ssh host key fingerprint");
-                if (ssh_sock != LIBSSH2_INVALID_SOCKET) {
-                     shutdown(ssh_sock, 2);
-                     LIBSSH2_SOCKET_CLOSE(ssh_sock);
-                 }
-                     pax_draw_rect(buffer, 0xffefefef, 0, 0, 800, 480);
-                 display_blit_buffer(buffer);
-                 libssh2_exit();	
-	         return;
+                return false;
 	    }
         }
 
@@ -445,92 +506,341 @@ void util_ssh(pax_buf_t* buffer, gui_theme_t* theme, ssh_settings_t* settings) {
     //	  }
     //}
 
-    ESP_LOGI(TAG, "checking to see if we have a saved password as part of this connection");
-    if (strlen(settings->password) > 0) {
-        ESP_LOGI(TAG, "using saved password");
-	strncpy(ssh_password, settings->password, strlen(settings->password));
+    return true;
+}
+
+static void keyboard_backlight(void) {
+    uint8_t brightness;
+    bsp_input_get_backlight_brightness(&brightness);
+    if (brightness != 100) {
+        brightness = 100;
     } else {
-        ESP_LOGI(TAG, "no saved password, so let's prompt the user for one");
-        bool accepted  = false;
-        memset(ssh_password, 0, sizeof(ssh_password)); // don't display the password
-    
-        menu_textedit(buffer, theme, "Password", ssh_password, sizeof(settings->password) + sizeof('\0'), true, &accepted);
-        if (accepted) {
-            ESP_LOGI(TAG, "updated password: <redacted>");
-            //ESP_LOGI(TAG, "updated password: %s", ssh_password);
-        } 
+        brightness = 0;
     }
+    ESP_LOGI(TAG, "Keyboard brightness: %u%%\r\n", brightness);
+    bsp_input_set_backlight_brightness(brightness);
+}
 
-    ESP_LOGI(TAG, "authenticating to %s:%s as user %s", settings->dest_host, settings->dest_port, settings->username);
-    console_printf(&console_instance, "Authenticating to %s:%s as user %s", settings->dest_host, settings->dest_port, settings->username);
-    if (libssh2_userauth_password(ssh_session, settings->username, settings->password)) {
-        ESP_LOGE(TAG, "authentication by password failed");
-        return;
+// Moves the history view, true when that changed what is on screen. Nothing else
+// asks for a render then, the server may well be quiet.
+static bool ssh_scrollback_move(int lines) {
+    size_t view = console_instance.scrollback.view;
+    return console_scrollback_view(&console_instance, lines) != view;
+}
+
+static void display_backlight(void) {
+    uint8_t brightness;
+    bsp_display_get_backlight_brightness(&brightness);
+    brightness += 15;
+    if (brightness > 100) {
+        brightness = 10;
     }
-    ESP_LOGE(TAG, "authentication by password succeeded");
+    ESP_LOGI(TAG, "Display brightness: %u%%\r\n", brightness);
+    bsp_display_set_backlight_brightness(brightness);
+}
 
-    // TODO: Support keyboard_interactive auth
-    // TODO: Support public key auth
-    // TODO: Support agent auth
-    //if (libssh2_userauth_keyboard_interactive(ssh_session, ssh_username, &kbd_callback) ) {
-    //if (libssh2_userauth_publickey_fromfile(ssh_session, ssh_username, ssh_fn1, ssh_fn2, ssh_password)) {
+// XXX this is the main function but it's getting a bit unwieldy - consider breaking up into functional parts
+void util_ssh(pax_buf_t* buffer, gui_theme_t* theme, ssh_settings_t* settings) {
+    QueueHandle_t input_event_queue = NULL;
+    ESP_ERROR_CHECK(bsp_input_get_queue(&input_event_queue));
 
-    ESP_LOGI(TAG, "requesting session");
-    console_printf(&console_instance, "Requesting ssh session...\n");
-    ssh_channel = libssh2_channel_open_session(ssh_session);
-    if (!ssh_channel) {
-        ESP_LOGE(TAG, "unable to open a session");
-        return;
-    }
+    struct cons_config_s con_conf = {
+        .font = pax_font_sky_mono, 
+	.font_size_mult = 1.5, 
+	.paxbuf = display_get_buffer(), 
+	.scrollback_lines = SSH_SCROLLBACK_LINES,
+	.output_cb = ssh_console_write_cb
+    };
+
+    int rc; // return code from libssh2 library calls
+    int i;
+    char ssh_comment[128];
+    char ssh_password[128];
+    LIBSSH2_SESSION *ssh_session;
+    LIBSSH2_CHANNEL *ssh_channel;
+    libssh2_socket_t ssh_sock;
+    char ssh_out = '\0';
+    ssh_connect_t conn; // everything the connection opened, closed in one place
+    bool libssh2_ready = false;
+    bool cancelled = false; // ESC while connecting, no error to show
+    bsp_input_event_t typeahead[SSH_TYPEAHEAD_EVENTS]; // keys typed before the shell was up
+    int typeahead_len = 0;
+    bool full_blit = false; // something other than the console drew on the screen
+    bool pty_resize = false; // the server still has to be told about a new terminal size
+    bool cursor_blinked = false; // the cursor cell has to be drawn again
+    bool view_moved = false; // the history view changed, the cells shown have to be drawn again
+    int64_t cursor_blink_us = 0; // next blink flip
+    int64_t keepalive_us = INT64_MAX; // next keepalive check, never while they are off
+    render_scheduler_t render_scheduler;
+    ssh_io_t ssh_io;
+    bsp_input_event_t event;
+    QueueSetHandle_t wake_set; // input events and received data, the loop sleeps on both
+    uint32_t wakeups = 0;
+    int64_t session_start_us;
+
+    console_init(&console_instance, &con_conf);
+#if CONSOLE_BENCHMARK == 1
+    console_benchmark(&console_instance);
+#endif
+    console_set_colors(&console_instance, 0xff00ff00, 0xff000000);
+    console_set_cursor_style(&console_instance, CONS_CURSOR_BAR, true);
+    keyboard_backlight();
+    ssh_connect_init(&conn);
+    nh = NULL;
 
-    //ESP_LOGI(TAG, "sending env variables");
-    libssh2_channel_setenv(ssh_channel, "LANG", "en_US.UTF-8");
+    // decode the background on the other core while the connection is set up
+    ssh_bg_start();
 
-    ESP_LOGI(TAG, "requesting pty");
-    console_printf(&console_instance, "Requesting pseudoterminal for interactive login session...\n");
     // TODO: Let user set terminal type?
     // TODO: Test with TERM xterm-color etc
-    if (libssh2_channel_request_pty(ssh_channel, "xterm-256color")) {
-        ESP_LOGE(TAG, "failed requesting pty");
-        return;
+    static char const term[] = "xterm-256color";
+
+    // the menu may have set the connection up already while the entry was highlighted
+    bool prewarmed = ssh_prewarm_claim(settings, term, console_instance.chars_x, console_instance.chars_y, &conn);
+    if (prewarmed) {
+        console_printf(&console_instance, "\nUsing the connection made in advance...\n");
+    } else {
+        //busy_dialog(get_icon(ICON_REPOSITORY), "SSH", "Connecting to WiFi...");
+        console_printf(&console_instance, "\nConnecting to WiFi...\n");
+        console_render(&console_instance);
+        display_blit_buffer(buffer);
+
+        if (!wifi_stack_get_initialized()) {
+            ESP_LOGE(TAG, "WiFi stack not initialized");
+            message_dialog(get_icon(ICON_REPOSITORY), "SSH: fatal error", "WiFi stack not initialized", "Quit");
+            goto shutdown_connection;
+        }
+
+        // one at a time with a pre-warm that may still be connecting
+        if (ssh_prewarm_wifi_connect() != ESP_OK) {
+            ESP_LOGE(TAG, "Not connected to WiFi");
+            message_dialog(get_icon(ICON_REPOSITORY), "SSH: fatal error", "Failed to connect to WiFi network", "Quit");
+            goto shutdown_connection;
+        }
+
+        //ESP_LOGI(TAG, "initialising libssh2");
+        console_printf(&console_instance, "Initialising libssh2...\n");
+        console_render(&console_instance);
+        display_blit_buffer(buffer);
+    }
+    rc = libssh2_init(0);
+    if (rc) {
+        ESP_LOGE(TAG, "libssh2 initialization failed (%d)", rc);
+        goto shutdown_connection;
     }
+    libssh2_ready = true;
 
-    // TODO: check whether libssh2_channel_shell is required
-    if (libssh2_channel_shell(ssh_channel)) {
-        ESP_LOGE(TAG, "failed requesting shell");
-        return;
+    // XXX we can do verbose ssh debugging if needed... 
+    //libssh2_trace(ssh_session, ~0);
+    // TODO: display server banner?
+
+    // every step waits on the socket instead of blocking, so a dead host can be given up on
+    // with ESC and keys typed in the meantime reach the shell once it is up
+    if (!prewarmed) {
+        ssh_connect_begin(&conn, settings, term, console_instance.chars_x, console_instance.chars_y);
     }
+    ssh_connect_phase_t shown = SSH_CONNECT_FAILED;
+    int64_t dot_us = 0;
+    while (1) {
+        ssh_connect_phase_t phase = ssh_connect_step(&conn);
+        if (phase != shown) {
+            if (shown == SSH_CONNECT_AUTH && conn.auth_methods != NULL) {
+                console_printf(&console_instance, "Host supports auth methods... %s\n", conn.auth_methods);
+            }
+            if (phase != SSH_CONNECT_FAILED) {
+                ESP_LOGI(TAG, "%s", ssh_connect_phase_name(phase));
+                console_printf(&console_instance, "%s...\n", ssh_connect_phase_name(phase));
+            }
+            console_render(&console_instance);
+            display_blit_buffer(buffer);
+            shown = phase;
+            dot_us = esp_timer_get_time() + SSH_SETUP_DOT_US;
+        }
+        if (phase == SSH_CONNECT_DONE || phase == SSH_CONNECT_FAILED) {
+            break;
+        }
 
-    ESP_LOGI(TAG, "making the channel non-blocking");
-    libssh2_channel_set_blocking(ssh_channel, 0);
+        if (phase == SSH_CONNECT_VERIFY_HOST) {
+            if (!ssh_verify_host(buffer, settings, conn.session)) {
+                ssh_connect_cancel(&conn, "host key rejected");
+                cancelled = true;
+                continue;
+            }
+
+            ESP_LOGI(TAG, "checking to see if we have a saved password as part of this connection");
+            memset(ssh_password, 0, sizeof(ssh_password)); // don't display the password
+            if (strlen(settings->password) > 0) {
+                ESP_LOGI(TAG, "using saved password");
+                strncpy(ssh_password, settings->password, sizeof(ssh_password) - 1);
+            } else {
+                ESP_LOGI(TAG, "no saved password, so let's prompt the user for one");
+                bool accepted  = false;
+                menu_textedit(buffer, theme, "Password", ssh_password, sizeof(settings->password) + sizeof('\0'), true, &accepted);
+                if (accepted) {
+                    ESP_LOGI(TAG, "updated password: <redacted>");
+                }
+            }
+
+            // the dialogs drew over the console
+            console_redraw(&console_instance);
+            display_blit_buffer(buffer);
+            ESP_LOGI(TAG, "authenticating to %s:%s as user %s", settings->dest_host, settings->dest_port, settings->username);
+            console_printf(&console_instance, "Authenticating to %s:%s as user %s\n", settings->dest_host, settings->dest_port, settings->username);
+            ssh_connect_authenticate(&conn, ssh_password);
+            continue;
+        }
+
+        ssh_connect_wait(&conn, SSH_SETUP_POLL_MS);
+
+        // still waiting, show that something is happening
+        if (esp_timer_get_time() >= dot_us) {
+            console_printf(&console_instance, ".");
+            console_render(&console_instance);
+            display_blit_buffer(buffer);
+            dot_us = esp_timer_get_time() + SSH_SETUP_DOT_US;
+        }
+
+        // ESC gives up, other keys wait for the shell
+        while (xQueueReceive(input_event_queue, &event, 0) == pdTRUE) {
+            if (event.type == INPUT_EVENT_TYPE_NAVIGATION && event.args_navigation.state &&
+                (event.args_navigation.key == BSP_INPUT_NAVIGATION_KEY_ESC ||
+                 event.args_navigation.key == BSP_INPUT_NAVIGATION_KEY_F1)) {
+                ssh_connect_cancel(&conn, "cancelled");
+                cancelled = true;
+            } else if ((event.type == INPUT_EVENT_TYPE_KEYBOARD ||
+                        (event.type == INPUT_EVENT_TYPE_NAVIGATION && event.args_navigation.state)) &&
+                       typeahead_len < SSH_TYPEAHEAD_EVENTS) {
+                typeahead[typeahead_len++] = event;
+            }
+        }
+    }
+
+    if (conn.phase != SSH_CONNECT_DONE) {
+        if (!cancelled) {
+            snprintf(ssh_comment, sizeof(ssh_comment), "%s: %s", ssh_connect_phase_name(conn.failed_phase), conn.error);
+            message_dialog(get_icon(ICON_REPOSITORY), "SSH: connection failed", ssh_comment, "Quit");
+        }
+        goto shutdown_connection;
+    }
+    ESP_LOGI(TAG, "ssh session is up");
+
+#if SSH_BENCHMARK == 1
+    // every cipher gets a connection of its own, the session waits until they are done
+    console_printf(&console_instance, "Benchmarking ciphers...\n");
+    console_render(&console_instance);
+    display_blit_buffer(buffer);
+    ssh_benchmark_result_t results[SSH_BENCHMARK_MAX_RESULTS];
+    int result_count = ssh_benchmark(settings, conn.session, ssh_password, results, SSH_BENCHMARK_MAX_RESULTS);
+    for (i = 0; i < result_count; i++) {
+        if (results[i].error != NULL) {
+            console_printf(&console_instance, "%-30s %s\n", results[i].cipher, results[i].error);
+        } else {
+            console_printf(&console_instance, "%-30s kex %5lld ms %8lld KiB/s\n", results[i].cipher,
+                           results[i].kex_us / 1000,
+                           (int64_t)results[i].bytes * 1000000 / 1024 / (results[i].transfer_us + 1));
+        }
+    }
+    console_printf(&console_instance, "Press any key to start the session\n");
+    console_render(&console_instance);
+    display_blit_buffer(buffer);
+    while (xQueueReceive(input_event_queue, &event, portMAX_DELAY) == pdTRUE &&
+           event.type != INPUT_EVENT_TYPE_KEYBOARD &&
+           !(event.type == INPUT_EVENT_TYPE_NAVIGATION && event.args_navigation.state)) {
+    }
+#endif
+    ssh_session = conn.session;
+    ssh_channel = conn.channel;
+    ssh_sock = conn.sock;
+
+    // a queue can only join a set while it is empty, keys typed during setup are put back
+    // once it has
+    wake_set = xQueueCreateSet(uxQueueSpacesAvailable(input_event_queue) +
+                               uxQueueMessagesWaiting(input_event_queue) + 1);
+    if (wake_set == NULL) {
+        ESP_LOGE(TAG, "failed creating the wake set");
+        goto shutdown_connection;
+    }
+    do {
+        while (xQueueReceive(input_event_queue, &event, 0) == pdTRUE) {
+            if (typeahead_len < SSH_TYPEAHEAD_EVENTS) {
+                typeahead[typeahead_len++] = event;
+            }
+        }
+    } while (xQueueAddToSet(input_event_queue, wake_set) != pdPASS);
+    for (i = 0; i < typeahead_len; i++) {
+        xQueueSend(input_event_queue, &typeahead[i], 0);
+    }
+
+    // from here on the channel belongs to the receive task, this one only writes through it
+    if (!ssh_io_start(&ssh_io, ssh_session, ssh_channel, ssh_sock, wake_set, SSH_WRITE_COALESCE_US)) {
+        ESP_LOGE(TAG, "failed starting the receive task");
+        goto shutdown_wake;
+    }
 
-    // TODO: make background image loading into a task, so it doesn't hold everything else up
-    // TODO: see if we can find a way to stop background image from scrolling
     // TODO: function key switches between background images?
-    ESP_LOGI(TAG, "trying to load background image");
-    console_printf(&console_instance, "Looking for background images...\n");
-    load_ssh_bg();
     console_clear(&console_instance);
     console_set_cursor(&console_instance, 0, 0);
-    pax_draw_image(buffer, &ssh_bg_pax_buf, 0, 0);
+    console_render(&console_instance);
     display_blit_buffer(buffer);
+    console_get_damage(&console_instance, NULL, 0);
 
     ESP_LOGI(TAG, "ssh setup completed, entering main loop");
+    render_scheduler_init(&render_scheduler, SSH_RENDER_MAX_FPS);
+    session_start_us = esp_timer_get_time();
+    if (settings->keepalive_interval > 0) {
+        keepalive_us = session_start_us;
+    }
 
     while (1) {
-        bsp_input_event_t event;
-        if (xQueueReceive(input_event_queue, &event, pdMS_TO_TICKS(10)) == pdTRUE) {
+        // sleep until there is work: a key, received data, a frame or cursor flip that is due
+        int64_t deadline_us = cursor_blink_us;
+        int64_t frame_us = render_scheduler_next_us(&render_scheduler);
+        if (frame_us < deadline_us) {
+            deadline_us = frame_us;
+        }
+        int64_t flush_us = ssh_io_flush_us(&ssh_io);
+        if (flush_us < deadline_us) {
+            deadline_us = flush_us;
+        }
+        if (keepalive_us < deadline_us) {
+            deadline_us = keepalive_us;
+        }
+        // data left over from the last pass is parsed straight away
+        if (ssh_io_pending(&ssh_io) > 0) {
+            deadline_us = esp_timer_get_time();
+        }
+        if (pty_resize || ssh_bg_running) {
+            int64_t poll_us = esp_timer_get_time() + (pty_resize ? SSH_RETRY_US : SSH_BG_POLL_US);
+            if (poll_us < deadline_us) {
+                deadline_us = poll_us;
+            }
+        }
+        QueueSetMemberHandle_t ready = xQueueSelectFromSet(wake_set, ssh_wait_ticks(deadline_us));
+        wakeups++;
+
+        // then take everything that is pending in one pass, each member once per set entry so
+        // the set stays in step with its queues
+        for (; ready != NULL; ready = xQueueSelectFromSet(wake_set, 0)) {
+            if (ready == ssh_io.received) {
+                xSemaphoreTake(ssh_io.received, 0);
+                continue;
+            }
+            if (xQueueReceive(input_event_queue, &event, 0) != pdTRUE) {
+                continue;
+            }
             //ESP_LOGI(TAG, "input received");
             switch (event.type) {
                 case INPUT_EVENT_TYPE_KEYBOARD:
 		    //ESP_LOGI(TAG, "normal keyboard event received");
+		    // typing jumps back from the history to the live screen
+		    view_moved |= ssh_scrollback_move(-(int)console_instance.scrollback.view);
 		    ssh_out = event.args_keyboard.ascii;
 		    if (event.args_keyboard.modifiers & BSP_INPUT_MODIFIER_CTRL) {
 			//ESP_LOGI(TAG, "applying CTRL modifier");
                         ssh_out &= 0x1f; // modify the keycode sent to make it a control character
 		    }
 		    // TODO: Add support for other modifiers where needed, e.g. ALT, FN
-                    libssh2_channel_write(ssh_channel, &ssh_out, sizeof(ssh_out));
+                    ssh_io_send(&ssh_io, &ssh_out, sizeof(ssh_out));
                     break;
 		case INPUT_EVENT_TYPE_NONE:
 		    ESP_LOGI(TAG, "input is a non-event");
@@ -549,7 +859,7 @@ void util_ssh(pax_buf_t* buffer, gui_theme_t* theme, ssh_settings_t* settings) {
                             case BSP_INPUT_NAVIGATION_KEY_ESC:
 				ESP_LOGI(TAG, "esc key pressed");
 				ssh_out = '\e';
-                                libssh2_channel_write(ssh_channel, &ssh_out, 1);
+                                ssh_io_send(&ssh_io, &ssh_out, 1);
 				break;
                             case BSP_INPUT_NAVIGATION_KEY_F1:
 				ESP_LOGI(TAG, "close key pressed - returning to app launcher");
@@ -566,83 +876,68 @@ void util_ssh(pax_buf_t* buffer, gui_theme_t* theme, ssh_settings_t* settings) {
 				break;
                             case BSP_INPUT_NAVIGATION_KEY_F6:
 				ESP_LOGI(TAG, "colour randomiser");
-	        		//printf("clearing cursor visual at old cursor position... %d, %d\n", ocx, ocy);
-  	        		pax_draw_line(buffer, 0xff000000, ocx, ocy, ocx, ocy + (console_instance.char_height - 1));
-    				console_init(&console_instance, &con_conf);
-    				console_clear(&console_instance);
-                                int randfg = (rand() % 0xffffff) & 0xff000000;
-                                int randbg = (rand() % 0xffffff) & 0xff000000;
-	                        console_instance.fg = randfg;
-	                        console_instance.bg = randbg;
+                                int randfg = (rand() & 0xffffff) | 0xff000000;
+                                int randbg = (rand() & 0xffffff) | 0xff000000;
 				fprintf(stderr, "fg: %08x, bg: %08x\n", randfg, randbg);
-				console_set_cursor(&console_instance, 0, 0);
-				cx = cy = ocx = ocy = 0;
-  	        		pax_draw_line(buffer, 0xff000000, ocx, ocy, ocx, ocy + (console_instance.char_height - 1));
-                                libssh2_channel_write(ssh_channel, CHR_NL, 1);
+				// recolour the grid and repaint it locally, no need to ask the server to resend anything
+				console_recolor(&console_instance, randfg, randbg);
+				console_redraw(&console_instance);
                                 display_blit_buffer(buffer);
+				console_get_damage(&console_instance, NULL, 0);
 				break;
 			    case BSP_INPUT_NAVIGATION_KEY_LEFT:
 				ESP_LOGI(TAG, "left key pressed");
-                                libssh2_channel_write(ssh_channel, CSI_LEFT, strlen(CSI_LEFT));
+                                ssh_io_send(&ssh_io, CSI_LEFT, strlen(CSI_LEFT));
 				break;
             		    case BSP_INPUT_NAVIGATION_KEY_RIGHT:
 				ESP_LOGI(TAG, "right key pressed");
-                                libssh2_channel_write(ssh_channel, CSI_RIGHT, strlen(CSI_RIGHT));
+                                ssh_io_send(&ssh_io, CSI_RIGHT, strlen(CSI_RIGHT));
 				break;
             		    case BSP_INPUT_NAVIGATION_KEY_UP:
+				if (event.args_navigation.modifiers & BSP_INPUT_MODIFIER_SHIFT) {
+				    // half a screen back into the history
+				    view_moved |= ssh_scrollback_move(console_instance.chars_y / 2);
+				    break;
+				}
 				ESP_LOGI(TAG, "up key pressed");
-                                libssh2_channel_write(ssh_channel, CSI_UP, strlen(CSI_UP));
+				view_moved |= ssh_scrollback_move(-(int)console_instance.scrollback.view);
+                                ssh_io_send(&ssh_io, CSI_UP, strlen(CSI_UP));
 				break;
             		    case BSP_INPUT_NAVIGATION_KEY_DOWN:
+				if (event.args_navigation.modifiers & BSP_INPUT_MODIFIER_SHIFT) {
+				    view_moved |= ssh_scrollback_move(-(int)(console_instance.chars_y / 2));
+				    break;
+				}
 				ESP_LOGI(TAG, "down key pressed");
-                                libssh2_channel_write(ssh_channel, CSI_DOWN, strlen(CSI_DOWN));
+				view_moved |= ssh_scrollback_move(-(int)console_instance.scrollback.view);
+                                ssh_io_send(&ssh_io, CSI_DOWN, strlen(CSI_DOWN));
 				break;
             		    case BSP_INPUT_NAVIGATION_KEY_TAB:
 				ESP_LOGI(TAG, "tab key pressed");
-                                libssh2_channel_write(ssh_channel, CHR_TAB, 1);
+                                ssh_io_send(&ssh_io, CHR_TAB, 1);
 				break;
 			    case BSP_INPUT_NAVIGATION_KEY_VOLUME_UP:
-				ESP_LOGI(TAG, "volume up key pressed");
-	        		printf("clearing cursor visual at old cursor position... %d, %d\n", ocx, ocy);
-  	        		pax_draw_line(buffer, 0xff000000, ocx, ocy, ocx, ocy + (console_instance.char_height - 1));
-                                con_conf.font_size_mult += 0.3;
-    				console_init(&console_instance, &con_conf);
-    				console_clear(&console_instance);
-				console_set_cursor(&console_instance, 0, 0);
-				cx = cy = ocx = ocy = 0;
-  	        		pax_draw_line(buffer, 0xff000000, ocx, ocy, ocx, ocy + (console_instance.char_height - 1));
-	                        console_instance.fg = 0xff00ff00;
-	                        console_instance.bg = 0x00000000;
-                                libssh2_channel_write(ssh_channel, CHR_NL, 1);
-                                display_blit_buffer(buffer);
-				break;
 			    case BSP_INPUT_NAVIGATION_KEY_VOLUME_DOWN:
-				ESP_LOGI(TAG, "volume down key pressed");
-	        		//printf("clearing cursor visual at old cursor position... %d, %d\n", ocx, ocy);
-  	        		pax_draw_line(buffer, 0xff000000, ocx, ocy, ocx, ocy + (console_instance.char_height - 1));
-                                con_conf.font_size_mult -= 0.3;
-    				console_init(&console_instance, &con_conf);
-    				console_clear(&console_instance);
-				console_set_cursor(&console_instance, 0, 0);
-				cx = cy = ocx = ocy = 0;
-  	        		pax_draw_line(buffer, 0xff000000, ocx, ocy, ocx, ocy + (console_instance.char_height - 1));
-	                        console_instance.fg = 0xff00ff00;
-	                        console_instance.bg = 0x00000000;
-                                libssh2_channel_write(ssh_channel, CHR_NL, 1);
-                                display_blit_buffer(buffer);
+				ESP_LOGI(TAG, "volume key pressed - changing font size");
+				float font_size_mult = con_conf.font_size_mult;
+				if (event.args_navigation.key == BSP_INPUT_NAVIGATION_KEY_VOLUME_UP) {
+				    font_size_mult += SSH_FONT_SIZE_STEP;
+				} else {
+				    font_size_mult -= SSH_FONT_SIZE_STEP;
+				}
+				if (ssh_set_font_size(font_size_mult)) {
+				    con_conf.font_size_mult = font_size_mult;
+				    full_blit = true;
+				    pty_resize = true;
+				}
 				break;
             		    case BSP_INPUT_NAVIGATION_KEY_BACKSPACE:
 				ESP_LOGI(TAG, "backspace key pressed");
-                                rc = libssh2_channel_write(ssh_channel, CHR_BS, 1);
+                                ssh_io_send(&ssh_io, CHR_BS, 1);
                                 break;
                             case BSP_INPUT_NAVIGATION_KEY_RETURN:
 				ESP_LOGI(TAG, "return key pressed");
-	        		//printf("clearing cursor visual at old cursor position... %d, %d\n", ocx, ocy);
-  	        		pax_draw_line(buffer, 0xff000000, ocx, ocy, ocx, ocy + (console_instance.char_height - 1));
-    				//ESP_LOGI(TAG, "redrawing background image");
-				// XXX this is too slow to do every time return is pressed
-				//pax_draw_image(buffer, &ssh_bg_pax_buf, 0, 0);
-                                libssh2_channel_write(ssh_channel, CHR_NL, 1);
+                                ssh_io_send(&ssh_io, CHR_NL, 1);
                                 break;
 			    // TODO: handle control key combinations
 			    // TODO: improve escape character processing so we can use vi, emacs etc
@@ -661,112 +956,112 @@ void util_ssh(pax_buf_t* buffer, gui_theme_t* theme, ssh_settings_t* settings) {
 		case INPUT_EVENT_TYPE_LAST:
 		    break;
 	    }
+	    if (event.type == INPUT_EVENT_TYPE_KEYBOARD || event.type == INPUT_EVENT_TYPE_NAVIGATION) {
+	        render_scheduler_input(&render_scheduler);
+	    }
         }
 
-	//ESP_LOGI(TAG, "check for server EOF");
-        if (libssh2_channel_eof(ssh_channel)) {
-            ESP_LOGI(TAG, "server sent EOF");
+	// libssh2 knows when the session was last used, it sends one only after a quiet interval
+	if (esp_timer_get_time() >= keepalive_us) {
+	    int next = ssh_io_keepalive(&ssh_io);
+	    keepalive_us = esp_timer_get_time() + (int64_t)(next > 0 ? next : settings->keepalive_interval) * 1000000;
+	}
+
+	// typing that was held back to share a packet goes out once its window is over
+	if (esp_timer_get_time() >= ssh_io_flush_us(&ssh_io)) {
+	    ssh_io_flush(&ssh_io);
+	}
+
+	// the channel is non-blocking, keep asking until the window change request is sent
+	if (pty_resize) {
+	    rc = ssh_io_pty_size(&ssh_io, console_instance.chars_x, console_instance.chars_y);
+	    if (rc != LIBSSH2_ERROR_EAGAIN) {
+	        pty_resize = false;
+	    }
+	}
+
+	// parse what the receive task has buffered since the last pass, escape sequences
+	// split over two chunks included. A pass stops at what was there when it started, so a
+	// flood still leaves room to render and read keys, the rest is parsed on the next pass.
+	size_t len;
+	char const* received;
+	size_t budget = ssh_io_pending(&ssh_io);
+	while (budget > 0 && (received = ssh_io_peek(&ssh_io, &len)) != NULL) {
+	    if (len > budget) {
+	        len = budget;
+	    }
+	    console_write(&console_instance, received, len);
+	    ssh_io_consume(&ssh_io, len);
+	    budget -= len;
+	    render_scheduler_output(&render_scheduler);
+	}
+
+	if (ssh_io_ended(&ssh_io)) {
+	    ESP_LOGI(TAG, "server sent EOF");
 	    goto shutdown;
-            break;
-        }
+	}
 
-        //ESP_LOGI(TAG, "read any data sent by server");
-        bzero(ssh_buffer, sizeof(ssh_buffer));
-        nbytes = libssh2_channel_read(ssh_channel, ssh_buffer, sizeof(ssh_buffer));
-        //if (nbytes < 0) {
-        //    ESP_LOGE(TAG, "unable to read response");
-        //    break;
-        //}
-
-	//ESP_LOGI(TAG, "display data sent by server");
-	if (nbytes > 0) {
-
-	    // Parse ANSI escape sequences
-	    char* p = ssh_buffer;
-	    while (p < ssh_buffer + nbytes) {
-	        if (*p == '\x1b' && p + 1 < ssh_buffer + nbytes && *(p+1) == '[') {
-	            // CSI sequence: ESC[
-	            p += 2;
-	            char seq[32] = {0};
-	            int i = 0;
-	            // Parse parameters
-	            while (p < ssh_buffer + nbytes && i < 31) {
-	                if ((*p >= '0' && *p <= '9') || *p == ';' || *p == '?') {
-	                    seq[i++] = *p++;
-	                } else {
-	                    break;
-	                }
-	            }
-	            if (p < ssh_buffer + nbytes) {
-	                char cmd = *p++;
-	                if (cmd == 'J' && strcmp(seq, "2") == 0) {
-	                    // Clear screen
-	                    console_clear(&console_instance);
-	                    pax_draw_rect(buffer, 0xff000000, 0, 0, 800, 480);
-	                    if (ssh_bg_pax_buf.width > 0) {
-	                        pax_draw_image(buffer, &ssh_bg_pax_buf, 0, 0);
-	                    }
-	                    console_set_cursor(&console_instance, 0, 0);
-	                    cx = cy = ocx = ocy = 0;
-	                } else if (cmd == 'H' || cmd == 'f') {
-	                    // Cursor position
-	                    int row = 1, col = 1;
-	                    if (seq[0]) sscanf(seq, "%d;%d", &row, &col);
-	                    console_set_cursor(&console_instance, col - 1, row - 1);
-	                } else {
-	                    // Pass through other sequences
-	                    char esc_seq[64];
-	                    snprintf(esc_seq, sizeof(esc_seq), "\x1b[%s%c", seq, cmd);
-	                    console_puts(&console_instance, esc_seq);
-	                }
-	            }
-	        } else if (*p == 0x08) {
-	            // Backspace: erase previous character and move cursor left
-	            ESP_LOGI(TAG, "Detected BS (0x08), erasing character and moving cursor left from x=%d", console_instance.cursor_x);
-	            if (console_instance.cursor_x > 0) {
-	                console_instance.cursor_x--;
-	                int erase_x = console_instance.char_width * console_instance.cursor_x;
-	                int erase_y = console_instance.char_height * console_instance.cursor_y;
-	                // Erase the character at the new cursor position
-	                pax_draw_rect(buffer, console_instance.bg,
-	                             erase_x, erase_y,
-	                             console_instance.char_width, console_instance.char_height);
-	            }
-	            p++;
-	        } else {
-	            console_put(&console_instance, *p++);
-	        }
+	// the console composites its own RGB565 copy of the background behind the text, scrolling
+	// and clears only touch the cells they change
+	if (ssh_bg_poll()) {
+	    console_set_background(&console_instance, &ssh_bg_pax_buf);
+	    pax_buf_destroy(&ssh_bg_pax_buf);
+	    full_blit = true;
+	}
+
+	// blink the cursor, the console draws it over its cell when rendering
+	int64_t now = esp_timer_get_time();
+	if (now >= cursor_blink_us) {
+	    cursor_blink_us = now + SSH_CURSOR_BLINK_US;
+	    cursor_blinked |= console_cursor_blink(&console_instance);
+	}
+
+	// draw once per frame, or straight away when this is the echo of a key press
+	bool render_due = render_scheduler_due(&render_scheduler);
+	if (render_due || cursor_blinked || view_moved || full_blit) {
+	    console_render(&console_instance);
+
+	    if (full_blit) {
+	        display_blit_buffer(buffer);
+	        console_get_damage(&console_instance, NULL, 0);
+	        full_blit = false;
+	    } else {
+	        // only what changed, the cursor cells included
+	        ssh_blit_damage(buffer);
 	    }
-	    
-	    // Draw cursor
-	    cx = console_instance.char_width * console_instance.cursor_x;
-	    cy = console_instance.char_height * console_instance.cursor_y;
-	    if (ocx != 0 || ocy != 0) {
-	        pax_draw_line(buffer, 0xff000000, ocx, ocy, ocx, ocy + (console_instance.char_height - 1));
+	    cursor_blinked = false;
+	    view_moved = false;
+	    if (render_due) {
+	        render_scheduler_rendered(&render_scheduler);
 	    }
-	    ocx = cx;
-	    ocy = cy;
-	    pax_draw_line(buffer, 0xffefefef, cx, cy, cx, cy + (console_instance.char_height - 1));
-	    
-            display_blit_buffer(buffer);
 	}
     }
  
     // closing the ssh connection and freeing resources
     // could be due to user action, or an error
  shutdown:
+    render_scheduler_log_stats(&render_scheduler);
+    ESP_LOGI(TAG, "loop woke %lu times in %lld ms", (unsigned long)wakeups,
+             (esp_timer_get_time() - session_start_us) / 1000);
+    ssh_io_stop(&ssh_io);
+ shutdown_wake:
+    // the menus read the input queue directly again
+    while (xQueueRemoveFromSet(input_event_queue, wake_set) != pdPASS) {
+        xQueueReceive(input_event_queue, &event, 0);
+    }
+    vQueueDelete(wake_set);
+ shutdown_connection:
     ESP_LOGI(TAG, "in shutdown, clearing the screen...");
     pax_draw_rect(buffer, 0xffefefef, 0, 0, 800, 480);
     display_blit_buffer(buffer);
     ESP_LOGI(TAG, "freeing memory...");
-    libssh2_channel_send_eof(ssh_channel);
-    libssh2_channel_close(ssh_channel);
-    libssh2_session_disconnect(ssh_session, "User closed session");
-    libssh2_channel_free(ssh_channel);
-    libssh2_knownhost_free(nh);
-    if (ssh_sock != LIBSSH2_INVALID_SOCKET) {
-        shutdown(ssh_sock, 2);
-        LIBSSH2_SOCKET_CLOSE(ssh_sock);
-    }
-    libssh2_exit();	
+    ssh_connect_close(&conn, conn.phase == SSH_CONNECT_DONE ? "User closed session" : conn.error);
+    if (nh) {
+        libssh2_knownhost_free(nh);
+        nh = NULL;
+    }
+    if (libssh2_ready) {
+        libssh2_exit();
+    }
+    console_deinit(&console_instance);
 }
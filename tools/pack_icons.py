@@ -0,0 +1,189 @@
+#!/usr/bin/env python3
+#
+# Packs the icons listed in main/icons.c into one pre-decoded atlas, so the
+# app doesn't have to decode a PNG per icon on the device. The build runs
+# this and links the result into the app, see main/CMakeLists.txt.
+#
+# The layout matches icons_atlas_header_t in main/icons.c: a 16 byte header,
+# one present byte per icon, then every icon as 32x32 ARGB8888 pixels the way
+# pax keeps them in memory (little endian 0xAARRGGBB). Icons that can't be
+# found are left out and decoded from their PNG on the device as before.
+#
+# Only the Python standard library is used, so this runs in the ESP-IDF
+# Python environment as is.
+#
+
+import argparse
+import os
+import re
+import struct
+import sys
+import zlib
+
+ICON_WIDTH = 32
+ICON_HEIGHT = 32
+ICON_BPP = 32
+ICON_BUFFER_SIZE = ICON_WIDTH * ICON_HEIGHT * 4
+ATLAS_MAGIC = b"ICNA"
+ATLAS_VERSION = 1
+
+PNG_SIGNATURE = b"\x89PNG\r\n\x1a\n"
+
+# Channels per pixel for the PNG color types
+PNG_CHANNELS = {0: 1, 2: 3, 3: 1, 4: 2, 6: 4}
+
+
+def icon_order(icons_h, icons_c):
+    """Icon names in icon_t order, and the /int path of each."""
+    with open(icons_h) as f:
+        enum = re.search(r"typedef enum \{(.*?)\} icon_t;", f.read(), re.S).group(1)
+    names = re.findall(r"\b(ICON_\w+)\b", enum)
+    names = names[: names.index("ICON_LAST")]
+
+    with open(icons_c) as f:
+        paths = dict(re.findall(r'\[(ICON_\w+)\]\s*=\s*"([^"]+)"', f.read()))
+    return [(name, paths.get(name)) for name in names]
+
+
+def paeth(a, b, c):
+    p = a + b - c
+    pa, pb, pc = abs(p - a), abs(p - b), abs(p - c)
+    if pa <= pb and pa <= pc:
+        return a
+    return b if pb <= pc else c
+
+
+def decode_png(path):
+    """Returns (width, height, rows of (r, g, b, a) tuples). 8 bit,
+    non-interlaced PNGs only, which is what the icons are."""
+    with open(path, "rb") as f:
+        data = f.read()
+    if not data.startswith(PNG_SIGNATURE):
+        raise ValueError("not a PNG")
+
+    pos = len(PNG_SIGNATURE)
+    idat = b""
+    palette = []
+    alpha = b""
+    while pos < len(data):
+        length, kind = struct.unpack(">I4s", data[pos : pos + 8])
+        chunk = data[pos + 8 : pos + 8 + length]
+        pos += 12 + length
+        if kind == b"IHDR":
+            width, height, depth, color, _, _, interlace = struct.unpack(">IIBBBBB", chunk)
+        elif kind == b"PLTE":
+            palette = [tuple(chunk[i : i + 3]) for i in range(0, len(chunk), 3)]
+        elif kind == b"tRNS":
+            alpha = chunk
+        elif kind == b"IDAT":
+            idat += chunk
+        elif kind == b"IEND":
+            break
+
+    if depth != 8 or interlace != 0 or color not in PNG_CHANNELS:
+        raise ValueError("unsupported PNG format (depth %d, color type %d)" % (depth, color))
+
+    channels = PNG_CHANNELS[color]
+    stride = width * channels
+    raw = zlib.decompress(idat)
+    prev = bytearray(stride)
+    rows = []
+    for y in range(height):
+        base = y * (stride + 1)
+        kind = raw[base]
+        line = bytearray(raw[base + 1 : base + 1 + stride])
+        for x in range(stride):
+            left = line[x - channels] if x >= channels else 0
+            up = prev[x]
+            corner = prev[x - channels] if x >= channels else 0
+            if kind == 1:
+                line[x] = (line[x] + left) & 0xFF
+            elif kind == 2:
+                line[x] = (line[x] + up) & 0xFF
+            elif kind == 3:
+                line[x] = (line[x] + ((left + up) >> 1)) & 0xFF
+            elif kind == 4:
+                line[x] = (line[x] + paeth(left, up, corner)) & 0xFF
+        prev = line
+
+        pixels = []
+        for x in range(width):
+            p = line[x * channels : (x + 1) * channels]
+            if color == 0:
+                pixels.append((p[0], p[0], p[0], 255))
+            elif color == 2:
+                pixels.append((p[0], p[1], p[2], 255))
+            elif color == 3:
+                r, g, b = palette[p[0]]
+                pixels.append((r, g, b, alpha[p[0]] if p[0] < len(alpha) else 255))
+            elif color == 4:
+                pixels.append((p[0], p[0], p[0], p[1]))
+            else:
+                pixels.append(tuple(p))
+        rows.append(pixels)
+
+    return width, height, rows
+
+
+def pack_icon(rows):
+    """Pixels as pax holds them in a 32x32 PAX_BUF_32_8888ARGB buffer. Bigger
+    images are cut off at the top left, like pax_insert_png_fd does."""
+    out = bytearray(ICON_BUFFER_SIZE)
+    for y, row in enumerate(rows[:ICON_HEIGHT]):
+        for x, (r, g, b, a) in enumerate(row[:ICON_WIDTH]):
+            struct.pack_into("<I", out, (y * ICON_WIDTH + x) * 4, (a << 24) | (r << 16) | (g << 8) | b)
+    return out
+
+
+def find_icon(sources, path):
+    relative = path[len("/int/icons/") :] if path.startswith("/int/icons/") else path
+    for source in sources:
+        candidate = os.path.join(source, relative)
+        if os.path.isfile(candidate):
+            return candidate
+    return None
+
+
+def main():
+    root = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+    parser = argparse.ArgumentParser(description="Packs the app icons into one pre-decoded atlas")
+    parser.add_argument(
+        "sources",
+        nargs="*",
+        default=[os.path.join(root, "fat", "tanmatsu", "icons")],
+        help="directories laid out like /int/icons, searched in order",
+    )
+    parser.add_argument("-o", "--output", required=True)
+    args = parser.parse_args()
+
+    icons = icon_order(os.path.join(root, "main", "icons.h"), os.path.join(root, "main", "icons.c"))
+    present = bytearray(len(icons))
+    pixels = bytearray(len(icons) * ICON_BUFFER_SIZE)
+
+    for index, (name, path) in enumerate(icons):
+        found = find_icon(args.sources, path) if path else None
+        if found is None:
+            print("%s: not found, left to the device" % name, file=sys.stderr)
+            continue
+        try:
+            _, _, rows = decode_png(found)
+        except ValueError as e:
+            print("%s: %s, left to the device" % (found, e), file=sys.stderr)
+            continue
+        pixels[index * ICON_BUFFER_SIZE : (index + 1) * ICON_BUFFER_SIZE] = pack_icon(rows)
+        present[index] = 1
+
+    if not any(present):
+        sys.exit("no icons found in %s" % ", ".join(args.sources))
+
+    header = struct.pack(
+        "<4sHHHHHH", ATLAS_MAGIC, ATLAS_VERSION, len(icons), ICON_WIDTH, ICON_HEIGHT, ICON_BPP, ICON_BUFFER_SIZE
+    )
+    with open(args.output, "wb") as f:
+        f.write(header + present + pixels)
+
+    print("%s: %d of %d icons" % (args.output, sum(present), len(icons)))
+
+
+if __name__ == "__main__":
+    main()